@@ -0,0 +1,19 @@
+#!/bin/bash
+# Run the scripted client checks of the socket server
+#
+# Builds aesdsocket with the file backend and scancheck, checks the packet
+# scanner, then runs server/clienttest.py in every connection mode. The
+# checks use port 9000 and /var/tmp/aesdsocketdata, so no other aesdsocket
+# may be running.
+set -e
+
+cd `dirname $0`/server
+make clean
+make USE_AESD_CHAR_DEVICE=0 all scancheck
+./scancheck
+
+rc=0
+for mode in "-m thread" "-m epoll -t 4" "-m pool -t 2" "-m uring" "-c -g"; do
+    python3 ./clienttest.py ./aesdsocket -- ${mode} || rc=1
+done
+exit ${rc}
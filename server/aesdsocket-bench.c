@@ -0,0 +1,694 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Comments:
+ *  Load generator for aesdsocket. It opens -c connections, split between -j
+ *  threads that each run an epoll loop, and every connection sends one
+ *  packet at a time and waits for it in the replay that follows. The latency
+ *  of a packet is the time from sending it to receiving its last byte in the
+ *  replay, that is everything the server sends before it; the rest of that
+ *  replay are packets appended after it and are read while the next packet
+ *  is on its way.
+ *
+ *  Packets are one line,
+ *      aesdbench <run>:<conn> <seq> <len> <fnv1a> <len bytes of payload>
+ *  so the contents of every replay are checked whoever sent them: each bench
+ *  line must have its length and checksum right and the only other lines
+ *  expected are the server's timestamps. Lines of other clients are counted
+ *  as foreign and aren't errors.
+ *
+ *  The size of the packets is fixed (-s 512), uniform (-s 64-4k) or
+ *  exponential (-s exp:1k, capped at 16 times the mean). Without -r every
+ *  connection sends its next packet as soon as it sees the last one (closed
+ *  loop); with -r the connections send that many packets per second in all
+ *  on a fixed schedule and the latency is measured from the scheduled time,
+ *  so a slow server isn't hidden by the bench sending less.
+ *
+ *  Both backends work: the file backend replays everything appended since the
+ *  server started, so its replays get longer as the bench runs (use the
+ *  server's -r to bound them). /dev/aesdchar only keeps the last ten writes,
+ *  so with more connections than that a packet can be pushed out before its
+ *  replay is read; -C counts those as lost instead of failing the run.
+ *
+ *  Build with `make aesdsocket-bench`, run with ./aesdsocket-bench -h for the
+ *  options. It exits with 1 if a replay was wrong or a packet never came back.
+ */
+
+#define BENCH_READ_LEN      (64 << 10)
+#define BENCH_HDR_MAX       96          // Longest bench line header
+#define BENCH_MAX_PACKET    (16 << 20)
+#define BENCH_MAGIC         "aesdbench "
+#define BENCH_MAGIC_LEN     (sizeof(BENCH_MAGIC) - 1)
+#define BENCH_TIMESTAMP     "timestamp:"
+
+enum bench_dist { DIST_FIXED, DIST_UNIFORM, DIST_EXP };
+
+static struct {
+    const char *host;
+    const char *port;
+    int nconns;
+    int nthreads;
+    double seconds;
+    uint64_t count;                 // Packets per connection, 0 for -d
+    enum bench_dist dist;
+    size_t size_min, size_max;      // Fixed uses min, exp uses min as mean
+    double rate;                    // Packets per second in all, 0 is closed loop
+    double timeout;
+    bool chardev;
+    unsigned run;                   // Tells this run's lines from others
+} bench = {
+    .host = "127.0.0.1",
+    .port = "9000",
+    .nconns = 16,
+    .nthreads = 0,
+    .seconds = 10,
+    .count = 0,
+    .dist = DIST_FIXED,
+    .size_min = 256,
+    .size_max = 256,
+    .rate = 0,
+    .timeout = 5,
+    .chardev = false
+};
+
+enum line_state {
+    LINE_HEAD,                      // Collecting the header
+    LINE_PAYLOAD,                   // Checksumming a bench line's payload
+    LINE_END,                       // Expecting the newline of a bench line
+    LINE_SKIP                       // Skipping to the next newline
+};
+
+struct bench_conn {
+    int fd;
+    unsigned id;
+    bool open;
+    bool waiting;                   // The packet seq was sent, not seen yet
+    uint64_t seq;
+    uint64_t due;                   // When to send the next packet
+    uint64_t sent;                  // When the packet in flight counts from
+    uint64_t started;               // When it was really sent, for -t
+    char *out;                      // The packet in flight
+    size_t outlen, outoff;
+    enum line_state state;          // Replay parser
+    char hdr[BENCH_HDR_MAX];
+    size_t hdrlen;
+    unsigned lrun, lconn;           // Fields of the line being parsed
+    uint64_t lseq;
+    size_t lleft;
+    uint32_t lsum, lhash;
+};
+
+struct bench_worker {
+    pthread_t thread;
+    int efd;
+    struct bench_conn *conns;
+    int nconns;
+    uint64_t rng;
+    uint64_t *lat;                  // Latencies in ns
+    size_t nlat, caplat;
+    uint64_t bytes_out, bytes_in;
+    uint64_t lines, timestamps, foreign, corrupt, lost, closed;
+};
+
+static uint64_t bench_start, bench_end;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_rand(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static uint32_t bench_fnv(uint32_t h, const char *p, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Parses a size with an optional k or m suffix.
+ * @returns 0 on success, -1 if s isn't one.
+ */
+static int bench_parsesize(const char *s, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if(errno || end == s) return -1;
+    if(*end == 'k' || *end == 'K') { v <<= 10; end++; }
+    else if(*end == 'm' || *end == 'M') { v <<= 20; end++; }
+    if(*end != '\0' || v == 0 || v > BENCH_MAX_PACKET) return -1;
+    *size = v;
+    return 0;
+}
+
+/* Parses the -s argument: N, MIN-MAX or exp:MEAN. */
+static int bench_parsedist(const char *s) {
+    char tmp[64];
+    if(strlen(s) >= sizeof(tmp)) return -1;
+    strcpy(tmp, s);
+    if(strncmp(tmp, "exp:", 4) == 0) {
+        bench.dist = DIST_EXP;
+        if(bench_parsesize(tmp + 4, &bench.size_min)) return -1;
+        bench.size_max = bench.size_min * 16;
+        if(bench.size_max > BENCH_MAX_PACKET) bench.size_max = BENCH_MAX_PACKET;
+        return 0;
+    }
+    char *dash = strchr(tmp, '-');
+    if(dash == NULL) {
+        bench.dist = DIST_FIXED;
+        if(bench_parsesize(tmp, &bench.size_min)) return -1;
+        bench.size_max = bench.size_min;
+        return 0;
+    }
+    *dash = '\0';
+    bench.dist = DIST_UNIFORM;
+    if(bench_parsesize(tmp, &bench.size_min) ||
+       bench_parsesize(dash + 1, &bench.size_max) ||
+       bench.size_max < bench.size_min)
+        return -1;
+    return 0;
+}
+
+static size_t bench_size(struct bench_worker *w) {
+    switch(bench.dist) {
+        case DIST_UNIFORM:
+            return bench.size_min +
+                   bench_rand(&w->rng) % (bench.size_max - bench.size_min + 1);
+        case DIST_EXP: {
+            double u = (bench_rand(&w->rng) >> 11) * 0x1.0p-53;
+            double s = -log1p(-u) * bench.size_min;
+            if(s < 1) s = 1;
+            if(s > bench.size_max) s = bench.size_max;
+            return (size_t)s;
+        }
+        default:
+            return bench.size_min;
+    }
+}
+
+/* Builds the next packet of c in c->out: the payload is written after room
+ * for the longest header, which is then put right in front of it. Packets
+ * shorter than their header come out as just the header and a newline.
+ */
+static void bench_packet(struct bench_worker *w, struct bench_conn *c) {
+    size_t size = bench_size(w);
+    char hdr[BENCH_HDR_MAX];
+    int hlen = snprintf(hdr, sizeof(hdr), BENCH_MAGIC "%x:%u %" PRIu64 " %zu "
+                        "%08x ", bench.run, c->id, c->seq, size, 0u);
+    size_t plen = (size > (size_t)hlen + 1) ? size - hlen - 1 : 0;
+
+    char *payload = c->out + BENCH_HDR_MAX;
+    uint64_t s = ((uint64_t)c->id << 32 | (c->seq & 0xffffffff)) * 0x9e3779b97f4a7c15ULL + 1;
+    for(size_t i = 0; i < plen; i++) {
+        if((i & 7) == 0) bench_rand(&s);
+        payload[i] = 'a' + ((s >> ((i & 7) * 8)) & 15);
+    }
+    payload[plen] = '\n';
+    uint32_t sum = bench_fnv(2166136261u, payload, plen);
+    hlen = snprintf(hdr, sizeof(hdr), BENCH_MAGIC "%x:%u %" PRIu64 " %zu "
+                    "%08x ", bench.run, c->id, c->seq, plen, sum);
+    c->outoff = BENCH_HDR_MAX - hlen;
+    memcpy(c->out + c->outoff, hdr, hlen);
+    c->outlen = BENCH_HDR_MAX + plen + 1;
+}
+
+static void bench_record(struct bench_worker *w, uint64_t ns) {
+    if(w->nlat == w->caplat) {
+        size_t cap = w->caplat ? w->caplat * 2 : 4096;
+        uint64_t *lat = realloc(w->lat, cap * sizeof(*lat));
+        if(lat == NULL) return;     // keep going, the sample is lost
+        w->lat = lat;
+        w->caplat = cap;
+    }
+    w->lat[w->nlat++] = ns;
+}
+
+static void bench_close(struct bench_worker *w, struct bench_conn *c) {
+    if(!c->open) return;
+    epoll_ctl(w->efd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->open = false;
+    c->waiting = false;
+}
+
+/* Sends what is left of the packet in flight.
+ * @returns 0 when it was all sent or the socket is full, -1 on error.
+ */
+static int bench_flush(struct bench_worker *w, struct bench_conn *c) {
+    while(c->outoff < c->outlen) {
+        ssize_t n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff,
+                         MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN) return -1;
+            struct epoll_event ev = {
+                .events = EPOLLIN|EPOLLOUT,
+                .data.ptr = c
+            };
+            return epoll_ctl(w->efd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+        c->outoff += n;
+        w->bytes_out += n;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    return epoll_ctl(w->efd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void bench_send(struct bench_worker *w, struct bench_conn *c,
+                       uint64_t now) {
+    c->seq++;
+    bench_packet(w, c);
+    c->waiting = true;
+    c->started = now;
+    c->sent = (bench.rate > 0) ? c->due : now;
+    if(bench.rate > 0)
+        c->due += (uint64_t)(bench.nconns / bench.rate * 1e9);
+    if(bench_flush(w, c)) {
+        w->closed++;
+        bench_close(w, c);
+    }
+}
+
+/* @returns whether c should send another packet. */
+static bool bench_more(struct bench_conn *c, uint64_t now) {
+    if(bench.count) return c->seq < bench.count;
+    return now < bench_end;
+}
+
+/* A bench line ended: check it and see if it's the one c is waiting for. */
+static void bench_line(struct bench_worker *w, struct bench_conn *c) {
+    if(c->lhash != c->lsum) {
+        w->corrupt++;
+        return;
+    }
+    w->lines++;
+    if(c->waiting && c->lrun == bench.run && c->lconn == c->id &&
+       c->lseq == c->seq) {
+        uint64_t now = bench_now();
+        bench_record(w, now - c->sent);
+        c->waiting = false;
+        if(bench.rate == 0) c->due = now;
+    }
+}
+
+/* The header of a bench line is complete: parse its fields. */
+static void bench_header(struct bench_worker *w, struct bench_conn *c) {
+    c->hdr[c->hdrlen] = '\0';
+    size_t len;
+    if(sscanf(c->hdr + BENCH_MAGIC_LEN, "%x:%u %" SCNu64 " %zu %x",
+              &c->lrun, &c->lconn, &c->lseq, &len, &c->lsum) != 5 ||
+       len > BENCH_MAX_PACKET) {
+        w->corrupt++;
+        c->state = LINE_SKIP;
+        return;
+    }
+    c->lleft = len;
+    c->lhash = 2166136261u;
+    c->state = len ? LINE_PAYLOAD : LINE_END;
+}
+
+/* Feeds n bytes of replay to the line parser of c. */
+static void bench_parse(struct bench_worker *w, struct bench_conn *c,
+                        const char *p, size_t n) {
+    while(n > 0) {
+        switch(c->state) {
+            case LINE_HEAD: {
+                char ch = *p++;
+                n--;
+                if(ch == '\n') {
+                    if(c->hdrlen >= BENCH_MAGIC_LEN) w->corrupt++;
+                    else w->foreign++;
+                    c->hdrlen = 0;
+                    break;
+                }
+                c->hdr[c->hdrlen++] = ch;
+                if(c->hdrlen == BENCH_MAGIC_LEN) {
+                    if(memcmp(c->hdr, BENCH_TIMESTAMP, BENCH_MAGIC_LEN) == 0) {
+                        w->timestamps++;
+                        c->state = LINE_SKIP;
+                    }
+                    else if(memcmp(c->hdr, BENCH_MAGIC, BENCH_MAGIC_LEN)) {
+                        w->foreign++;
+                        c->state = LINE_SKIP;
+                    }
+                }
+                else if(c->hdrlen > BENCH_MAGIC_LEN && ch == ' ') {
+                    // The payload starts after the fifth space
+                    int spaces = 0;
+                    for(size_t i = 0; i < c->hdrlen; i++)
+                        spaces += (c->hdr[i] == ' ');
+                    if(spaces == 5) bench_header(w, c);
+                }
+                if(c->state == LINE_HEAD && c->hdrlen == BENCH_HDR_MAX - 1) {
+                    w->corrupt++;
+                    c->state = LINE_SKIP;
+                }
+                if(c->state != LINE_HEAD) c->hdrlen = 0;
+                break;
+            }
+            case LINE_PAYLOAD: {
+                size_t k = (c->lleft < n) ? c->lleft : n;
+                const char *nl = memchr(p, '\n', k);
+                if(nl) {                // Cut short
+                    w->corrupt++;
+                    n -= nl + 1 - p;
+                    p = nl + 1;
+                    c->state = LINE_HEAD;
+                    break;
+                }
+                c->lhash = bench_fnv(c->lhash, p, k);
+                c->lleft -= k;
+                p += k;
+                n -= k;
+                if(c->lleft == 0) c->state = LINE_END;
+                break;
+            }
+            case LINE_END:
+                if(*p == '\n') {
+                    bench_line(w, c);
+                    c->state = LINE_HEAD;
+                }
+                else {
+                    w->corrupt++;
+                    c->state = LINE_SKIP;
+                }
+                p++;
+                n--;
+                break;
+            case LINE_SKIP: {
+                const char *nl = memchr(p, '\n', n);
+                if(nl == NULL) return;
+                n -= nl + 1 - p;
+                p = nl + 1;
+                c->state = LINE_HEAD;
+                break;
+            }
+        }
+    }
+}
+
+static void *bench_thread(void *thread_param) {
+    struct bench_worker *w = thread_param;
+    struct epoll_event evs[64];
+    char *buf = malloc(BENCH_READ_LEN);
+    if(buf == NULL) return NULL;
+    uint64_t timeout = (uint64_t)(bench.timeout * 1e9);
+
+    for(;;) {
+        uint64_t now = bench_now();
+        uint64_t wake = now + timeout;
+        int busy = 0;
+        for(int i = 0; i < w->nconns; i++) {
+            struct bench_conn *c = &w->conns[i];
+            if(!c->open) continue;
+            if(c->waiting && now - c->started > timeout) {
+                w->lost++;
+                c->waiting = false;
+            }
+            if(!c->waiting && bench_more(c, now) && c->due <= now)
+                bench_send(w, c, now);
+            if(!c->open) continue;
+            if(c->waiting) {
+                busy++;
+                if(c->started + timeout < wake) wake = c->started + timeout;
+            }
+            else if(bench_more(c, now)) {
+                busy++;
+                if(c->due < wake) wake = c->due;
+            }
+        }
+        if(busy == 0) break;
+
+        int ms = (wake > now) ? (int)((wake - now + 999999) / 1000000) : 0;
+        int nev = epoll_wait(w->efd, evs, 64, ms);
+        if(nev == -1) {
+            if(errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for(int i = 0; i < nev; i++) {
+            struct bench_conn *c = evs[i].data.ptr;
+            if(!c->open) continue;
+            if(evs[i].events & EPOLLOUT && bench_flush(w, c)) {
+                w->closed++;
+                bench_close(w, c);
+                continue;
+            }
+            if(evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+                ssize_t n = recv(c->fd, buf, BENCH_READ_LEN, 0);
+                if(n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+                    w->closed++;
+                    bench_close(w, c);
+                    continue;
+                }
+                if(n > 0) {
+                    w->bytes_in += n;
+                    bench_parse(w, c, buf, n);
+                }
+            }
+        }
+    }
+    free(buf);
+    for(int i = 0; i < w->nconns; i++)
+        bench_close(w, &w->conns[i]);
+    return NULL;
+}
+
+static int bench_connect(struct bench_conn *c) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    }, *res, *ai;
+    int r = getaddrinfo(bench.host, bench.port, &hints, &res);
+    if(r) {
+        fprintf(stderr, "%s:%s: %s\n", bench.host, bench.port, gai_strerror(r));
+        return -1;
+    }
+    c->fd = -1;
+    for(ai = res; ai != NULL; ai = ai->ai_next) {
+        c->fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC,
+                       ai->ai_protocol);
+        if(c->fd == -1) continue;
+        if(connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(c->fd);
+        c->fd = -1;
+    }
+    freeaddrinfo(res);
+    if(c->fd == -1) {
+        perror("connect");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    c->open = true;
+    return 0;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* @returns the latency at quantile q of the n sorted samples, in ms. */
+static double bench_quantile(const uint64_t *lat, size_t n, double q) {
+    if(n == 0) return 0;
+    size_t i = (size_t)ceil(q * n);
+    if(i > 0) i--;
+    if(i >= n) i = n - 1;
+    return lat[i] / 1e6;
+}
+
+static void bench_usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] "
+                    "[-j threads] [-d seconds | -n packets] [-s size] "
+                    "[-r rate] [-t timeout] [-C]\n", progname);
+    fprintf(stderr, "  -H  server address (default: 127.0.0.1)\n");
+    fprintf(stderr, "  -p  server port (default: 9000)\n");
+    fprintf(stderr, "  -c  concurrent connections (default: 16)\n");
+    fprintf(stderr, "  -j  threads driving them (default: one per core, at "
+                    "most one per connection)\n");
+    fprintf(stderr, "  -d  seconds to send for (default: 10)\n");
+    fprintf(stderr, "  -n  packets to send on each connection instead of -d\n");
+    fprintf(stderr, "  -s  packet size in bytes: N, MIN-MAX for uniform or "
+                    "exp:MEAN for exponential; k and m suffixes are accepted "
+                    "(default: 256)\n");
+    fprintf(stderr, "  -r  packets per second over all the connections "
+                    "(default: each sends when its last packet came back)\n");
+    fprintf(stderr, "  -t  seconds to wait for a packet in its replay before "
+                    "counting it lost (default: 5)\n");
+    fprintf(stderr, "  -C  the server uses /dev/aesdchar: lost packets are "
+                    "expected under load and aren't errors\n");
+}
+
+static int bench_options(int argc, char *argv[]) {
+    int c;
+    while((c = getopt(argc, argv, "H:p:c:j:d:n:s:r:t:Ch")) != -1) {
+        switch(c) {
+            case 'H': bench.host = optarg; break;
+            case 'p': bench.port = optarg; break;
+            case 'c':
+                bench.nconns = atoi(optarg);
+                if(bench.nconns < 1) return -1;
+                break;
+            case 'j':
+                bench.nthreads = atoi(optarg);
+                if(bench.nthreads < 1) return -1;
+                break;
+            case 'd':
+                bench.seconds = atof(optarg);
+                if(bench.seconds <= 0) return -1;
+                break;
+            case 'n':
+                bench.count = strtoull(optarg, NULL, 10);
+                if(bench.count == 0) return -1;
+                break;
+            case 's':
+                if(bench_parsedist(optarg)) return -1;
+                break;
+            case 'r':
+                bench.rate = atof(optarg);
+                if(bench.rate < 0) return -1;
+                break;
+            case 't':
+                bench.timeout = atof(optarg);
+                if(bench.timeout <= 0) return -1;
+                break;
+            case 'C': bench.chardev = true; break;
+            default: return -1;
+        }
+    }
+    if(optind != argc) return -1;
+    if(bench.nthreads == 0) {
+        long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+        bench.nthreads = (ncores < 1) ? 1 : (int)ncores;
+    }
+    if(bench.nthreads > bench.nconns) bench.nthreads = bench.nconns;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if(bench_options(argc, argv)) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+    bench.run = (unsigned)getpid() ^ (unsigned)bench_now();
+
+    struct bench_worker *workers = calloc(bench.nthreads, sizeof(*workers));
+    struct bench_conn *conns = calloc(bench.nconns, sizeof(*conns));
+    if(workers == NULL || conns == NULL) return 2;
+    for(int i = 0; i < bench.nconns; i++) {
+        conns[i].id = i;
+        conns[i].out = malloc(BENCH_HDR_MAX + bench.size_max + 1);
+        if(conns[i].out == NULL || bench_connect(&conns[i])) return 2;
+    }
+
+    bench_start = bench_now();
+    bench_end = bench_start + (uint64_t)(bench.seconds * 1e9);
+    for(int t = 0, first = 0; t < bench.nthreads; t++) {
+        struct bench_worker *w = &workers[t];
+        int n = bench.nconns / bench.nthreads + (t < bench.nconns % bench.nthreads);
+        w->conns = &conns[first];
+        w->nconns = n;
+        w->rng = 0x2545f4914f6cdd1dULL * (t + 1);
+        w->efd = epoll_create1(EPOLL_CLOEXEC);
+        if(w->efd == -1) {
+            perror("epoll_create1");
+            return 2;
+        }
+        for(int i = 0; i < n; i++) {
+            struct bench_conn *c = &w->conns[i];
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+            // Spread the first sends of -r over one interval
+            c->due = bench_start;
+            if(bench.rate > 0)
+                c->due += (uint64_t)(c->id / bench.rate * 1e9);
+            if(epoll_ctl(w->efd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+                perror("epoll_ctl");
+                return 2;
+            }
+        }
+        first += n;
+    }
+    for(int t = 0; t < bench.nthreads; t++) {
+        int r = pthread_create(&workers[t].thread, NULL, bench_thread,
+                               &workers[t]);
+        if(r) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(r));
+            return 2;
+        }
+    }
+
+    struct bench_worker sum = { .nlat = 0 };
+    size_t total = 0;
+    for(int t = 0; t < bench.nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        total += workers[t].nlat;
+    }
+    double elapsed = (bench_now() - bench_start) / 1e9;
+    sum.lat = malloc((total ? total : 1) * sizeof(*sum.lat));
+    if(sum.lat == NULL) return 2;
+    for(int t = 0; t < bench.nthreads; t++) {
+        struct bench_worker *w = &workers[t];
+        memcpy(sum.lat + sum.nlat, w->lat, w->nlat * sizeof(*w->lat));
+        sum.nlat += w->nlat;
+        sum.bytes_out += w->bytes_out;
+        sum.bytes_in += w->bytes_in;
+        sum.lines += w->lines;
+        sum.timestamps += w->timestamps;
+        sum.foreign += w->foreign;
+        sum.corrupt += w->corrupt;
+        sum.lost += w->lost;
+        sum.closed += w->closed;
+        close(w->efd);
+        free(w->lat);
+    }
+    qsort(sum.lat, sum.nlat, sizeof(*sum.lat), bench_cmp);
+
+    printf("%d connections, %zu packets in %.2f s: %.1f packets/s\n",
+           bench.nconns, sum.nlat, elapsed, sum.nlat / elapsed);
+    printf("sent %.1f MB (%.2f MB/s), received %.1f MB of replays "
+           "(%.2f MB/s)\n", sum.bytes_out / 1e6, sum.bytes_out / 1e6 / elapsed,
+           sum.bytes_in / 1e6, sum.bytes_in / 1e6 / elapsed);
+    printf("send to replay latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, "
+           "max %.3f ms\n", bench_quantile(sum.lat, sum.nlat, 0.5),
+           bench_quantile(sum.lat, sum.nlat, 0.99),
+           bench_quantile(sum.lat, sum.nlat, 0.999),
+           bench_quantile(sum.lat, sum.nlat, 1));
+    printf("replays: %" PRIu64 " packet lines checked, %" PRIu64 " timestamps, "
+           "%" PRIu64 " foreign, %" PRIu64 " corrupt; %" PRIu64 " packets "
+           "lost, %" PRIu64 " connections closed\n", sum.lines,
+           sum.timestamps, sum.foreign, sum.corrupt, sum.lost, sum.closed);
+
+    for(int i = 0; i < bench.nconns; i++)
+        free(conns[i].out);
+    free(conns);
+    free(workers);
+    free(sum.lat);
+    bool failed = sum.corrupt || sum.closed || (sum.lost && !bench.chardev);
+    return failed ? 1 : 0;
+}
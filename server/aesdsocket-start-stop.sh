@@ -1,16 +1,23 @@
 #! /bin/sh
 
+HANDOFF=/var/run/aesdsocket.handoff
+
 case "$1" in
   start)
     echo "Starting aesdsocket"
-    start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d
+    start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d -H $HANDOFF
     ;;
   stop)
     echo "Stopping aesdsocket"
     start-stop-daemon -K -n aesdsocket
     ;;
+  restart)
+    # The new server takes the socket and the data over from the running one
+    echo "Restarting aesdsocket"
+    /usr/bin/aesdsocket -d -H $HANDOFF
+    ;;
   *)
-    echo "Usage: $0 {start | stop}"
+    echo "Usage: $0 {start | stop | restart}"
   exit 1
   esac
 
@@ -1,5 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
-#define __DEBUG_MESSAGES 1
+#define _GNU_SOURCE
 
 #include <string.h>
 #include <stdbool.h>
@@ -19,14 +18,33 @@
 #include <pthread.h>
 #include <sys/queue.h>
 #include <inttypes.h>
-#include <sys/ioctl.h>
 
 #include "aesdsocket.h"
+#include "reactor.h"
+#include "pool.h"
+#include "uring.h"
+#include "cache.h"
+#include "writer.h"
+#include "shutdown.h"
+#include "scan.h"
+#include "shard.h"
+#include "tail.h"
+#include "pktidx.h"
+#include "seglog.h"
+#include "backend.h"
+#include "stats.h"
+#include "periodic.h"
+#include "handoff.h"
+#include "channel.h"
+#include "proto.h"
+#include "alog.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
-#define POLL_TIMEOUT_MS     20
 #define TIMESTAMP_MAX_SIZE  100
 #define TIMESTAMP_FMT       "timestamp:%a, %d %b %Y %T %z\n"
+#define TIMESTAMP_PERIOD_S  10
+#define RETAIN_PERIOD_MS    1000    // how often -a looks for old segments
+#define SYNC_PERIOD_MS      1000    // how often -f periodic flushes
 
 /* Comments:
  *  This server launches a thread dedicated to listening on the passive
@@ -38,54 +56,342 @@
  * 
  *  A global mutex makes sure the log file is only writen to by one thread at
  *  a time.
+ *
+ *  Alternatively (-m epoll), a small number of event-loop threads multiplex
+ *  all the client sockets with epoll. See reactor.c. With -m pool a fixed
+ *  set of worker threads takes the accepted connections from a bounded
+ *  queue, and puts the idle ones aside while others wait. See pool.c. With
+ *  -m uring the event loops do their socket I/O through io_uring, falling
+ *  back to -m epoll when the kernel can't. See uring.c.
+ *
+ *  With -l N the server opens N listening sockets on port 9000 with
+ *  SO_REUSEPORT and runs a whole server of the selected mode on each of them,
+ *  so accepting is spread over N threads as well. See shard.c.
+ *
+ *  A client that sends the AESDSOCKET_SUBSCRIBE packet gets the data file
+ *  once and from then on only what is appended to it, packets and
+ *  timestamps, instead of a whole replay after each of its packets. It can
+ *  still append, but any other request closes it: its reply would land in
+ *  the middle of the stream. See tail.c.
+ *
+ *  Clients can also ask for part of the data, a range of offsets or the last
+ *  packets, or talk a length-prefixed binary protocol on the same port. See
+ *  proto.c.
+ *
+ *  Replies are sent on non-blocking sockets. A handler waits for a full
+ *  socket to drain instead of blocking in send(), and stops reading that
+ *  client's packets meanwhile. With -o the clients that fall too far behind
+ *  are dropped. See outq.c.
+ *
+ *  With -s path the server counts connections, bytes, packets and the time
+ *  spent replaying, waiting for the data file mutex and writing timestamps,
+ *  and serves the numbers on a Unix socket. See stats.c.
+ *
+ *  The storage backend is chosen with -b: the segment files, the aesdchar
+ *  driver, segments kept in memory or mapped segment files. See backend.c.
+ *
+ *  With the file backend the data file is a segmented log: the path holds a
+ *  small manifest and the data goes to fixed-size segment files next to it.
+ *  With -r and -a the oldest segments are deleted once the data is over a
+ *  size or an age, and replays start at the oldest byte kept. See seglog.c.
+ *
+ *  Appends are not flushed to the disk unless -f asks for it: every second,
+ *  once per batch of the writer thread (group commit: one fdatasync() for
+ *  all the packets that arrived together, acknowledged together after it),
+ *  or after every packet. See writer.c.
+ *
+ *  The timestamps and the other jobs that run on a clock, like the age
+ *  retention of -a, share one timer thread instead of a thread each. See
+ *  periodic.c.
+ *
+ *  Messages are queued by the threads and written to syslog by a thread of
+ *  their own, and -L and ALOG_MAX_LEVEL filter them out before they cost
+ *  anything. See alog.c.
+ *
+ *  With -H path a new server can take over from a running one without
+ *  refusing a single connection: it receives the listening sockets over the
+ *  Unix socket at path, the old one stops accepting and finishes serving its
+ *  connections, then passes the data on, and the new one starts accepting
+ *  where the old one stopped. See handoff.c.
+ *
+ *  With -C the clients are split into named channels, one per port, each
+ *  served by a server process of its own with its own data, mutex and
+ *  timestamps, so unrelated producers don't wait on each other. See
+ *  channel.c.
+ *
+ *  No thread polls for the end of the server. SIGINT and SIGTERM arrive on a
+ *  signalfd and every blocking wait also watches the shutdown eventfd, so
+ *  idle threads sleep until there is work to do. See shutdown.c.
  *  
  */
 
-int main(int argc, char *argv[]) {
-    bool daemonize = false;
-    if(argc == 2) {
-        if(strcmp(argv[1],"-d") == 0) {
-            daemonize = true;
-        }
+struct socket_params aesd_netparams  = {
+    .port = "9000",
+    .ip = "0.0.0.0",                         // NULL will bind to all interfaces
+    .backlog = 100,
+    .ai = {
+        .ai_family = AF_INET,                // AF_UNSPEC for dual stack
+        .ai_socktype = SOCK_STREAM,           // | SOCK_NONBLOCK,
+        .ai_protocol = 0,
+        .ai_flags = AI_PASSIVE,
+        .ai_canonname = NULL,
+        .ai_addr = NULL,
+        .ai_addrlen = 0,
+        .ai_next = NULL
     }
+};
+// To bind to a specific interface use .ip = "127.0.0.1" for example.
+
+struct server_options aesd_opts = {
+    .daemonize = false,
+    .mode = SERVER_MODE_THREAD,
+    .nthreads = 0,
+    .qdepth = 64,
+    .listeners = 1,
+    .cache = false,
+    .writer = false,
+    .retain_bytes = 0,
+    .retain_secs = 0,
+    .outq_cap = 0,
+    .stats_path = NULL,
+    .durability = DURABILITY_NONE,
+    .handoff_path = NULL
+};
+
+volatile bool flag_accepting_connections = false;
+volatile int  last_signal_caught = 0;
+
+const char *datapath = NULL;            // backend->path, set by parseoptions()
+
+struct descriptors_t *server_descriptors;
+struct timestamp_t *timestamp_descriptors;
 
+int main(int argc, char *argv[]) {
     int r;
-    r = startserver(daemonize);  // opens syslog, socket, file
+    r = parseoptions(argc, argv, &aesd_opts);
+    if(r) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(channel_enabled()) {
+        int status;
+        r = channel_fork(&status);     // returns in each channel
+        if(r == -1) {return 1;}
+        if(r == 1) {return status;}
+    }
+
+    r = startserver(aesd_opts.daemonize);  // opens syslog, socket, file
     if(r) {return r;}
 
-    syslog(LOG_INFO, "Caught signal, exiting");
-    syslog(LOG_DEBUG, "Caught %s signal",strsignal(last_signal_caught));
+    if(handoff_done()) {
+        alog(LOG_INFO, "Handing over to the new server, exiting");
+    }
+    else {
+        alog(LOG_INFO, "Caught signal, exiting");
+        alog(LOG_DEBUG, "Caught %s signal",strsignal(last_signal_caught));
+    }
     r = stopserver();   // closes socket, file and syslog (and deletes file)
     return r;
 }
 
+int parseoptions(int argc, char *argv[], struct server_options *opts) {
+    int c;
+    while((c = getopt(argc, argv, "dm:t:q:l:r:a:o:s:L:b:f:H:C:cg")) != -1) {
+        switch(c) {
+            case 'd':
+                opts->daemonize = true;
+                break;
+            case 'c':
+                opts->cache = true;
+                break;
+            case 'g':
+                opts->writer = true;
+                break;
+            case 'm':
+                if(strcmp(optarg, "thread") == 0)
+                    opts->mode = SERVER_MODE_THREAD;
+                else if(strcmp(optarg, "epoll") == 0)
+                    opts->mode = SERVER_MODE_EPOLL;
+                else if(strcmp(optarg, "pool") == 0)
+                    opts->mode = SERVER_MODE_POOL;
+                else if(strcmp(optarg, "uring") == 0)
+                    opts->mode = SERVER_MODE_URING;
+                else
+                    return -1;
+                break;
+            case 't':
+                opts->nthreads = atoi(optarg);
+                if(opts->nthreads < 0) return -1;
+                break;
+            case 'q':
+                opts->qdepth = atoi(optarg);
+                if(opts->qdepth < 1) return -1;
+                break;
+            case 'l':
+                opts->listeners = atoi(optarg);
+                if(opts->listeners < 0) return -1;
+                break;
+            case 'r':
+                if(parsesize(optarg, &opts->retain_bytes)) return -1;
+                break;
+            case 'a':
+                opts->retain_secs = atol(optarg);
+                if(opts->retain_secs < 0) return -1;
+                break;
+            case 'o':
+                if(parsesize(optarg, &opts->outq_cap)) return -1;
+                break;
+            case 's':
+                opts->stats_path = optarg;
+                break;
+            case 'H':
+                opts->handoff_path = optarg;
+                break;
+            case 'C':
+                if(channel_parse(optarg)) return -1;
+                break;
+            case 'L':
+                alog_level = alog_parselevel(optarg);
+                if(alog_level == -1) return -1;
+                break;
+            case 'b':
+                if(backend_select(optarg)) return -1;
+                break;
+            case 'f':
+                if(strcmp(optarg, "none") == 0)
+                    opts->durability = DURABILITY_NONE;
+                else if(strcmp(optarg, "periodic") == 0)
+                    opts->durability = DURABILITY_PERIODIC;
+                else if(strcmp(optarg, "batch") == 0)
+                    opts->durability = DURABILITY_BATCH;
+                else if(strcmp(optarg, "packet") == 0)
+                    opts->durability = DURABILITY_PACKET;
+                else
+                    return -1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    if(optind != argc) return -1;
+    datapath = backend->path;
+    if(opts->durability == DURABILITY_BATCH)
+        opts->writer = true;    // the batches are the writer's
+    long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncores < 1) ncores = 1;
+    if(opts->nthreads == 0) {
+        opts->nthreads = (int)ncores;
+    }
+    if(opts->listeners == 0) {
+        opts->listeners = (int)ncores;
+    }
+    return 0;
+}
+
+void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-d] [-c] [-g] [-m thread|epoll|pool|uring] "
+                    "[-t threads] [-q depth] [-l listeners] [-r bytes] [-a seconds] "
+                    "[-o bytes] [-s path] [-L level] [-b file|char|mem|mmap]\n"
+                    "       [-f none|periodic|batch|packet] [-H path] "
+                    "[-C name,...]\n",
+                    progname);
+    fprintf(stderr, "  -d  run as a daemon\n");
+    fprintf(stderr, "  -c  serve replays from a shared in-memory image of the "
+                    "data file\n");
+    fprintf(stderr, "  -g  append through a single writer thread that batches "
+                    "packets (group commit)\n");
+    fprintf(stderr, "  -m  connection handling mode (default: thread)\n");
+    fprintf(stderr, "  -t  number of event-loop threads for -m epoll and -m "
+                    "uring, or worker threads for -m pool (default: one per "
+                    "core)\n");
+    fprintf(stderr, "  -q  accepted connections queued for a worker in -m pool "
+                    "(default: 64)\n");
+    fprintf(stderr, "  -l  listening sockets sharing the port with SO_REUSEPORT, "
+                    "each with its own accept loop and handlers; the threads "
+                    "of -t are split between them (default: 1, 0 is one per "
+                    "core)\n");
+    fprintf(stderr, "  -r  delete the oldest data, keeping at least this many "
+                    "of the newest bytes; k, m and g suffixes are accepted "
+                    "(default: keep everything)\n");
+    fprintf(stderr, "  -a  delete the data not appended to for this many "
+                    "seconds (default: keep everything)\n");
+    fprintf(stderr, "  -o  drop the clients that fall further than this many "
+                    "bytes behind the end of the data file while they don't "
+                    "read; k, m and g suffixes are accepted (default: no "
+                    "limit)\n");
+    fprintf(stderr, "  -s  serve counters and latency histograms in the "
+                    "Prometheus text format on a Unix socket at path\n");
+    fprintf(stderr, "  -L  least important messages logged: err, warning, "
+                    "notice, info or debug (default: debug)\n");
+    fprintf(stderr, "  -b  storage backend: segment files in /var/tmp, the "
+                    "aesdchar driver, segments in memory, or segment files "
+                    "in /var/tmp preallocated and mapped (default: %s)\n",
+                    USE_AESD_CHAR_DEVICE ? "char" : "file");
+    fprintf(stderr, "  -f  when appends are flushed to the disk: never, every "
+                    "second, once per batch of the writer thread before its "
+                    "replies (implies -g), or after every packet (default: "
+                    "none)\n");
+    fprintf(stderr, "  -H  take over from the server listening for handoffs on "
+                    "the Unix socket at path, if there is one, and listen "
+                    "there for the next one\n");
+    fprintf(stderr, "  -C  run an independent server per named channel, the "
+                    "first on port 9000 and the next ones on the following "
+                    "ports, each with its own data (path-name) and the -s "
+                    "and -H paths suffixed with -name\n");
+}
+
 int startserver(bool daemonize) {
     int r;
     openlog("aesdsocket", LOG_CONS|LOG_PERROR|LOG_PID, LOG_USER);
 
-    syslog(LOG_DEBUG, "using data file %s", datapath);
-    if(!USE_AESD_CHAR_DEVICE) {
-        syslog(LOG_DEBUG, "creating data file %s", datapath);
+    alog(LOG_DEBUG, "using the %s backend, data file %s", backend->name,
+         datapath);
+    int nsfds = 0;
+    int *sfds = NULL;
+    bool took_over = false;
+    if(aesd_opts.handoff_path) {
+        // Before createdatafile(), which would delete the data we take over
+        r = handoff_connect(aesd_opts.handoff_path, &sfds, &nsfds);
+        if(r == -1) {
+            log_errno("main(): handoff_connect()");
+            return 1;
+        }
+        if(r == 1) {
+            took_over = (handoff_takeover(datapath) == 0);
+            if(!took_over)
+                alog(LOG_ERR, "could not take the data over, starting with "
+                              "empty data");
+        }
+    }
+    if(!took_over) {
         r = createdatafile();
         if(r) {
-            log_errno("main(): initializedatafile()");
-            syslog(LOG_ERR, "the return value was %i", r);
+            log_errno("main(): createdatafile()");
             return 1;
         }
     }
-    else {
-        syslog(LOG_DEBUG, "Skipping creation of data file");
-    }
 
-    syslog(LOG_DEBUG, "opening socket %s:%s", aesd_netparams.ip, aesd_netparams.port);
-    int sfd = opensocket();
-    if( sfd == -1 ) {
-        log_errno("main(): opensocket()");
-        return 1;
+    if(sfds == NULL) {
+        alog(LOG_DEBUG, "opening socket %s:%s", aesd_netparams.ip,
+             aesd_netparams.port);
+        nsfds = aesd_opts.listeners;
+        sfds = malloc(nsfds * sizeof(int));
+        if(sfds == NULL) {
+            log_errno("main(): malloc()");
+            return 1;
+        }
+        for(int i = 0; i < nsfds; i++) {
+            sfds[i] = opensocket(nsfds > 1);
+            if( sfds[i] == -1 ) {
+                log_errno("main(): opensocket()");
+                return 1;
+            }
+        }
     }
 
     if(daemonize) {
-        syslog(LOG_DEBUG,"Starting daemon");
+        alog(LOG_DEBUG,"Starting daemon");
         pid_t pid;
         pid = fork();
         if (pid < 0) {
@@ -93,30 +399,102 @@ int startserver(bool daemonize) {
             return 1;
         }
         else if(pid > 0) {
-            syslog(LOG_INFO,"Daemon PID: %ld",(long)pid);
+            alog(LOG_INFO,"Daemon PID: %ld",(long)pid);
             exit(EXIT_SUCCESS);
         }
     }
 
     struct sigaction signal_action;
     memset(&signal_action,0,sizeof(struct sigaction));
-    signal_action.sa_handler = signal_handler;
-    r  =  sigaction(SIGINT, &signal_action, NULL);
-    r |= sigaction(SIGTERM, &signal_action, NULL);
+    // sendfile() and splice() can't take MSG_NOSIGNAL; a client closing
+    // during a replay must not kill the server.
+    signal_action.sa_handler = SIG_IGN;
+    r = sigaction(SIGPIPE, &signal_action, NULL);
     if(r) {
         log_errno("main(): sigaction()");
         return 1;
     }
 
+    scan_init(AESD_SOCKET_IOC_STRING ":");
+
+    // Before any other thread starts, so they all inherit the signal mask
+    flag_accepting_connections = true;
+    r = shutdown_init();
+    if(r) {
+        log_errno("main(): shutdown_init()");
+        return 1;
+    }
+
+    r = alog_start();
+    if(r) {
+        log_errno("main(): alog_start()");
+        return 1;
+    }
+
+    // Where the appends start: 0, unless the data was taken over
+    off_t end = backend->follows_appends ? datasize() : 0;
+    if(end == -1) {
+        log_errno("main(): datasize()");
+        return 1;
+    }
+
+    if(aesd_opts.cache) {
+        alog(LOG_DEBUG, "enabling replay cache");
+        r = cache_init(backend->follows_appends, end);
+        if(r) {
+            log_errno("main(): cache_init()");
+            return 1;
+        }
+    }
+
+    r = tail_init(end);
+    if(r) {
+        log_errno("main(): tail_init()");
+        return 1;
+    }
+    r = pktidx_init(end);
+    if(r) {
+        log_errno("main(): pktidx_init()");
+        return 1;
+    }
+    outq_init(aesd_opts.outq_cap);
+
+    if(aesd_opts.stats_path) {
+        r = stats_start(aesd_opts.stats_path);
+        if(r) {
+            log_errno("main(): stats_start()");
+            return 1;
+        }
+    }
+
+    if(aesd_opts.handoff_path) {
+        r = handoff_start(aesd_opts.handoff_path, sfds, nsfds);
+        if(r) {
+            log_errno("main(): handoff_start()");
+            return 1;
+        }
+    }
+
     server_descriptors = 
         (struct descriptors_t *) malloc(sizeof(struct descriptors_t));
     server_descriptors->mutex = malloc(sizeof(pthread_mutex_t));
     //server_descriptors->dfd = dfd;
-    server_descriptors->sfd = sfd;
+    server_descriptors->sfd = sfds[0];
+    server_descriptors->sfds = sfds;
+    server_descriptors->nsfds = nsfds;
     pthread_mutex_init(server_descriptors->mutex, PTHREAD_MUTEX_NORMAL);
 
-    if(!USE_AESD_CHAR_DEVICE) {
-        syslog(LOG_DEBUG, "opening data file for timestamping %s", datapath);
+    if(aesd_opts.writer) {
+        alog(LOG_DEBUG, "starting writer thread");
+        r = writer_start();
+        if(r) {
+            log_errno("main(): writer_start()");
+            return 1;
+        }
+    }
+
+    if(backend->timestamps) {
+        alog(LOG_DEBUG, "opening data file for timestamping %s", datapath);
         int dfd = opendatafile();
         if( dfd == -1 ) {
             log_errno("main(): opendatafile()");
@@ -127,126 +505,200 @@ int startserver(bool daemonize) {
         timestamp_descriptors->dfd = dfd;
         timestamp_descriptors->dfdmutex = server_descriptors->mutex;
 
-        syslog(LOG_DEBUG,"Ordering start timestamp");
-        r = pthread_create(&timestamp_descriptors->thread, NULL, timestampthread, timestamp_descriptors);
+        alog(LOG_DEBUG,"Ordering start timestamp");
+        r = periodic_add(TIMESTAMP_PERIOD_S * 1000, timestamptask,
+                         timestamp_descriptors);
+        if(!r && aesd_opts.retain_secs)
+            r = periodic_add(RETAIN_PERIOD_MS, retaintask, NULL);
         if(r) {
-            perror("startlistenthread(): pthread_create()");
-            return -1;
+            log_errno("main(): periodic_add()");
+            return 1;
         }
     }
     else {
-        syslog(LOG_DEBUG,"Skipping start of timestamp thread");
+        alog(LOG_DEBUG,"Skipping start of timestamp task");
+    }
+    if(aesd_opts.durability == DURABILITY_PERIODIC) {
+        r = periodic_add(SYNC_PERIOD_MS, synctask, NULL);
+        if(r) {
+            log_errno("main(): periodic_add()");
+            return 1;
+        }
+    }
+    r = periodic_start();
+    if(r) {
+        log_errno("main(): periodic_start()");
+        return 1;
     }
 
-    syslog(LOG_DEBUG,"Ordering start of listenfunc");
+    if(aesd_opts.mode == SERVER_MODE_URING && !uring_supported()) {
+        alog(LOG_WARNING, "io_uring not usable (%m), falling back to epoll");
+        aesd_opts.mode = SERVER_MODE_EPOLL;
+    }
 
-    r = listenfunc( server_descriptors->sfd, 
-                    server_descriptors->mutex);
+    if(server_descriptors->nsfds > 1) {
+        int per_shard = aesd_opts.nthreads / server_descriptors->nsfds;
+        alog(LOG_DEBUG,"Ordering start of %i shards", server_descriptors->nsfds);
+        r = shard_run(server_descriptors->sfds, server_descriptors->nsfds,
+                      server_descriptors->mutex,
+                      per_shard > 0 ? per_shard : 1);
+        if(r) {
+            log_errno("main(): shard_run()");
+            return 1;
+        }
+        return 0;
+    }
+
+    r = runserver(server_descriptors->sfd, server_descriptors->mutex,
+                  aesd_opts.nthreads);
     if(r) {
-        log_errno("main(): startlistenthread()");
         return 1;
     }
     return 0;
 }
 
-int stopserver() {
+/* Serves the connections of the listening socket sfd in the selected mode,
+ * until the server stops.
+ * @param nthreads is the number of event loops or workers, for the modes
+ * that have them.
+ * @returns 0 on success, -1 on error.
+ */
+int runserver(int sfd, pthread_mutex_t *dfdmutex, int nthreads) {
     int r;
-    if(!USE_AESD_CHAR_DEVICE) {
-        syslog(LOG_DEBUG, "sending SIGTERM to timestampthread");
-        pthread_kill(timestamp_descriptors->thread, SIGINT);
-        syslog(LOG_DEBUG, "waiting for timestamp thread to exit");
-        r = pthread_join(timestamp_descriptors->thread, NULL);
+    if(aesd_opts.mode == SERVER_MODE_URING) {
+        alog(LOG_DEBUG,"Ordering start of %i io_uring loops", nthreads);
+        r = uring_run(sfd, dfdmutex, nthreads);
+        if(r) {
+            log_errno("main(): uring_run()");
+            return -1;
+        }
+        return 0;
     }
-    else {
-        syslog(LOG_DEBUG, "Skipping stop of timestamp thread");
+
+    if(aesd_opts.mode == SERVER_MODE_EPOLL) {
+        alog(LOG_DEBUG,"Ordering start of %i event loops", nthreads);
+        r = reactor_run(sfd, dfdmutex, nthreads);
+        if(r) {
+            log_errno("main(): reactor_run()");
+            return -1;
+        }
+        return 0;
+    }
+
+    if(aesd_opts.mode == SERVER_MODE_POOL) {
+        alog(LOG_DEBUG,"Ordering start of %i workers", nthreads);
+        r = pool_run(sfd, dfdmutex, nthreads, aesd_opts.qdepth);
+        if(r) {
+            log_errno("main(): pool_run()");
+            return -1;
+        }
+        return 0;
     }
+
+    alog(LOG_DEBUG,"Ordering start of listenfunc");
+
+    r = listenfunc(sfd, dfdmutex);
+    if(r) {
+        log_errno("main(): listenfunc()");
+        return -1;
+    }
+    return 0;
+}
+
+int stopserver() {
+    int r;
+    shutdown_request(0);
+    alog(LOG_DEBUG, "stopping periodic tasks");
+    periodic_stop();
+    if(backend->timestamps) {
+        closedatafile(timestamp_descriptors->dfd);
+        free(timestamp_descriptors);
+    }
+    alog(LOG_DEBUG, "stopping writer thread");
+    writer_stop();
+    stats_stop();
+    handoff_stop();
+    shutdown_destroy();
     pthread_mutex_destroy(server_descriptors->mutex);
-    syslog(LOG_DEBUG, "closing socket %s:%s", aesd_netparams.ip, aesd_netparams.port);
-    r = closesocket(server_descriptors->sfd);
-    if(r) {return 1;}
-    if(!USE_AESD_CHAR_DEVICE) {
-        syslog(LOG_DEBUG, "deleting data file %s", datapath);
-        r = deletedatafile();        
+    alog(LOG_DEBUG, "closing socket %s:%s", aesd_netparams.ip, aesd_netparams.port);
+    for(int i = 0; i < server_descriptors->nsfds; i++) {
+        // shutdown() would stop the listening socket the new server uses
+        if(handoff_done())
+            r = robustclose(server_descriptors->sfds[i]);
+        else
+            r = closesocket(server_descriptors->sfds[i]);
         if(r) {return 1;}
     }
+    if(handoff_done()) {
+        alog(LOG_DEBUG, "handing %s data %s over", backend->name, datapath);
+        r = handoff_finish();
+    }
     else {
-        syslog(LOG_DEBUG, "Skipping deletion of data file");
+        alog(LOG_DEBUG, "closing %s data %s", backend->name, datapath);
+        r = deletedatafile();
     }
-    syslog(LOG_DEBUG, "freeing global mallocs");
+    if(r) {return 1;}
+    alog(LOG_DEBUG, "freeing global mallocs");
+    cache_destroy();
+    tail_destroy();
+    pktidx_destroy();
     pthread_mutex_destroy(server_descriptors->mutex);
     free(server_descriptors->mutex);
+    free(server_descriptors->sfds);
     free(server_descriptors);
-    syslog(LOG_DEBUG, "server stopped");
+    alog(LOG_DEBUG, "server stopped");
+    alog_stop();
     closelog();
     return 0;
 }
 
-void *listenthread(void *thread_param) {
-    struct descriptors_t *desc = (struct descriptors_t *)thread_param;
-    int sfd = desc->sfd;
-    pthread_mutex_t *dfdmutex = desc->mutex;
-    syslog(LOG_DEBUG,"listenthread is alive");
-    listenfunc(sfd, dfdmutex);   //it's nice getting out of pointer-land, mostly
-    return thread_param;
-}
-
 int listenfunc(int sfd, pthread_mutex_t *dfdmutex) {
     int r;
-    syslog(LOG_DEBUG, "acceptconnection sfd = %i",sfd);
-    flag_accepting_connections = true;
+    alog(LOG_DEBUG, "acceptconnection sfd = %i",sfd);
     int rsfd;   //receiving socket-file-descriptor
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
 
-    TAILQ_HEAD(head_s, append_t) append_head;
+    // append_head holds the running threads, free_head the finished ones
+    // whose append_t (buffer and data file descriptor) can be reused.
+    struct append_head_t append_head, free_head;
     TAILQ_INIT(&append_head);
+    TAILQ_INIT(&free_head);
     struct append_t * append_inst = NULL;
 
-    struct pollfd sfd_poll = { 
-        .fd = sfd, 
-        .events  = POLLIN|POLLPRI, 
-        .revents = 0
-    };
+    while(flag_accepting_connections && !shutdown_draining()) {
 
-    while(flag_accepting_connections) {
+        reapappendthreads(&append_head, &free_head);
 
-        poll(&sfd_poll,1,POLL_TIMEOUT_MS);
-        if(!(sfd_poll.revents&(POLLIN|POLLPRI)))
-            continue;
-        rsfd = accept(sfd,(struct sockaddr *)&client_addr,&client_addr_len);
+        rsfd = acceptconnection(sfd);
         if(rsfd == -1) {
-            log_errno("listenfunc(): accept()");
+            if(errno == EAGAIN) continue;
+            log_errno("listenfunc(): acceptconnection()");
             goto errorcleanup;
         }
 
-        #ifdef __DEBUG_MESSAGES
-            char hoststr[NI_MAXHOST];
-            char portstr[NI_MAXSERV];
-            if (getnameinfo((struct sockaddr *)&client_addr, client_addr_len,
-                            hoststr, sizeof(hoststr), portstr, sizeof(portstr),
-                            NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
-                syslog(LOG_INFO,"Incoming connection from %s port %s", hoststr, portstr);
+        append_inst = TAILQ_FIRST(&free_head);
+        if(append_inst != NULL) {
+            TAILQ_REMOVE(&free_head, append_inst, nodes);
+        }
+        else {
+            append_inst = allocappend(dfdmutex);
+            if(append_inst == NULL) {
+                log_errno("listenfunc(): allocappend()");
+                closesocket(rsfd);
+                goto errorcleanup;
             }
-            syslog(LOG_DEBUG,"Opened new rsfd descriptor # %i",rsfd);
-        #endif
-
-        append_inst = NULL;
-        append_inst = malloc(sizeof(struct append_t));
-        if(append_inst == NULL) {
-            log_errno("listenfunc(): malloc()");
-            goto errorcleanup;
         }
 
         append_inst->rsfd = rsfd;
-        append_inst->dfdmutex = dfdmutex;
+        append_inst->done = false;
         r = pthread_create(&append_inst->thread, NULL, appenddatathread, append_inst);
-        TAILQ_INSERT_TAIL(&append_head,append_inst,nodes);
-
         if(r) {
-            log_errno("listenfunc(): appenddata()");
-            robustclose(rsfd);
+            errno = r;
+            log_errno("listenfunc(): pthread_create()");
+            closesocket(rsfd);
+            freeappend(append_inst);
             goto errorcleanup;
         }
+        TAILQ_INSERT_TAIL(&append_head,append_inst,nodes);
     }
 
     r = 0;
@@ -254,169 +706,413 @@ int listenfunc(int sfd, pthread_mutex_t *dfdmutex) {
     TAILQ_FOREACH(append_inst, &append_head, nodes) {
         pthread_join(append_inst->thread,NULL);
     }
-    while(!TAILQ_EMPTY(&append_head))
+    TAILQ_CONCAT(&free_head, &append_head, nodes);
+    while(!TAILQ_EMPTY(&free_head))
     {
-        append_inst = TAILQ_FIRST(&append_head);
-        TAILQ_REMOVE(&append_head, append_inst, nodes);
-        free(append_inst);
+        append_inst = TAILQ_FIRST(&free_head);
+        TAILQ_REMOVE(&free_head, append_inst, nodes);
+        freeappend(append_inst);
         append_inst = NULL;
     }
     return r;
 }
 
-int startlistenthread(pthread_t *thread, struct descriptors_t *descriptors) {
-    int r;
-    if(descriptors == NULL) {
-        perror("startlistenthread(): malloc()");
+/* Waits for a connection on the listening socket sfd and accepts it.
+ * @returns The receiving socket file descriptor, or -1 on error. When the
+ * server is shutting down or draining (or the connection went away before
+ * accept()), -1 is returned and errno is EAGAIN.
+ */
+int acceptconnection(int sfd) {
+    int rsfd;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    struct pollfd fds[2] = {
+        { .fd = sfd, .events = POLLIN },
+        { .fd = shutdown_drain_fd(), .events = POLLIN }
+    };
+    int w = shutdown_poll(fds, 2);
+    if(w != 1 || fds[1].revents) {
+        if(w != -1) errno = EAGAIN;
         return -1;
     }
-    syslog(LOG_DEBUG, "startlistenthread sfd = %i; dfd = %i",descriptors->sfd,descriptors->dfd);
-    r = pthread_create(thread, NULL, listenthread, descriptors);
-    if(r) {
-        perror("startlistenthread(): pthread_create()");
+    rsfd = accept(sfd,(struct sockaddr *)&client_addr,&client_addr_len);
+    if(rsfd == -1) {
+        if(errno == EINTR || errno == ECONNABORTED) errno = EAGAIN;
         return -1;
     }
-    return 0;
+    stats_add(STATS_ACCEPTED, 1);
+
+    if(alog_enabled(LOG_INFO)) {
+        char hoststr[NI_MAXHOST];
+        char portstr[NI_MAXSERV];
+        if (getnameinfo((struct sockaddr *)&client_addr, client_addr_len,
+                        hoststr, sizeof(hoststr), portstr, sizeof(portstr),
+                        NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            alog(LOG_INFO,"Incoming connection from %s port %s", hoststr, portstr);
+        }
+    }
+    alog(LOG_DEBUG,"Opened new rsfd descriptor # %i",rsfd);
+    return rsfd;
+}
+
+/* Joins the threads in running that have finished their connection and moves
+ * their append_t to finished, where listenfunc() picks them up for reuse.
+ */
+void reapappendthreads(struct append_head_t *running,
+                       struct append_head_t *finished) {
+    struct append_t *a = TAILQ_FIRST(running);
+    while(a != NULL) {
+        struct append_t *next = TAILQ_NEXT(a, nodes);
+        if(a->done) {
+            pthread_join(a->thread, NULL);
+            TAILQ_REMOVE(running, a, nodes);
+            TAILQ_INSERT_TAIL(finished, a, nodes);
+        }
+        a = next;
+    }
+}
+
+/* Allocates the per-connection state: the receive and replay buffers and a
+ * data file descriptor. They are kept across connections when the append_t is
+ * reused.
+ * @returns The new append_t, or NULL on error.
+ */
+struct append_t *allocappend(pthread_mutex_t *dfdmutex) {
+    struct append_t *a = malloc(sizeof(struct append_t));
+    if(a == NULL) return NULL;
+    a->dfdmutex = dfdmutex;
+    a->rsfd = -1;
+    a->ret = 0;
+    a->done = false;
+    a->subscribed = false;
+    a->tail_blocked = false;
+    a->replaying = false;
+    a->yieldfd = -1;
+    memset(&a->out, 0, sizeof(a->out));
+    a->buf_len = APPEND_BUF_LEN;
+    a->buf = malloc(a->buf_len+1);
+    if(a->buf == NULL) {
+        free(a);
+        return NULL;
+    }
+    if(packet_init(&a->in)) {
+        free(a->buf);
+        free(a);
+        return NULL;
+    }
+    a->dfd = opendatafile();
+    if(a->dfd == -1) {
+        packet_free(&a->in);
+        free(a->buf);
+        free(a);
+        return NULL;
+    }
+    replay_init(&a->replay, a->buf, a->buf_len);
+    return a;
+}
+
+void freeappend(struct append_t *a) {
+    replay_release(&a->replay);
+    alog(LOG_DEBUG, "closing data file %s", datapath);
+    robustclose(a->dfd);
+    packet_free(&a->in);
+    free(a->buf);
+    free(a);
 }
 
 void *appenddatathread(void *thread_param) {
     struct append_t  * d = (struct append_t *)thread_param;
-    d->ret = appenddata(d->rsfd, d->dfdmutex);
+    d->ret = appenddata(d);
     closesocket(d->rsfd);
-    #ifdef __DEBUG_MESSAGES
-    syslog(LOG_DEBUG,"Closed file descriptor #%i",d->rsfd);
-    #endif
+    alog(LOG_DEBUG,"Closed file descriptor #%i",d->rsfd);
+    d->done = true;
     return thread_param;
 }
 
-int appenddata(int rsfd, pthread_mutex_t *dfdmutex) {
-
+/* Serves the client connected on d->rsfd until it disconnects, using the
+ * buffers and data file descriptor owned by d. Every complete packet is
+ * appended with a single write and then the data file is replayed once.
+ * The socket is non-blocking and every wait also watches for the shutdown,
+ * so a client that stops reading can't keep the server from exiting.
+ */
+int appenddata(struct append_t *d) {
     int r = -1;
-    int buf_len = 1024;  //arbitrary
-    void *buf = malloc(buf_len+1);
-    size_t readcount, writecount;
-    struct aesd_seekto * seekto;
-
-    struct pollfd rsfd_poll = { 
-        .fd = rsfd, 
-        .events  = POLLIN|POLLPRI, 
-        .revents = 0
-    };
-    struct timespec timeout;
-    // Read the socket and write into datafile
+    if(appendopen(d) == 0)
+        r = appendserve(d, -1);
+    appendclose(d);
+    return r;
+}
 
-    int dfd = opendatafile();
-        if( dfd == -1 ) {
-            log_errno("appenddata(): opendatafile()");
-            goto dfderrorcleanup;
+/* Gets d ready to serve the client just accepted on d->rsfd. appendclose()
+ * undoes it, whether it succeeded or not.
+ * @returns 0 on success, -1 on error.
+ */
+int appendopen(struct append_t *d) {
+    packet_reset(&d->in);
+    d->replaying = false;
+    stats_add(STATS_ACTIVE, 1);
+
+    int flags = fcntl(d->rsfd, F_GETFL);
+    if(flags == -1 || fcntl(d->rsfd, F_SETFL, flags|O_NONBLOCK) == -1) {
+        log_errno("appendopen(): fcntl()");
+        return -1;
     }
+    return 0;
+}
+
+void appendclose(struct append_t *d) {
+    outq_resume(&d->out);
+    if(d->subscribed) {
+        tail_unsubscribe(&d->tail);
+        d->subscribed = false;
+    }
+    stats_add(STATS_ACTIVE, -1);
+}
+
+/* Serves the client of d, opened with appendopen(), until it disconnects.
+ * @param yieldfd is a descriptor (or -1) that becomes readable when the
+ * thread is wanted elsewhere: if it is while the client has nothing to send
+ * or its socket is full, the partial packet, the replay and the subscription
+ * stay in d and appendserve() picks up from there when called again.
+ * @returns 0 once the client disconnected or the server stops, 1 when it
+ * yielded, -1 on error.
+ */
+int appendserve(struct append_t *d, int yieldfd) {
+
+    int r;
+    int rsfd = d->rsfd;
+    struct packet_buf *in = &d->in;
+    ssize_t readcount;
+    size_t avail, pktlen;
+    char *space;
+
+    d->yieldfd = yieldfd;
+
+    // Read the socket and write into datafile
 
     while(flag_accepting_connections) {
 
-        poll(&rsfd_poll,1,POLL_TIMEOUT_MS);
-        if(!(rsfd_poll.revents&(POLLIN|POLLPRI)))
-            continue;
+        // The replay a yield interrupted, then the packets received after it
+        if(d->replaying && (r = sendreplay(d)) != 0)
+            return r;
+        while((pktlen = packet_next(in)) > 0) {
+            r = appendpacket(d, packet_data(in), pktlen);
+            if(r == -1)
+                return -1;
+            packet_consume(in, pktlen);
+            if(r == 1)
+                return 1;
+        }
+        if(d->subscribed && sendtail(d))
+            return -1;
+
+        int w;
+        if(d->subscribed) {
+            // While the socket is full, new appends make no difference
+            struct pollfd fds[3] = {
+                { .fd = rsfd,        .events = POLLIN|POLLPRI },
+                { .fd = d->tail_blocked ? -1 : d->tail.efd, .events = POLLIN },
+                { .fd = yieldfd,     .events = POLLIN }
+            };
+            if(d->tail_blocked)
+                fds[0].events |= POLLOUT;
+            w = shutdown_poll(fds, 3);
+            if(w == 1 && fds[0].revents == 0 && fds[1].revents == 0)
+                return 1;
+            if(w == 1 && (fds[0].revents & ~POLLOUT) == 0)
+                continue;   // only appends to push to it, or room for them
+        }
+        else {
+            struct pollfd fds[2] = {
+                { .fd = rsfd,    .events = POLLIN|POLLPRI },
+                { .fd = yieldfd, .events = POLLIN }
+            };
+            w = shutdown_poll(fds, 2);
+            if(w == 1 && fds[0].revents == 0)
+                return 1;
+        }
+        if(w == 0)
+            break;
+        if(w == -1)
+            return -1;
 
-        readcount = read(rsfd, buf, buf_len);
+        space = packet_space(in, &avail);
+        if(space == NULL) {
+            log_errno("appendserve(): packet_space()");
+            return -1;
+        }
+        readcount = read(rsfd, space, avail);
         if (readcount == -1) {
-            log_errno("appenddata(): socket read()");
-            goto errorcleanup;
+            if(errno == EINTR || errno == EAGAIN) continue;
+            log_errno("appendserve(): socket read()");
+            return -1;
         }
         else if (readcount == 0) {
-            syslog(LOG_DEBUG,"appenddata received FIN from client");
+            alog(LOG_DEBUG,"appenddata received FIN from client");
+            if(packet_pending(in))
+                alog(LOG_DEBUG,"dropping %zu bytes without a newline",
+                       packet_pending(in));
             break;
         }
+        packet_commit(in, readcount);
+        stats_add(STATS_BYTES_IN, readcount);
+    }
+    return 0;
+}
 
-        
-        ssize_t ioccmdpos = find_ioc_command(buf, buf_len);
-        if(ioccmdpos >= 0) {
-            seekto = parse_ioc_command(buf, ioccmdpos);
-            /* send ioc command */
-            ioctl(dfd, AESDCHAR_IOCSEEKTO, seekto);
-            free(seekto);
+/* Appends one packet to the data file (or sends the seek command it holds to
+ * the driver) and replays the data file to the client.
+ * @returns 0 on success, 1 if the replay yielded (see sendreplay()), -1 on
+ * error.
+ */
+int appendpacket(struct append_t *d, const char *pkt, size_t pktlen) {
+    int dfd = d->dfd;
+    ssize_t writecount;
+    struct proto_cmd cmd;
+
+    if(proto_parse(pkt, pktlen, packet_binary(&d->in), &cmd))
+        return -1;
+    if(d->subscribed && proto_subscribed(&cmd))
+        return -1;
+    if(cmd.op == PROTO_SUBSCRIBE)
+        return subscribe(d);
+
+    if(cmd.op == PROTO_SEEK) {
+        /* send ioc command */
+        backend->seek(dfd, &cmd.seekto);
+        cache_invalidate();
+    }
+    else if(cmd.op == PROTO_APPEND && writer_enabled()) {
+        writecount = writer_append(cmd.data, cmd.len);
+        if(writecount == -1) {
+            log_errno("appendpacket(): writer_append()");
+            return -1;
         }
-        else {
-            do {
-                clock_gettime(CLOCK_REALTIME,&timeout);
-                timeout.tv_nsec += (POLL_TIMEOUT_MS*1000);
-            } while(pthread_mutex_timedlock(dfdmutex,&timeout));
-            writecount = write(dfd, buf, readcount);
-            pthread_mutex_unlock(dfdmutex);
-
-            if(writecount == -1) {
-                log_errno("appenddata(): data write()");
-                goto errorcleanup;
-            }
-            /* Case removed to allow command evaluation
-            else if(writecount < readcount) {
-                syslog(LOG_ERR, "appenddata(): write(): %m");
-                syslog(LOG_ERR, "caused by writecount=%li < readcount=%li", (
-                        long unsigned) writecount, (long unsigned) readcount);
-                goto errorcleanup;
-            }
-            */
-        }
-
-        if(readcount < buf_len) {
-        // Read all of the datafile and write into the socket
-            for(int pos=0,rc=-1; rc!=0; pos += rc) {
-                int wc;
-                rc = pread(dfd, buf, buf_len,pos);
-                if (rc == -1) {
-                    log_errno("appenddata(): file read()");
-                    goto errorcleanup;
-                }
-                else if (rc != 0){
-                    wc = write(rsfd,buf,rc);
-                    if(wc == -1) {
-                        log_errno("appenddata(): socket write()");
-                        goto errorcleanup;
-                    }
-                    else if(wc < rc) {
-                        syslog(LOG_ERR, "appenddata(): socket write(): %m");
-                        syslog(LOG_ERR, "caused by writecount=%li < readcount=%li", 
-                                (long unsigned)wc, (long unsigned) rc);
-                        goto errorcleanup;
-                    }
-                }
-                else if (rc == 0) {
-                    syslog(LOG_DEBUG,"appenddata copied datafile to the socket");
-                    break;
-                }
-            }
+        stats_add(STATS_PACKETS, 1);
+    }
+    else if(cmd.op == PROTO_APPEND) {
+        int syncerr;
+        stats_lock(d->dfdmutex);
+        writecount = datawrite(dfd, cmd.data, cmd.len, &syncerr);
+        if(writecount != -1) {
+            cache_append(cmd.data, writecount);
+            tail_append(cmd.data, writecount);
+            pktidx_append(writecount);
         }
+        pthread_mutex_unlock(d->dfdmutex);
+
+        if(writecount != -1 && syncerr) {
+            errno = syncerr;
+            writecount = -1;
+        }
+        if(writecount == -1) {
+            log_errno("appendpacket(): data write()");
+            return -1;
+        }
+        stats_add(STATS_PACKETS, 1);
     }
 
-    r = 0;
-    errorcleanup:
-    syslog(LOG_DEBUG, "closing data file %s", datapath);
-    robustclose(dfd);
-    dfderrorcleanup:
-    free(buf);
-    return r;
+    // Subscribers get the packet with the other appends instead
+    if(d->subscribed)
+        return 0;
+
+    // Read all of the datafile and write into the socket
+    proto_rewind(&d->replay, &cmd, dfd);
+    return sendreplay(d);
 }
 
-void *timestampthread(void *thread_param) {
-    int r;
-    struct timestamp_t * d = (struct timestamp_t *) thread_param;
-    struct timespec period = {.tv_sec = 10, .tv_nsec = 0};
-    do
-    {
-        r = clock_nanosleep(CLOCK_MONOTONIC,0,&period,NULL);
-        if(r == EINTR) {
-            r = 0;
-            break;
+/* Subscribes the connection: replays the data file once, as it is at this
+ * point, and from then on appendserve() only sends what is appended after it.
+ * @returns 0 on success, 1 if the replay yielded (see sendreplay()), -1 on
+ * error.
+ */
+int subscribe(struct append_t *d) {
+    if(d->subscribed) return 0;
+    int64_t start = tail_subscribe(&d->tail, NULL, NULL);
+    if(start == -1) {
+        log_errno("subscribe(): tail_subscribe()");
+        return -1;
+    }
+    d->subscribed = true;
+    d->tail_blocked = false;
+
+    replay_rewind(&d->replay);
+    if(backend->follows_appends)
+        replay_limit(&d->replay, start);
+    return sendreplay(d);
+}
+
+/* Sends the replay started on d->replay, waiting for room whenever the
+ * socket is full. Meanwhile the client is listed as stalled, so the appends
+ * that leave it too far behind drop it (see outq.c). Packets the client sends
+ * in the meantime stay in the socket until the replay is done. If d->yieldfd
+ * becomes readable while the socket is full, the replay is left in d for
+ * appendserve() to finish later, still listed as stalled.
+ * @returns 0 once the replay was sent or the server is shutting down, 1 when
+ * it yielded, -1 on error.
+ */
+int sendreplay(struct append_t *d) {
+    int rr;
+    d->replaying = false;
+    while((rr = replay_continue(&d->replay, d->dfd, d->rsfd)) == 0) {
+        off_t pos = replay_position(&d->replay);
+        outq_stall(&d->out, d->rsfd, (pos == -1) ? OUTQ_NOPOS : pos);
+        struct pollfd fds[2] = {
+            { .fd = d->rsfd,    .events = POLLOUT },
+            { .fd = d->yieldfd, .events = POLLIN }
+        };
+        int w = shutdown_poll(fds, 2);
+        if(w == 1 && fds[0].revents == 0) {
+            d->replaying = true;
+            return 1;
         }
-        else if(r) {
-            log_errno("timestampthread(): clock_nanosleep()");
-            goto errorcleanup;
+        if(w == 0) {
+            rr = 1;     // the while loop of appendserve() ends it
+            break;
         }
-        d->ret = timestamp(d->dfd, d->dfdmutex);
-    } while(flag_accepting_connections);
-    r = 0;
-    errorcleanup:
-    d->ret = r;
-    return thread_param;
+        if(w == -1)
+            break;
+    }
+    if(rr == 1)
+        alog(LOG_DEBUG,"sendreplay copied datafile to the socket");
+    outq_resume(&d->out);
+    return (rr == 1) ? 0 : -1;
+}
+
+/* Sends a subscriber what was appended since it last caught up, until it
+ * catches up again or its socket is full. In the latter case appenddata()
+ * waits for POLLOUT as well and the client is listed as stalled.
+ * @returns 0 on success, -1 on error.
+ */
+int sendtail(struct append_t *d) {
+    int r = tail_continue(&d->tail, d->rsfd);
+    if(r == -1)
+        return -1;
+    d->tail_blocked = (r == 0);
+    if(d->tail_blocked)
+        outq_stall(&d->out, d->rsfd, tail_position(&d->tail));
+    else
+        outq_resume(&d->out);
+    return 0;
+}
+
+/* Periodic task appending a timestamp line, see periodic.c. */
+void timestamptask(void *arg) {
+    struct timestamp_t *d = (struct timestamp_t *) arg;
+    d->ret = timestamp(d->dfd, d->dfdmutex);
+}
+
+/* Periodic task for -a: drops the old segments even when nothing is being
+ * appended to trigger the retention.
+ */
+void retaintask(void *arg) {
+    seglog_expire();
+}
+
+/* Periodic task for -f periodic. */
+void synctask(void *arg) {
+    datasync();
 }
 
 int timestamp(int dfd, pthread_mutex_t *dfdmutex) {
@@ -424,45 +1120,64 @@ int timestamp(int dfd, pthread_mutex_t *dfdmutex) {
     char tstr[TIMESTAMP_MAX_SIZE];
     size_t tstr_size;
     time_t t;
-    struct timespec timeout;
     ssize_t writecount;
+    struct tm tm;
 
-    do {
-        clock_gettime(CLOCK_REALTIME,&timeout);
-        timeout.tv_nsec += (POLL_TIMEOUT_MS*1000);
-    } while(pthread_mutex_timedlock(dfdmutex,&timeout));
-
+    // Formatted before taking the mutex, the appenders only wait for the write
     t = time(NULL);
 
     if(t == (time_t)-1) {
         log_errno("timestamp(): ");
-        goto errorcleanup;
+        return -1;
     }
 
-    struct tm * tm = gmtime(&t);
-
-    tstr_size = strftime(tstr, TIMESTAMP_MAX_SIZE, TIMESTAMP_FMT, tm);
+    tstr_size = strftime(tstr, TIMESTAMP_MAX_SIZE, TIMESTAMP_FMT,
+                         gmtime_r(&t, &tm));
     if(tstr_size == 0) {
-        syslog(LOG_DEBUG,"strftime string size is too small");
-        goto errorcleanup;
+        alog(LOG_DEBUG,"strftime string size is too small");
+        return -1;
     }
 
-    writecount = write(dfd, tstr, tstr_size);
+    stats_lock(dfdmutex);
+    uint64_t started = stats_now();
+    if(writer_enabled()) {
+        writecount = writer_append(tstr, tstr_size);
+    }
+    else {
+        int syncerr;
+        writecount = datawrite(dfd, tstr, tstr_size, &syncerr);
+        if(writecount > 0) {
+            cache_append(tstr, writecount);
+            tail_append(tstr, writecount);
+            pktidx_append(writecount);
+        }
+        if(writecount != -1 && syncerr) {
+            errno = syncerr;
+            writecount = -1;
+        }
+    }
+    stats_observe(STATS_TIMESTAMP, stats_now() - started);
     if(writecount < tstr_size) {
         log_errno("timestamp(): write(): ");
         goto errorcleanup;
     }
 
     r = 0;
-    syslog(LOG_DEBUG,"Appended %s",tstr);
+    alog(LOG_DEBUG,"Appended %s",tstr);
     errorcleanup:
     pthread_mutex_unlock(dfdmutex);
     return r;
 }
 
-int opensocket() {
+/* Opens a socket bound to aesd_netparams and listening.
+ * @param reuseport lets other sockets bind the same address and port, for
+ * the listeners of -l.
+ * @returns the socket file descriptor, or -1 on error.
+ */
+int opensocket(bool reuseport) {
 
     int errnoshadow;
+    int one = 1;
 
     struct addrinfo *bindaddresses, *rp;
     int sfd = -1;    //socket file descriptor
@@ -483,9 +1198,19 @@ int opensocket() {
                         aesd_netparams.ai.ai_socktype,
                         aesd_netparams.ai.ai_protocol);
         if( sfd == -1 ) {
-            syslog(LOG_DEBUG, "opensocket(): socket() loop: %m");
+            alog(LOG_DEBUG, "opensocket(): socket() loop: %m");
             continue;
         }
+        // Restarts must not wait for the old connections in TIME_WAIT
+        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+            log_errno("opensocket(): setsockopt(SO_REUSEADDR)");
+            goto errorcleanup;
+        }
+        if (reuseport &&
+            setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+            log_errno("opensocket(): setsockopt(SO_REUSEPORT)");
+            goto errorcleanup;
+        }
         if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0) {
             break;
         }
@@ -496,14 +1221,14 @@ int opensocket() {
 
     }
     if (rp == NULL) {
-        syslog(LOG_ERR, "opensocket(): could not bind to any address");
+        alog(LOG_ERR, "opensocket(): could not bind to any address");
         goto errorcleanup;
     }
     // the following type cast comes from https://beej.us/guide/bgnet/html/
     void *addr = &(((struct sockaddr_in *)rp->ai_addr)->sin_addr);
     char ipstr[INET_ADDRSTRLEN];
     inet_ntop(rp->ai_family, addr, ipstr, sizeof(ipstr));
-    syslog(LOG_INFO, "Bound to %s", ipstr);
+    alog(LOG_INFO, "Bound to %s", ipstr);
     if(listen(sfd, aesd_netparams.backlog)) {
         log_errno("opensocket(): listen()");
         goto errorcleanup;
@@ -530,8 +1255,12 @@ int closesocket(int sfd) {
     return 0;
 }
 
+/* Opens the data file for a handler, through the backend (see backend.c).
+ * With the seglog backends the descriptor is only a placeholder; the data*()
+ * functions below go to the segments instead.
+ */
 int opendatafile() {
-    int fd = open(datapath, O_APPEND|O_CREAT|O_RDWR|O_TRUNC, S_IRWXU|S_IRWXG);
+    int fd = backend->open(datapath);
     if(fd == -1) {
         log_errno("opendatafile(): open()");
     }
@@ -547,24 +1276,91 @@ int closedatafile(int fd) {
 }
 
 int createdatafile() {
-    const char cmdfmt[] = "mkdir -p $(dirname %s); touch %s";
-    char cmd[PATH_MAX*2 + sizeof(cmdfmt) + 1];
-    //2 chars longer than necessary for every %s
-    sprintf(cmd, cmdfmt, datapath, datapath);
-    return system(cmd);
+    return backend->create(datapath);
 }
 
 int deletedatafile() {
-    const char cmdfmt[] = "rm %s";
-    char cmd[PATH_MAX + sizeof(cmdfmt)]; 
-    //2 chars longer than necessary for every %s
-    sprintf(cmd, cmdfmt, datapath);
-    return system(cmd);
+    backend->destroy(datapath);
+    return 0;
+}
+
+/* Appends to the data file through the backend, and flushes it with
+ * -f packet. The caller holds the data file mutex or is the writer thread.
+ * @param syncerr is set to the errno of a failed flush, 0 otherwise. The
+ * bytes were appended all the same, so the caller still records them (cache,
+ * tail, packet index) before failing the request, like writer_flush() does.
+ * @returns the number of bytes appended, or -1 if the append failed.
+ */
+ssize_t datawrite(int dfd, const void *buf, size_t len, int *syncerr) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    ssize_t wc = backend->append(dfd, &iov, 1);
+    *syncerr = 0;
+    if(wc != -1 && aesd_opts.durability == DURABILITY_PACKET && datasync())
+        *syncerr = errno;   // appended, but not known to be on the disk
+    return wc;
+}
+
+/* Like datawrite(), but may write fewer than all the buffers and never
+ * flushes; the writer thread flushes its batches itself (writer_flush()).
+ */
+ssize_t datawritev(int dfd, const struct iovec *iov, int iovcnt) {
+    return backend->append(dfd, iov, iovcnt);
+}
+
+/* Reads the data file at offset pos, which is a log offset with the seglog
+ * backends (see datastart()).
+ */
+ssize_t datapread(int dfd, void *buf, size_t len, off_t pos) {
+    return backend->read(dfd, buf, len, pos);
+}
+
+/* Flushes the appends to stable storage, timing it for the stats.
+ * @returns 0 on success, -1 on error.
+ */
+int datasync(void) {
+    uint64_t started = stats_now();
+    int r = backend->sync();
+    if(r)
+        log_errno("datasync()");
+    stats_observe(STATS_SYNC, stats_now() - started);
+    return r;
+}
+
+/* @returns the offset of the first byte of the data file still kept, which
+ * moves when the retention deletes old data (-r, -a).
+ */
+off_t datastart(void) {
+    return backend->start();
+}
+
+/* @returns the offset just past the end of the data file. */
+off_t datasize(void) {
+    return backend->size();
+}
+
+/* Parses a byte count with an optional k, m or g suffix (powers of 1024).
+ * @returns 0 on success, -1 if s isn't a size.
+ */
+int parsesize(const char *s, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if(errno || end == s || *s == '-') return -1;
+    switch(*end) {
+        case 'g': case 'G': n <<= 10; // fall through
+        case 'm': case 'M': n <<= 10; // fall through
+        case 'k': case 'K': n <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if(*end != '\0') return -1;
+    *size = n;
+    return 0;
 }
 
 int robustclose(int fd) {
     if (close(fd) == 0) {
-                syslog(LOG_DEBUG,"Closed file descriptor #%i", fd);
+                alog(LOG_DEBUG,"Closed file descriptor #%i", fd);
                 return 0;
             }
     else{
@@ -574,12 +1370,12 @@ int robustclose(int fd) {
                 r = close(fd);
             }
             if (r != 0) {
-                syslog(LOG_ERR,"robustclose() failed to close file descriptor %i after %i retries: %m",fd,i);
+                alog(LOG_ERR,"robustclose() failed to close file descriptor %i after %i retries: %m",fd,i);
                 return -1;
             } 
         }
         else {
-            syslog(LOG_ERR,"robustclose() failed to close file descriptor %i",fd);
+            alog(LOG_ERR,"robustclose() failed to close file descriptor %i",fd);
             return -1;
         }
     }
@@ -588,64 +1384,51 @@ int robustclose(int fd) {
 
 void log_errno(const char *funcname) {
     int local_errno = errno;
-    syslog(LOG_ERR, "%s: %m", funcname);
+    alog(LOG_ERR, "%s: %m", funcname);
     errno = local_errno;
 }
 
 void log_gai(const char *funcname, int errcode) {
     const char *errstr = gai_strerror(errcode);
-    syslog(LOG_ERR, "%s: %s", funcname, errstr);
+    alog(LOG_ERR, "%s: %s", funcname, errstr);
 }
 
-static void signal_handler(int signo) {
-    switch(signo) {
-        case SIGTERM:
-        case SIGINT:
-            flag_accepting_connections = false;
-            flag_idling_main_thread = false;
-        default:
-            last_signal_caught = signo;
-    }
+/* @returns true if the packet in buf (buf_len bytes, newline included) is the
+ * subscribe command.
+ */
+bool is_subscribe_command(const void * buf, size_t buf_len) {
+    size_t l = sizeof(AESD_SOCKET_SUBSCRIBE_STRING) - 1;
+    return buf_len == l + 1 &&
+           memcmp(buf, AESD_SOCKET_SUBSCRIBE_STRING, l) == 0;
 }
 
-/* Finds the AESD_SOCKET_IOC_STRING in a given file buffer
+/* Finds the AESD_SOCKET_IOC_STRING at the start of a given file buffer.
  * @param buf is the buffer to check.
  * @param buf_len is the length of the buffer.
  * @returns The starting position, that is the position of the first character 
  * of the command string. If no entry is found, -ENOENT is returned.
  */
 ssize_t find_ioc_command(const void * buf, int buf_len) {
-    size_t s = sizeof(AESD_SOCKET_IOC_STRING) - 1; // removing NULL termination
-    if(s > buf_len) return -ENOENT;
-    for(size_t i = 0; i < buf_len - s; i++) {
-        if( !memcmp(AESD_SOCKET_IOC_STRING, buf, s) ) 
-            return i;
-    }
-    return -ENOENT;
+    ssize_t pos;
+    scan_packet(buf, buf_len, &pos);    // see scan.c
+    if(pos < 0) return -ENOENT;
+    return pos;
 }
 /* Parses the information from an AESDCHAR_IOCSEEKTO command into an
  * aesd_seekto structure. The command has the format `AESDCHAR_IOCSEEKTO:X,Y`,
  * where X is put into write_cmd and Y is put into write_cmd_offset. The command
  * is expected to end in a newline.
- * The user is responsible for freeing the memory allocated for the return 
- * value.
  * @param buf is the buffer containing the command string.
  * @param startpos is the starting position, that is the position of the first
  * character of the command string.
+ * @param seekto receives the values, 0 for those missing.
  */
-struct aesd_seekto * parse_ioc_command(const void * buf, size_t startpos) 
+void parse_ioc_command(const void * buf, size_t startpos,
+                       struct aesd_seekto *seekto)
 {
-    struct aesd_seekto * r = malloc(sizeof(struct aesd_seekto));
-    sscanf(buf, AESD_SOCKET_IOC_STRING ":%" PRIu32 ",%" PRIu32 "\n",
-        &r->write_cmd, &r->write_cmd_offset);
-    return r;
-}
-
-ssize_t find_eoc(const void * buf, int buf_len, size_t ioc_command_pos)
-{
-    size_t s;
-    for(s=ioc_command_pos; s<buf_len; s++) {
-        if(*((char *)(buf+s)) == '\n') return s;
-    }
-    return -ENOENT;
+    seekto->write_cmd = 0;
+    seekto->write_cmd_offset = 0;
+    sscanf((const char *)buf + startpos,
+        AESD_SOCKET_IOC_STRING ":%" PRIu32 ",%" PRIu32 "\n",
+        &seekto->write_cmd, &seekto->write_cmd_offset);
 }
@@ -1,3 +1,6 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
 #  define NI_MAXHOST      1025  //these should come from netdb.h but I can't
 #  define NI_MAXSERV      32    //seem to get the ifdef to work right away
 
@@ -5,20 +8,29 @@
 #   define USE_AESD_CHAR_DEVICE 0
 #endif
 
-#if USE_AESD_CHAR_DEVICE == 0
-#   define AESD_DATAPATH ("/var/tmp/aesdsocketdata")
-#else
-#   define AESD_DATAPATH ("/dev/aesdchar")
-#endif
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/queue.h>
 #include <netdb.h>
 #include <linux/limits.h>
 #include <pthread.h>
 
+#include "replay.h"
+#include "packet.h"
+#include "tail.h"
+#include "outq.h"
+
 #define AESD_SOCKET_IOC_STRING "AESDCHAR_IOCSEEKTO"
+#define AESD_SOCKET_SUBSCRIBE_STRING "AESDSOCKET_SUBSCRIBE"
+#define AESD_SOCKET_READ_STRING "AESDSOCKET_READ"
+#define AESD_SOCKET_LAST_STRING "AESDSOCKET_LAST"
+#define APPEND_BUF_LEN      1024    // arbitrary
+#define AESD_SEGMENT_LEN    (1 << 20)   // data file segment size (seglog.c)
 
 struct socket_params {
     char *port;
@@ -27,76 +39,130 @@ struct socket_params {
     struct addrinfo ai;
 };
 
-const struct socket_params aesd_netparams  = {
-    .port = "9000",
-    .ip = "0.0.0.0",                         // NULL will bind to all interfaces
-    .backlog = 100,
-    .ai = {
-        .ai_family = AF_INET,                // AF_UNSPEC for dual stack
-        .ai_socktype = SOCK_STREAM,           // | SOCK_NONBLOCK,
-        .ai_protocol = 0,
-        .ai_flags = AI_PASSIVE,
-        .ai_canonname = NULL,
-        .ai_addr = NULL,
-        .ai_addrlen = 0,
-        .ai_next = NULL
-    }
+extern struct socket_params aesd_netparams;
+
+struct aesd_seekto;
+
+enum server_mode {
+    SERVER_MODE_THREAD,     // one thread per accepted connection
+    SERVER_MODE_EPOLL,      // event-loop threads multiplexing all connections
+    SERVER_MODE_POOL,       // fixed worker pool fed by a queue of connections
+    SERVER_MODE_URING       // event loops doing their socket I/O with io_uring
+};
+
+enum durability {
+    DURABILITY_NONE,        // leave the flushing to the kernel
+    DURABILITY_PERIODIC,    // flush from the timer thread every second
+    DURABILITY_BATCH,       // the writer flushes each batch before its replies
+    DURABILITY_PACKET       // every packet is flushed before its reply
+};
+
+struct server_options {
+    bool daemonize;
+    enum server_mode mode;
+    int nthreads;           // event-loop or worker threads, 0 is one per core
+    int qdepth;             // connections waiting for a worker in -m pool
+    int listeners;          // SO_REUSEPORT listening sockets, 0 is one per core
+    bool cache;             // serve replays from an in-memory image
+    bool writer;            // append through the single writer thread
+    uint64_t retain_bytes;  // data file size kept, 0 keeps everything
+    time_t retain_secs;     // age of the data kept, 0 keeps everything
+    uint64_t outq_cap;      // bytes a client may fall behind, 0 for no cap
+    const char *stats_path; // Unix socket serving the metrics, or NULL
+    enum durability durability;
+    const char *handoff_path;   // Unix socket for hot restarts, or NULL
 };
-// To bind to a specific interface use .ip = "127.0.0.1" for example.
+extern struct server_options aesd_opts;
 
-volatile bool flag_accepting_connections = false;
-volatile bool flag_idling_main_thread = false;
-volatile int  last_signal_caught = 0;
+extern volatile bool flag_accepting_connections;
+extern volatile int  last_signal_caught;
 
-const char datapath[PATH_MAX] = AESD_DATAPATH;
+extern const char *datapath;
 
 struct descriptors_t {
     pthread_mutex_t *mutex;
     int dfd;                // data file descriptor
-    int sfd;                // socket file descriptor
+    int sfd;                // socket file descriptor (sfds[0])
+    int *sfds;              // all the listening sockets
+    int nsfds;
 };
-struct descriptors_t *server_descriptors;
-pthread_t server_thread;
+extern struct descriptors_t *server_descriptors;
 
 // Passed to appenddata() threads. This data would be on a TAILQ list and each
-// list element is assigned to a thread.
+// list element is assigned to a thread. Finished elements are reused, so the
+// buffer and the data file descriptor outlive a single connection.
 struct append_t {
     pthread_mutex_t * dfdmutex;     // Mutex for data file descriptor
     int dfd;                        // Data file descriptor
     int rsfd;                       // Socket file descriptor
+    void *buf;                      // Replay bounce buffer (buf_len+1 bytes)
+    int buf_len;
+    struct packet_buf in;           // Received bytes, framed into packets
+    struct replay_t replay;         // Replay state, borrows buf
+    struct tail_sub tail;           // New appends, once subscribed
+    bool subscribed;
+    bool tail_blocked;              // rsfd was full sending new appends
+    bool replaying;                 // The replay yielded, see sendreplay()
+    int yieldfd;                    // See appendserve()
+    struct outq_ent out;            // Listed while rsfd is full
     pthread_t thread;               // Thread ID
     int ret;                        // Return value
+    volatile bool done;             // Thread finished with rsfd
     TAILQ_ENTRY(append_t) nodes;    // TAILQ nodes
 };
+TAILQ_HEAD(append_head_t, append_t);
 
 struct timestamp_t {
     pthread_mutex_t * dfdmutex;     // Mutex for data file descriptor
     int dfd;                        // Data file descriptor
-    pthread_t thread;               // Thread ID
-    int ret;                        // Return value
+    int ret;                        // Return value of the last timestamp
 };
-struct timestamp_t *timestamp_descriptors;
+extern struct timestamp_t *timestamp_descriptors;
 
 int main(int argc, char *argv[]);
+int parseoptions(int argc, char *argv[], struct server_options *opts);
+void usage(const char *progname);
 int startserver(bool daemonize);
 int stopserver();
-int opensocket();
+int runserver(int sfd, pthread_mutex_t *dfdmutex, int nthreads);
+int opensocket(bool reuseport);
 int closesocket(int sfd);
 int opendatafile();
 int closedatafile(int fd);
 int listenfunc(int sfd, pthread_mutex_t *dfdmutex);
-void *listenthread(void *thread_param);
-int startlistenthread(pthread_t *thread, struct descriptors_t *descriptors);
+int acceptconnection(int sfd);
+void reapappendthreads(struct append_head_t *running,
+                       struct append_head_t *finished);
+struct append_t *allocappend(pthread_mutex_t *dfdmutex);
+void freeappend(struct append_t *a);
 void *appenddatathread(void *thread_param);
-int appenddata(int sfd, pthread_mutex_t *sfdmutex);
-void *timestampthread(void *thread_param);
+int appenddata(struct append_t *d);
+int appendopen(struct append_t *d);
+int appendserve(struct append_t *d, int yieldfd);
+void appendclose(struct append_t *d);
+int appendpacket(struct append_t *d, const char *pkt, size_t pktlen);
+int subscribe(struct append_t *d);
+int sendreplay(struct append_t *d);
+int sendtail(struct append_t *d);
+void timestamptask(void *arg);
+void retaintask(void *arg);
+void synctask(void *arg);
 int timestamp(int dfd, pthread_mutex_t *dfdmutex);
 int createdatafile();
 int deletedatafile();
+ssize_t datawrite(int dfd, const void *buf, size_t len, int *syncerr);
+ssize_t datawritev(int dfd, const struct iovec *iov, int iovcnt);
+ssize_t datapread(int dfd, void *buf, size_t len, off_t pos);
+int datasync(void);
+off_t datastart(void);
+off_t datasize(void);
+int parsesize(const char *s, uint64_t *size);
 int robustclose(int fd);
 void log_errno(const char *funcname);
 void log_gai(const char *funcname, int errcode);
-static void signal_handler(int signo);
 ssize_t find_ioc_command(const void * buf, int buf_len);
-struct aesd_seekto * parse_ioc_command(const void * buf, size_t startpos);
-ssize_t find_eoc(const void * buf, int buf_len, size_t ioc_command_pos);
+void parse_ioc_command(const void * buf, size_t startpos,
+                       struct aesd_seekto *seekto);
+bool is_subscribe_command(const void * buf, size_t buf_len);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "alog.h"
+
+#define ALOG_RING_LEN       64          // messages queued per thread
+#define ALOG_MSG_LEN        248         // longer messages are cut
+
+/* Comments:
+ *  syslog() takes a process-wide lock and writes to the log socket for every
+ *  message, so with every accept, close and replay logging, the handlers
+ *  ended up queueing on it. Now each thread formats its messages into a
+ *  ring of its own, a single-producer single-consumer queue that needs no
+ *  lock, and one logging thread takes them from all the rings and hands
+ *  them to syslog().
+ *
+ *  The logging thread sleeps on a semaphore when every ring is empty, and a
+ *  producer only posts it when it finds it asleep, so a busy server doesn't
+ *  pay a syscall per message. A thread whose ring is full drops the message
+ *  and the logging thread reports how many were dropped, unless it is an
+ *  error or worse: those go to syslog() from the thread itself, out of order
+ *  with what is still queued but never lost.
+ *
+ *  The rings are allocated the first time a thread logs and are never freed:
+ *  when the thread exits its ring is drained and handed to the next new
+ *  thread, so -m thread doesn't allocate one per connection. The list of
+ *  rings only grows, at its head, so the logging thread walks it without a
+ *  lock.
+ *
+ *  Messages are filtered before any of this, at compile time against
+ *  ALOG_MAX_LEVEL and at run time against alog_level (-L).
+ */
+
+enum alog_state {
+    ALOG_LIVE,                      // Owned by a running thread
+    ALOG_DEAD,                      // Its thread exited, maybe not drained
+    ALOG_FREE                       // Drained, ready for another thread
+};
+
+struct alog_rec {
+    int prio;
+    char msg[ALOG_MSG_LEN];
+};
+
+struct alog_ring {
+    _Atomic uint32_t head;          // Next record to fill, producer owned
+    _Atomic uint32_t tail;          // Next record to log, consumer owned
+    atomic_int state;
+    struct alog_ring *next;         // Never changes once listed
+    struct alog_rec recs[ALOG_RING_LEN];
+};
+
+int alog_level = LOG_DEBUG;
+
+static struct {
+    atomic_bool running;
+    atomic_bool sleeping;           // The logging thread waits on wake
+    _Atomic uint64_t dropped;
+    _Atomic(struct alog_ring *) rings;
+    pthread_mutex_t mutex;          // Serializes the threads taking a ring
+    pthread_key_t key;              // Releases a thread's ring when it exits
+    pthread_t thread;
+    sem_t wake;
+} alog = {
+    .running = false,
+    .sleeping = false,
+    .dropped = 0,
+    .rings = NULL,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static _Thread_local struct alog_ring *alog_mine;
+
+static const struct {
+    const char *name;
+    int prio;
+} alog_levels[] = {
+    { "emerg", LOG_EMERG }, { "alert", LOG_ALERT }, { "crit", LOG_CRIT },
+    { "err", LOG_ERR }, { "warning", LOG_WARNING }, { "notice", LOG_NOTICE },
+    { "info", LOG_INFO }, { "debug", LOG_DEBUG }
+};
+
+static void *alog_thread(void *thread_param);
+static bool alog_drain(void);
+static struct alog_ring *alog_ring(void);
+static void alog_release(void *ring);
+
+void alog_write(int prio, const char *fmt, ...) {
+    int errnoshadow = errno;
+    va_list ap;
+    va_start(ap, fmt);
+    struct alog_ring *r = atomic_load(&alog.running) ? alog_ring() : NULL;
+    if(r == NULL) {
+        vsyslog(prio, fmt, ap);
+        va_end(ap);
+        errno = errnoshadow;
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if(head - tail == ALOG_RING_LEN) {
+        // Errors are worth the syslog() lock, they are what the log is for
+        if(prio <= LOG_ERR)
+            vsyslog(prio, fmt, ap);
+        else
+            atomic_fetch_add_explicit(&alog.dropped, 1, memory_order_relaxed);
+    }
+    else {
+        struct alog_rec *rec = &r->recs[head % ALOG_RING_LEN];
+        rec->prio = prio;
+        vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+        atomic_store_explicit(&r->head, head + 1, memory_order_release);
+        // Pairs with the store of sleeping before the last look at the rings
+        if(atomic_load(&alog.sleeping) && atomic_exchange(&alog.sleeping, false))
+            sem_post(&alog.wake);
+    }
+    va_end(ap);
+    errno = errnoshadow;
+}
+
+int alog_parselevel(const char *s) {
+    for(size_t i = 0; i < sizeof(alog_levels)/sizeof(alog_levels[0]); i++)
+        if(strcmp(s, alog_levels[i].name) == 0)
+            return alog_levels[i].prio;
+    char *end;
+    long l = strtol(s, &end, 10);
+    if(end == s || *end != '\0' || l < LOG_EMERG || l > LOG_DEBUG)
+        return -1;
+    return (int)l;
+}
+
+int alog_start(void) {
+    int r = pthread_key_create(&alog.key, alog_release);
+    if(r) {
+        errno = r;
+        return -1;
+    }
+    sem_init(&alog.wake, 0, 0);
+    atomic_store(&alog.running, true);
+    r = pthread_create(&alog.thread, NULL, alog_thread, NULL);
+    if(r) {
+        atomic_store(&alog.running, false);
+        sem_destroy(&alog.wake);
+        pthread_key_delete(alog.key);
+        errno = r;
+        return -1;
+    }
+    return 0;
+}
+
+void alog_stop(void) {
+    if(!atomic_exchange(&alog.running, false)) return;
+    sem_post(&alog.wake);
+    pthread_join(alog.thread, NULL);
+    alog_drain();       // whatever a thread queued while it was stopping
+    sem_destroy(&alog.wake);
+}
+
+static void *alog_thread(void *thread_param) {
+    for(;;) {
+        if(alog_drain()) continue;
+        if(!atomic_load(&alog.running)) break;
+        atomic_store(&alog.sleeping, true);
+        if(alog_drain()) {
+            atomic_store(&alog.sleeping, false);
+            continue;
+        }
+        while(sem_wait(&alog.wake) == -1 && errno == EINTR);
+    }
+    return thread_param;
+}
+
+/* Logs everything queued in the rings and recycles the ones of the threads
+ * that exited.
+ * @returns whether there was anything to log.
+ */
+static bool alog_drain(void) {
+    bool any = false;
+    for(struct alog_ring *r = atomic_load(&alog.rings); r != NULL; r = r->next) {
+        int state = atomic_load(&r->state);
+        if(state == ALOG_FREE) continue;
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for(; tail != head; tail++) {
+            struct alog_rec *rec = &r->recs[tail % ALOG_RING_LEN];
+            syslog(rec->prio, "%s", rec->msg);
+            any = true;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+        // state was loaded before head, so a dead ring is empty now
+        if(state == ALOG_DEAD)
+            atomic_store(&r->state, ALOG_FREE);
+    }
+    uint64_t dropped = atomic_exchange(&alog.dropped, 0);
+    if(dropped)
+        syslog(LOG_WARNING, "%" PRIu64 " log messages dropped, the log "
+               "rings were full", dropped);
+    return any;
+}
+
+/* @returns the ring of the calling thread, taking a free one or allocating
+ * one the first time, or NULL if there is no memory for it.
+ */
+static struct alog_ring *alog_ring(void) {
+    if(alog_mine) return alog_mine;
+    struct alog_ring *r;
+    pthread_mutex_lock(&alog.mutex);
+    for(r = atomic_load(&alog.rings); r != NULL; r = r->next) {
+        if(atomic_load(&r->state) == ALOG_FREE) {
+            atomic_store(&r->state, ALOG_LIVE);
+            break;
+        }
+    }
+    if(r == NULL) {
+        r = malloc(sizeof(*r));
+        if(r != NULL) {
+            atomic_init(&r->head, 0);
+            atomic_init(&r->tail, 0);
+            atomic_init(&r->state, ALOG_LIVE);
+            r->next = atomic_load(&alog.rings);
+            atomic_store(&alog.rings, r);
+        }
+    }
+    pthread_mutex_unlock(&alog.mutex);
+    if(r != NULL) {
+        if(pthread_setspecific(alog.key, r) == 0)
+            alog_mine = r;
+        else
+            atomic_store(&r->state, ALOG_FREE);
+    }
+    return alog_mine;
+}
+
+/* Thread exit destructor of alog.key. */
+static void alog_release(void *ring) {
+    struct alog_ring *r = ring;
+    atomic_store(&r->state, ALOG_DEAD);
+}
@@ -0,0 +1,49 @@
+#ifndef ALOG_H
+#define ALOG_H
+
+#include <stdbool.h>
+#include <syslog.h>
+
+/* Messages less important than this are compiled out, arguments and all.
+ * Build with `make LOG_MAX_LEVEL=LOG_INFO` to drop the debug messages.
+ */
+#ifndef ALOG_MAX_LEVEL
+#   define ALOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+/* The least important priority logged, set once at start up (-L). */
+extern int alog_level;
+
+/* @returns whether a message of priority prio would be logged, to skip the
+ * work of preparing its arguments (getnameinfo(), for one).
+ */
+#define alog_enabled(prio) ((prio) <= ALOG_MAX_LEVEL && (prio) <= alog_level)
+
+/* Logs like syslog(): formats the message in the calling thread, %m
+ * included, and queues it for the logging thread. When the queue is full
+ * the message is dropped, unless it is LOG_ERR or worse, which is then
+ * written to syslog directly. Filtered out messages cost a comparison.
+ */
+#define alog(prio, ...) \
+    do { \
+        if(alog_enabled(prio)) alog_write((prio), __VA_ARGS__); \
+    } while(0)
+
+void alog_write(int prio, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Parses a level name (err, warning, notice, info, debug...) or number.
+ * @returns the priority, or -1 if s is neither.
+ */
+int alog_parselevel(const char *s);
+
+/* Starts the thread writing the queued messages to syslog. Until then, and
+ * after alog_stop(), messages go to syslog directly.
+ * @returns 0 on success, -1 on error.
+ */
+int alog_start(void);
+
+/* Writes what is still queued and stops the logging thread. */
+void alog_stop(void);
+
+#endif /* ALOG_H */
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+#include "backend.h"
+#include "seglog.h"
+#include "alog.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+/* Comments:
+ *  The backend used to be chosen when building, with USE_AESD_CHAR_DEVICE,
+ *  and every place that cared had an #if or an if on it. The differences are
+ *  now here, behind one table of operations, and -b picks the table when the
+ *  server starts; USE_AESD_CHAR_DEVICE only chooses the default. So all of
+ *  them can be measured with the same binary (see aesdsocket-bench.c).
+ *
+ *   - file: the segmented log of seglog.c in /var/tmp, the default without
+ *     the driver. The path is its manifest.
+ *   - char: the aesdchar driver. Appends are write()s and reads pread()s of
+ *     the device, which only returns its last ten writes, so reads don't
+ *     follow the appends and the driver keeps no timestamps.
+ *   - mem: the segmented log kept in memfd files; nothing reaches the disk
+ *     and the data is gone when the server stops.
+ *   - mmap: the segment files of the file backend, preallocated and mapped,
+ *     so appends and reads are memory copies and replays are sent straight
+ *     from the mapping.
+ *
+ *  The seglog backends share everything but how they create the log.
+ *
+ *  On a hot restart (-H) the data outlives the server: the seglog backends
+ *  pass their open segments to the new one, and the char backend has
+ *  nothing to pass, since the driver keeps the data, so the new server only
+ *  waits for the old one to be done with the device before opening it.
+ */
+
+static struct {
+    int fd;                         // Placeholder or device, for size()
+} be = {
+    .fd = -1
+};
+
+/* The segmented log, in files or in memory */
+
+static int seg_create(const char *path, enum seglog_store store) {
+    if(store != SEGLOG_MEMORY) {
+        const char cmdfmt[] = "mkdir -p $(dirname %s); rm -f %s.[0-9]*";
+        char cmd[PATH_MAX*2 + sizeof(cmdfmt) + 1];
+        //2 chars longer than necessary for every %s
+        sprintf(cmd, cmdfmt, path, path);
+        if(system(cmd)) return -1;
+    }
+    if(seglog_open(path, store, AESD_SEGMENT_LEN, aesd_opts.retain_bytes,
+                   aesd_opts.retain_secs))
+        return -1;
+    if(store == SEGLOG_MEMORY) {
+        // Handlers still want a descriptor; they get copies of this one
+        be.fd = memfd_create(path, MFD_CLOEXEC);
+        if(be.fd == -1) {
+            seglog_close(true);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int file_create(const char *path) {
+    return seg_create(path, SEGLOG_FILES);
+}
+
+static int mem_create(const char *path) {
+    return seg_create(path, SEGLOG_MEMORY);
+}
+
+static int mmap_create(const char *path) {
+    return seg_create(path, SEGLOG_MMAP);
+}
+
+static int seg_take_over(int sock, const char *path,
+                         enum seglog_store store) {
+    if(seglog_recv(sock, path, store, AESD_SEGMENT_LEN, aesd_opts.retain_bytes,
+                   aesd_opts.retain_secs))
+        return -1;
+    if(store == SEGLOG_MEMORY) {
+        be.fd = memfd_create(path, MFD_CLOEXEC);
+        if(be.fd == -1) {
+            seglog_close(true);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int file_take_over(int sock, const char *path) {
+    return seg_take_over(sock, path, SEGLOG_FILES);
+}
+
+static int mem_take_over(int sock, const char *path) {
+    return seg_take_over(sock, path, SEGLOG_MEMORY);
+}
+
+static int mmap_take_over(int sock, const char *path) {
+    return seg_take_over(sock, path, SEGLOG_MMAP);
+}
+
+static int seg_hand_over(int sock) {
+    int r = seglog_send(sock);
+    if(r)
+        seglog_close(false);
+    robustclose(be.fd);     // the placeholder of mem, if any
+    be.fd = -1;
+    return r;
+}
+
+static void file_destroy(const char *path) {
+    seglog_close(true);
+    if(unlink(path))
+        log_errno("file_destroy(): unlink()");
+}
+
+static void mem_destroy(const char *path) {
+    seglog_close(true);
+    robustclose(be.fd);
+    be.fd = -1;
+}
+
+/* The manifest, which is never read or written through the descriptor. */
+static int file_open(const char *path) {
+    return open(path, O_RDONLY|O_CLOEXEC);
+}
+
+static int mem_open(const char *path) {
+    return fcntl(be.fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static ssize_t seg_append(int dfd, const struct iovec *iov, int iovcnt) {
+    return seglog_writev(iov, iovcnt);
+}
+
+static int seg_sync(void) {
+    return seglog_sync();
+}
+
+static ssize_t seg_read(int dfd, void *buf, size_t len, off_t pos) {
+    return seglog_pread(buf, len, pos);
+}
+
+static int seg_seek(int dfd, const struct aesd_seekto *seekto) {
+    errno = ENOTTY;
+    return -1;
+}
+
+static off_t seg_start(void) {
+    return seglog_start();
+}
+
+static off_t seg_size(void) {
+    return seglog_end();
+}
+
+static size_t seg_locate(int dfd, off_t *pos, size_t len, void **ref,
+                         int *fd, off_t *off) {
+    uint64_t p = *pos;
+    struct seglog_seg *s = *ref;
+    size_t n = seglog_locate(&p, len, &s, fd, off);
+    *pos = p;
+    *ref = s;
+    return n;
+}
+
+static void seg_release(void *ref) {
+    if(ref) seglog_put(ref);
+}
+
+static const char *seg_mapping(void *ref) {
+    return seglog_map(ref);
+}
+
+/* The aesdchar driver */
+
+static int char_open(const char *path) {
+    return open(path, O_APPEND|O_CREAT|O_RDWR|O_CLOEXEC, S_IRWXU|S_IRWXG);
+}
+
+static int char_create(const char *path) {
+    be.fd = char_open(path);
+    return (be.fd == -1) ? -1 : 0;
+}
+
+static void char_destroy(const char *path) {
+    robustclose(be.fd);
+    be.fd = -1;
+}
+
+static int char_hand_over(int sock) {
+    char_destroy(NULL);
+    return 0;
+}
+
+/* The old server closes the connection once it closed the device. */
+static int char_take_over(int sock, const char *path) {
+    char c;
+    ssize_t rc;
+    while((rc = recv(sock, &c, 1, 0)) == -1 && errno == EINTR);
+    if(rc == -1) return -1;
+    return char_create(path);
+}
+
+static ssize_t char_append(int dfd, const struct iovec *iov, int iovcnt) {
+    return writev(dfd, iov, iovcnt);
+}
+
+/* The driver keeps its writes in kernel memory, there is nothing to flush. */
+static int char_sync(void) {
+    return 0;
+}
+
+static ssize_t char_read(int dfd, void *buf, size_t len, off_t pos) {
+    return pread(dfd, buf, len, pos);
+}
+
+static int char_seek(int dfd, const struct aesd_seekto *seekto) {
+    return ioctl(dfd, AESDCHAR_IOCSEEKTO, seekto);
+}
+
+static off_t char_start(void) {
+    return 0;
+}
+
+/* The driver's llseek takes SEEK_END. Everyone else uses pread() and
+ * O_APPEND writes, so moving the position of be.fd doesn't disturb them.
+ */
+static off_t char_size(void) {
+    return lseek(be.fd, 0, SEEK_END);
+}
+
+static size_t char_locate(int dfd, off_t *pos, size_t len, void **ref,
+                          int *fd, off_t *off) {
+    *fd = dfd;
+    *off = *pos;
+    return len;
+}
+
+static void char_release(void *ref) {
+}
+
+static const struct backend_ops backends[] = {
+    {
+        .name = "file",
+        .path = "/var/tmp/aesdsocketdata",
+        .follows_appends = true,
+        .timestamps = true,
+        .create = file_create,
+        .destroy = file_destroy,
+        .hand_over = seg_hand_over,
+        .take_over = file_take_over,
+        .open = file_open,
+        .append = seg_append,
+        .sync = seg_sync,
+        .read = seg_read,
+        .seek = seg_seek,
+        .start = seg_start,
+        .size = seg_size,
+        .locate = seg_locate,
+        .release = seg_release
+    },
+    {
+        .name = "char",
+        .path = "/dev/aesdchar",
+        .follows_appends = false,
+        .timestamps = false,
+        .create = char_create,
+        .destroy = char_destroy,
+        .hand_over = char_hand_over,
+        .take_over = char_take_over,
+        .open = char_open,
+        .append = char_append,
+        .sync = char_sync,
+        .read = char_read,
+        .seek = char_seek,
+        .start = char_start,
+        .size = char_size,
+        .locate = char_locate,
+        .release = char_release
+    },
+    {
+        .name = "mem",
+        .path = "aesdsocketdata",
+        .follows_appends = true,
+        .timestamps = true,
+        .create = mem_create,
+        .destroy = mem_destroy,
+        .hand_over = seg_hand_over,
+        .take_over = mem_take_over,
+        .open = mem_open,
+        .append = seg_append,
+        .sync = seg_sync,
+        .read = seg_read,
+        .seek = seg_seek,
+        .start = seg_start,
+        .size = seg_size,
+        .locate = seg_locate,
+        .release = seg_release
+    },
+    {
+        .name = "mmap",
+        .path = "/var/tmp/aesdsocketdata",
+        .follows_appends = true,
+        .timestamps = true,
+        .create = mmap_create,
+        .destroy = file_destroy,
+        .hand_over = seg_hand_over,
+        .take_over = mmap_take_over,
+        .open = file_open,
+        .append = seg_append,
+        .sync = seg_sync,
+        .read = seg_read,
+        .seek = seg_seek,
+        .start = seg_start,
+        .size = seg_size,
+        .locate = seg_locate,
+        .release = seg_release,
+        .mapping = seg_mapping
+    }
+};
+
+const struct backend_ops *backend = &backends[USE_AESD_CHAR_DEVICE ? 1 : 0];
+
+int backend_select(const char *name) {
+    for(size_t i = 0; i < sizeof(backends)/sizeof(backends[0]); i++) {
+        if(strcmp(backends[i].name, name) == 0) {
+            backend = &backends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,84 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct aesd_seekto;
+
+/* A storage backend: where the data file lives and how it is appended to,
+ * read and replayed. One is selected at start up (-b) and the data*()
+ * functions of aesdsocket.c go through it.
+ *
+ * Handlers own a descriptor from open() and pass it back to the other
+ * operations; backends that keep their data elsewhere hand out a placeholder.
+ * Offsets are log offsets, the bytes appended since the server started, for
+ * the backends that follow appends.
+ */
+struct backend_ops {
+    const char *name;
+    const char *path;               // Default data path
+    bool follows_appends;           // Reads return the appended bytes at
+                                    // their log offsets (not the char device)
+    bool timestamps;                // The server appends the timestamp lines
+
+    /* Creates empty data at path when the server starts. */
+    int (*create)(const char *path);
+    /* Closes the data and deletes it, when the server stops. */
+    void (*destroy)(const char *path);
+    /* Instead of destroy(), on a hot restart: passes the data to the new
+     * server on the handoff connection sock and closes it. See handoff.c.
+     * @returns 0 on success, -1 on error.
+     */
+    int (*hand_over)(int sock);
+    /* Instead of create(), on a hot restart: waits for the old server's
+     * hand_over() on sock and adopts the data it passed.
+     * @returns 0 on success, -1 on error.
+     */
+    int (*take_over)(int sock, const char *path);
+    /* @returns a descriptor for a handler, or -1 on error. */
+    int (*open)(const char *path);
+    /* Appends as many of the buffers as it can, at least the first one.
+     * Callers are serialized, by the data file mutex or the writer thread.
+     * @returns the number of bytes appended, or -1 on error.
+     */
+    ssize_t (*append)(int dfd, const struct iovec *iov, int iovcnt);
+    /* Flushes what was appended so far to stable storage.
+     * @returns 0 on success, -1 on error.
+     */
+    int (*sync)(void);
+    /* Reads from offset pos. @returns the bytes read, 0 at the end. */
+    ssize_t (*read)(int dfd, void *buf, size_t len, off_t pos);
+    /* Applies an AESDCHAR_IOCSEEKTO. @returns 0, or -1 if unsupported. */
+    int (*seek)(int dfd, const struct aesd_seekto *seekto);
+    /* @returns the offset of the oldest byte kept. */
+    off_t (*start)(void);
+    /* @returns the offset just past the last byte appended. */
+    off_t (*size)(void);
+    /* Finds the next bytes of a replay at *pos for sendfile(), splice() or
+     * pread(), keeping whatever the reader needs in *ref (NULL to start
+     * with) until it is passed to release(). *pos may move forward past
+     * deleted data.
+     * @returns how many of the next len bytes are in *fd at *off, 0 at the
+     * end of the data.
+     */
+    size_t (*locate)(int dfd, off_t *pos, size_t len, void **ref,
+                     int *fd, off_t *off);
+    void (*release)(void *ref);
+    /* For backends whose data is mapped, NULL for the others.
+     * @returns the address of offset 0 of the *fd returned by the locate()
+     * that gave ref, valid until release(ref).
+     */
+    const char *(*mapping)(void *ref);
+};
+
+extern const struct backend_ops *backend;
+
+/* Selects the backend named name: file, char, mem or mmap.
+ * @returns 0 on success, -1 if there is no such backend.
+ */
+int backend_select(const char *name);
+
+#endif /* BACKEND_H */
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+#include "cache.h"
+#include "stats.h"
+#include "alog.h"
+
+#define CACHE_CHUNK_LEN     (64 * 1024)
+#define CACHE_IOV_MAX       16          // chunks per sendmsg()
+
+/* Comments:
+ *  The image is a list of fixed-size chunks that only ever grows at the tail.
+ *  A chunk never moves once it is linked, and img->len is published after the
+ *  bytes and the links are in place, so readers walk the chunks up to the
+ *  length they saw in cache_open() without taking any lock.
+ *
+ *  The generation counts changes to the data file. An image is current when
+ *  its generation matches cache.generation:
+ *   - With the file backend every append is copied into the image and both
+ *     generations move together, so the data file is never read again.
+ *   - With the char device the driver only keeps the last writes and the
+ *     IOCSEEKTO offset changes what reads return, so changes only bump the
+ *     generation. The first replay that finds the image stale reloads it from
+ *     the device; concurrent replays wait on load_mutex and share that load.
+ *  A replay needs the generation current when it starts, not the one current
+ *  when its turn to load comes: any newer image has its bytes too. So during
+ *  a burst of appends, which move the generation on while a load is in
+ *  flight, the replays that queued up behind it share the next load instead
+ *  of each reading the whole data once more, and the data is read once per
+ *  load rather than once per client (see aesdsocket_cache_loads_total).
+ *  Readers hold a reference, so a reload never pulls an image from under a
+ *  replay in progress.
+ *
+ *  When the retention deletes old data (see seglog.c) the image is
+ *  invalidated as well and the next replay reloads what is left, starting at
+ *  the oldest byte kept (img->base). A reload that follows appends reads up to
+ *  cache.appended as it was when it started, without holding cache.mutex.
+ *  cache_append() only adds to the current image, so the appends made during
+ *  the load are read from the file once more under the mutex before the image
+ *  is installed, which makes it current; unless the data was invalidated
+ *  meanwhile, then the image only serves the replays that were waiting for it.
+ */
+
+struct cache_chunk {
+    struct cache_chunk *next;
+    char data[CACHE_CHUNK_LEN];
+};
+
+struct cache_image {
+    atomic_int refs;
+    uint64_t generation;            // Data file generation the image matches
+    off_t base;                     // Data file offset of the first byte
+    _Atomic size_t len;             // Published length
+    size_t cap;                     // Bytes allocated in chunks
+    struct cache_chunk *head;
+    struct cache_chunk *tail;
+};
+
+static struct {
+    bool enabled;
+    bool follow_appends;
+    pthread_mutex_t mutex;          // Protects image and image->generation
+    pthread_mutex_t load_mutex;     // One reload at a time
+    struct cache_image *image;      // Current image, NULL until loaded
+    _Atomic uint64_t generation;
+    uint64_t invalidations;         // cache_invalidate() calls
+    off_t appended;                 // Bytes passed to cache_append()
+} cache = {
+    .enabled = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .load_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .image = NULL,
+    .generation = 0,
+    .invalidations = 0,
+    .appended = 0
+};
+
+static struct cache_image *image_new(uint64_t generation);
+static int image_append(struct cache_image *img, const void *buf, size_t len);
+static int image_fill(struct cache_image *img, int dfd, off_t end);
+static struct cache_chunk *image_grow(struct cache_image *img);
+static void image_put(struct cache_image *img);
+
+int cache_init(bool follow_appends, off_t end) {
+    cache.follow_appends = follow_appends;
+    atomic_store(&cache.generation, 0);
+    cache.appended = end;
+    if(follow_appends && end == 0) {
+        // The data file was just truncated, so an empty image is current.
+        cache.image = image_new(0);
+        if(cache.image == NULL) return -1;
+    }
+    cache.enabled = true;
+    return 0;
+}
+
+void cache_destroy(void) {
+    if(!cache.enabled) return;
+    cache.enabled = false;
+    pthread_mutex_lock(&cache.mutex);
+    if(cache.image) image_put(cache.image);
+    cache.image = NULL;
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+bool cache_enabled(void) {
+    return cache.enabled;
+}
+
+void cache_append(const void *buf, size_t len) {
+    if(!cache.enabled) return;
+    if(!cache.follow_appends) {
+        cache_invalidate();
+        return;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    uint64_t g = atomic_load(&cache.generation);
+    struct cache_image *img = cache.image;
+    if(img != NULL && img->generation == g) {
+        if(image_append(img, buf, len) == 0) {
+            img->generation = g + 1;
+        }
+        else {
+            log_errno("cache_append(): image_append()");
+            cache.image = NULL;     // next replay reloads from the file
+            image_put(img);
+        }
+    }
+    atomic_store(&cache.generation, g + 1);
+    cache.appended += len;
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void cache_invalidate(void) {
+    if(!cache.enabled) return;
+    // Under the mutex, or a concurrent cache_append() could store over it
+    pthread_mutex_lock(&cache.mutex);
+    atomic_fetch_add(&cache.generation, 1);
+    cache.invalidations++;
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+uint64_t cache_generation(void) {
+    return atomic_load(&cache.generation);
+}
+
+int cache_open(struct cache_reader *rd, int dfd) {
+    struct cache_image *img;
+    uint64_t want = atomic_load(&cache.generation);
+
+    pthread_mutex_lock(&cache.mutex);
+    img = cache.image;
+    if(img != NULL && img->generation >= want) {
+        atomic_fetch_add(&img->refs, 1);
+    }
+    else {
+        img = NULL;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+
+    if(img == NULL) {
+        pthread_mutex_lock(&cache.load_mutex);
+        // Someone may have loaded it while we waited for load_mutex
+        pthread_mutex_lock(&cache.mutex);
+        img = cache.image;
+        if(img != NULL && img->generation >= want)
+            atomic_fetch_add(&img->refs, 1);
+        else
+            img = NULL;
+        uint64_t g = atomic_load(&cache.generation);
+        uint64_t inval = cache.invalidations;
+        off_t end = cache.follow_appends ? cache.appended : -1;
+        pthread_mutex_unlock(&cache.mutex);
+
+        if(img == NULL) {
+            img = image_new(g);
+            if(img != NULL) img->base = datastart();
+            if(img == NULL || image_fill(img, dfd, end)) {
+                log_errno("cache_open(): loading image");
+                if(img) image_put(img);
+                pthread_mutex_unlock(&cache.load_mutex);
+                return -1;
+            }
+            atomic_fetch_add(&img->refs, 1);   // ours, on top of the cache's
+            pthread_mutex_lock(&cache.mutex);
+            if(cache.follow_appends && cache.invalidations == inval) {
+                // Catch up with the appends made during the load
+                if(image_fill(img, dfd, cache.appended) == 0)
+                    img->generation = atomic_load(&cache.generation);
+                else
+                    log_errno("cache_open(): catching up");
+            }
+            struct cache_image *old = cache.image;
+            cache.image = img;
+            pthread_mutex_unlock(&cache.mutex);
+            if(old) image_put(old);
+            stats_add(STATS_CACHE_LOADS, 1);
+            alog(LOG_DEBUG, "cache loaded %zu bytes from %s",
+                   atomic_load(&img->len), datapath);
+        }
+        pthread_mutex_unlock(&cache.load_mutex);
+    }
+
+    rd->img = img;
+    rd->base = img->base;
+    rd->end = atomic_load_explicit(&img->len, memory_order_acquire);
+    rd->pos = 0;
+    rd->chunk = img->head;
+    return 0;
+}
+
+int cache_send(struct cache_reader *rd, int rsfd) {
+    while(rd->pos < rd->end) {
+        struct iovec iov[CACHE_IOV_MAX];
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 0 };
+        struct cache_chunk *c = rd->chunk;
+        size_t p = rd->pos;
+        while(msg.msg_iovlen < CACHE_IOV_MAX && p < rd->end) {
+            size_t off = p % CACHE_CHUNK_LEN;
+            size_t l = CACHE_CHUNK_LEN - off;
+            if(l > rd->end - p) l = rd->end - p;
+            iov[msg.msg_iovlen].iov_base = c->data + off;
+            iov[msg.msg_iovlen].iov_len = l;
+            msg.msg_iovlen++;
+            p += l;
+            if(p % CACHE_CHUNK_LEN == 0) c = c->next;
+        }
+
+        ssize_t wc = sendmsg(rsfd, &msg, MSG_NOSIGNAL);
+        if(wc == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_errno("cache_send(): sendmsg()");
+            return -1;
+        }
+        cache_advance(rd, wc);
+        stats_add(STATS_BYTES_OUT, wc);
+    }
+    return 1;
+}
+
+size_t cache_peek(struct cache_reader *rd, const char **data) {
+    if(rd->pos >= rd->end) return 0;
+    size_t off = rd->pos % CACHE_CHUNK_LEN;
+    size_t l = CACHE_CHUNK_LEN - off;
+    if(l > rd->end - rd->pos) l = rd->end - rd->pos;
+    *data = rd->chunk->data + off;
+    return l;
+}
+
+void cache_advance(struct cache_reader *rd, size_t n) {
+    while(n > 0) {
+        size_t off = rd->pos % CACHE_CHUNK_LEN;
+        size_t step = CACHE_CHUNK_LEN - off;
+        if(step > n) step = n;
+        rd->pos += step;
+        n -= step;
+        if(rd->pos % CACHE_CHUNK_LEN == 0) rd->chunk = rd->chunk->next;
+    }
+}
+
+void cache_close(struct cache_reader *rd) {
+    if(rd->img) image_put(rd->img);
+    rd->img = NULL;
+    rd->chunk = NULL;
+}
+
+static struct cache_image *image_new(uint64_t generation) {
+    struct cache_image *img = calloc(1, sizeof(struct cache_image));
+    if(img == NULL) return NULL;
+    atomic_init(&img->refs, 1);
+    atomic_init(&img->len, 0);
+    img->generation = generation;
+    return img;
+}
+
+/* Copies buf at the end of img. Only one thread appends to an image at a time
+ * (cache_append() runs under the data file mutex or on the writer thread,
+ * image_fill() before the image is shared).
+ */
+static int image_append(struct cache_image *img, const void *buf, size_t len) {
+    size_t l = atomic_load_explicit(&img->len, memory_order_relaxed);
+    while(len > 0) {
+        if(l == img->cap && image_grow(img) == NULL) return -1;
+        size_t off = l % CACHE_CHUNK_LEN;
+        size_t n = CACHE_CHUNK_LEN - off;
+        if(n > len) n = len;
+        memcpy(img->tail->data + off, buf, n);
+        buf = (const char *)buf + n;
+        len -= n;
+        l += n;
+    }
+    atomic_store_explicit(&img->len, l, memory_order_release);
+    return 0;
+}
+
+/* Loads the data file from img->base plus what img already holds up to end,
+ * or up to the end of the file when end is -1. On error img keeps the length
+ * it had.
+ */
+static int image_fill(struct cache_image *img, int dfd, off_t end) {
+    size_t l = atomic_load_explicit(&img->len, memory_order_relaxed);
+    for(;;) {
+        if(l == img->cap && image_grow(img) == NULL) return -1;
+        size_t off = l % CACHE_CHUNK_LEN;
+        size_t want = CACHE_CHUNK_LEN - off;
+        if(end != -1) {
+            if(img->base + (off_t)l >= end) break;
+            if((off_t)want > end - img->base - (off_t)l)
+                want = end - img->base - l;
+        }
+        ssize_t rc = datapread(dfd, img->tail->data + off, want,
+                               img->base + l);
+        if(rc == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(rc == 0) break;
+        l += rc;
+    }
+    atomic_store_explicit(&img->len, l, memory_order_release);
+    return 0;
+}
+
+static struct cache_chunk *image_grow(struct cache_image *img) {
+    struct cache_chunk *c = malloc(sizeof(struct cache_chunk));
+    if(c == NULL) return NULL;
+    c->next = NULL;
+    if(img->tail)
+        img->tail->next = c;
+    else
+        img->head = c;
+    img->tail = c;
+    img->cap += CACHE_CHUNK_LEN;
+    return c;
+}
+
+static void image_put(struct cache_image *img) {
+    if(atomic_fetch_sub(&img->refs, 1) != 1) return;
+    struct cache_chunk *c = img->head;
+    while(c) {
+        struct cache_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    free(img);
+}
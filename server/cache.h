@@ -0,0 +1,73 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct cache_image;
+struct cache_chunk;
+
+/* A replay served from the in-memory image. It holds a reference on the image
+ * it started with, so a replay always sends one consistent snapshot even if
+ * the image is replaced in the meantime.
+ */
+struct cache_reader {
+    struct cache_image *img;
+    off_t base;                     // Data file offset of the image's first byte
+    size_t end;                     // Image length when the replay started
+    size_t pos;                     // Bytes already sent
+    struct cache_chunk *chunk;      // Chunk holding pos
+};
+
+/* Enables the replay cache.
+ * @param follow_appends is true when the bytes passed to cache_append() are
+ * exactly what the data file will return (the file backend). Otherwise every
+ * change only invalidates the image and the next replay reloads it.
+ * @param end is the size of the data the server starts with, which is 0
+ * unless it was taken over from another server (see handoff.c).
+ * @returns 0 on success, -1 on error.
+ */
+int cache_init(bool follow_appends, off_t end);
+void cache_destroy(void);
+bool cache_enabled(void);
+
+/* Records len bytes appended to the data file. The caller must hold the data
+ * file mutex (or be the writer thread, see writer.c) so the image sees the
+ * appends in file order.
+ */
+void cache_append(const void *buf, size_t len);
+
+/* Records a change of the data file that the image can't follow, such as an
+ * AESDCHAR_IOCSEEKTO.
+ */
+void cache_invalidate(void);
+
+/* @returns the generation of the data file, bumped on every change. */
+uint64_t cache_generation(void);
+
+/* Starts a replay of the current image, loading it from dfd first if it is
+ * older than the current generation.
+ * @returns 0 on success, -1 on error.
+ */
+int cache_open(struct cache_reader *rd, int dfd);
+
+/* Sends the image to rsfd until it is done or rsfd would block.
+ * @returns 1 when done, 0 when rsfd would block, -1 on error.
+ */
+int cache_send(struct cache_reader *rd, int rsfd);
+
+/* For callers that send the image themselves (see uring.c).
+ * @param data is set to the next bytes to send.
+ * @returns the number of bytes at *data, 0 when the whole image was sent.
+ */
+size_t cache_peek(struct cache_reader *rd, const char **data);
+
+/* Marks n bytes returned by cache_peek() as sent. */
+void cache_advance(struct cache_reader *rd, size_t n);
+
+/* Drops the reference taken by cache_open(). */
+void cache_close(struct cache_reader *rd);
+
+#endif /* CACHE_H */
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "aesdsocket.h"
+#include "channel.h"
+#include "backend.h"
+#include "alog.h"
+
+/* Comments:
+ *  Every client shares one data file, and so one data file mutex, one writer
+ *  thread, one replay cache and one timestamp schedule, whether or not its
+ *  packets have anything to do with the others'. With -C a,b,c the server
+ *  runs one channel per name instead, each a complete server of its own in
+ *  a process of its own:
+ *   - channel i listens on port 9000 + i, which is how a client picks it;
+ *   - its data is at the backend's path followed by -name (for the char
+ *     backend, a device node per channel);
+ *   - the -s and -H paths get the same suffix, so every channel has its own
+ *     metrics and hot restarts channel by channel.
+ *  Producers only contend with the clients of their own channel. Forking
+ *  the whole server keeps every module as it is, since each of them keeps a
+ *  single instance of its state (the log, the cache, the tail ring...).
+ *
+ *  The parent only forks the channels and waits: SIGINT and SIGTERM are
+ *  passed on to them, and a channel failing stops the others, so the server
+ *  stops as a whole like it would without -C. A channel that exits cleanly
+ *  after a hot restart handed it over is left alone.
+ */
+
+static struct {
+    int n;
+    char names[CHANNEL_MAX][CHANNEL_NAME_LEN];
+    pid_t pids[CHANNEL_MAX];        // 0 once it exited
+    char port[8];                   // Of the channel, in the child
+    char datapath[PATH_MAX];
+    char stats_path[PATH_MAX];
+    char handoff_path[PATH_MAX];
+} ch = {
+    .n = 0
+};
+
+static int channel_setup(int i, int port);
+static int channel_suffix(char *buf, const char *path, const char *name);
+static int channel_wait(const sigset_t *mask);
+static void channel_kill(int sig);
+
+int channel_parse(const char *list) {
+    const char *p = list;
+    ch.n = 0;
+    for(;;) {
+        size_t l = strcspn(p, ",");
+        if(l == 0 || l >= CHANNEL_NAME_LEN || ch.n == CHANNEL_MAX)
+            return -1;
+        for(size_t i = 0; i < l; i++) {
+            if(!isalnum((unsigned char)p[i]) && p[i] != '-' && p[i] != '_')
+                return -1;
+        }
+        memcpy(ch.names[ch.n], p, l);
+        ch.names[ch.n][l] = '\0';
+        for(int i = 0; i < ch.n; i++) {
+            if(strcmp(ch.names[i], ch.names[ch.n]) == 0)
+                return -1;
+        }
+        ch.n++;
+        if(p[l] == '\0')
+            return 0;
+        p += l + 1;
+    }
+}
+
+bool channel_enabled(void) {
+    return ch.n > 0;
+}
+
+int channel_fork(int *status) {
+    sigset_t mask, oldmask;
+    int base = atoi(aesd_netparams.port);
+
+    openlog("aesdsocket", LOG_CONS|LOG_PERROR|LOG_PID, LOG_USER);
+    if(base + ch.n - 1 > 65535) {
+        alog(LOG_ERR, "not enough ports after %d for %d channels", base, ch.n);
+        return -1;
+    }
+
+    // Blocked before forking, so none is lost before sigwaitinfo()
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    if(sigprocmask(SIG_BLOCK, &mask, &oldmask)) {
+        log_errno("channel_fork(): sigprocmask()");
+        return -1;
+    }
+
+    if(aesd_opts.daemonize) {
+        // The channels can't report their errors to the caller anymore, only
+        // to syslog
+        pid_t pid = fork();
+        if(pid < 0) {
+            log_errno("channel_fork(): fork()");
+            return -1;
+        }
+        else if(pid > 0) {
+            alog(LOG_INFO, "Daemon PID: %ld", (long)pid);
+            exit(EXIT_SUCCESS);
+        }
+        aesd_opts.daemonize = false;
+    }
+
+    for(int i = 0; i < ch.n; i++) {
+        pid_t pid = fork();
+        if(pid == -1) {
+            log_errno("channel_fork(): fork()");
+            channel_kill(SIGTERM);
+            channel_wait(&mask);
+            return -1;
+        }
+        if(pid == 0) {
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            return channel_setup(i, base + i);
+        }
+        ch.pids[i] = pid;
+        alog(LOG_INFO, "channel %s on port %d, PID %ld", ch.names[i],
+             base + i, (long)pid);
+    }
+    *status = channel_wait(&mask);
+    return 1;
+}
+
+/* Points the options of the server about to start at channel i.
+ * @returns 0 on success, -1 if a path gets too long.
+ */
+static int channel_setup(int i, int port) {
+    const char *name = ch.names[i];
+    snprintf(ch.port, sizeof(ch.port), "%d", port);
+    aesd_netparams.port = ch.port;
+    if(channel_suffix(ch.datapath, datapath, name))
+        return -1;
+    datapath = ch.datapath;
+    if(aesd_opts.stats_path) {
+        if(channel_suffix(ch.stats_path, aesd_opts.stats_path, name))
+            return -1;
+        aesd_opts.stats_path = ch.stats_path;
+    }
+    if(aesd_opts.handoff_path) {
+        if(channel_suffix(ch.handoff_path, aesd_opts.handoff_path, name))
+            return -1;
+        aesd_opts.handoff_path = ch.handoff_path;
+    }
+    return 0;
+}
+
+/* Writes path-name into buf, PATH_MAX bytes.
+ * @returns 0 on success, -1 if it doesn't fit.
+ */
+static int channel_suffix(char *buf, const char *path, const char *name) {
+    int l = snprintf(buf, PATH_MAX, "%s-%s", path, name);
+    if(l < 0 || l >= PATH_MAX) {
+        alog(LOG_ERR, "path %s-%s is too long", path, name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Waits for all the channels to exit.
+ * @returns 0 if they all exited cleanly, 1 otherwise.
+ */
+static int channel_wait(const sigset_t *mask) {
+    int ret = 0;
+    bool stopping = false;
+    int running = 0;
+    for(int i = 0; i < ch.n; i++) {
+        if(ch.pids[i] > 0) running++;
+    }
+
+    while(running > 0) {
+        int sig = sigwaitinfo(mask, NULL);
+        if(sig == -1) {
+            if(errno == EINTR) continue;
+            log_errno("channel_wait(): sigwaitinfo()");
+            return 1;
+        }
+        if(sig != SIGCHLD) {
+            alog(LOG_INFO, "Caught %s signal, stopping the channels",
+                 strsignal(sig));
+            channel_kill(sig);
+            stopping = true;
+            continue;
+        }
+
+        pid_t pid;
+        int st;
+        while((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+            int i;
+            for(i = 0; i < ch.n && ch.pids[i] != pid; i++);
+            if(i == ch.n) continue;
+            ch.pids[i] = 0;
+            running--;
+            if(WIFEXITED(st) && WEXITSTATUS(st) == 0) {
+                alog(LOG_DEBUG, "channel %s stopped", ch.names[i]);
+                continue;
+            }
+            alog(LOG_ERR, "channel %s failed", ch.names[i]);
+            ret = 1;
+            if(!stopping) {
+                channel_kill(SIGTERM);
+                stopping = true;
+            }
+        }
+    }
+    return ret;
+}
+
+static void channel_kill(int sig) {
+    for(int i = 0; i < ch.n; i++) {
+        if(ch.pids[i] > 0 && kill(ch.pids[i], sig) && errno != ESRCH)
+            log_errno("channel_kill(): kill()");
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdbool.h>
+
+#define CHANNEL_MAX         64
+#define CHANNEL_NAME_LEN    32      // with the terminating NUL
+
+/* Parses the comma-separated channel names of -C: letters, digits, '-' and
+ * '_', at most CHANNEL_MAX of them.
+ * @returns 0 on success, -1 if the list is not valid.
+ */
+int channel_parse(const char *list);
+
+/* @returns whether -C asked for channels. */
+bool channel_enabled(void);
+
+/* Starts one server process per channel. In each child it sets the port,
+ * the data path and the -s and -H paths of its channel and returns 0; the
+ * child then runs the server as usual. In the parent it waits for the
+ * channels to stop, passing SIGINT and SIGTERM on to them.
+ * @param status is set in the parent to the exit status of the server.
+ * @returns 0 in a channel, 1 in the parent once they all stopped, -1 on error.
+ */
+int channel_fork(int *status);
+
+#endif /* CHANNEL_H */
@@ -0,0 +1,879 @@
+#!/usr/bin/env python3
+"""Scripted client checks for aesdsocket.
+
+Usage: clienttest.py path/to/aesdsocket [section...] [-- server options...]
+
+Starts the server once per section, on port 9000 with its data in
+/var/tmp/aesdsocketdata, so no other server may be running, and checks the
+replies byte for byte:
+    lines       text packets split over several sends, several in one send,
+                up to PACKET_MAX_LEN with the newline, and one byte more
+    subscribe   AESDSOCKET_SUBSCRIBE: the data once, then the appends, and
+                any other request closing the subscriber
+    slow        -o: a subscriber that stops reading dropped once the appends
+                pile up behind it, not for its first replay
+    seglog      segment rolls and the byte retention (-r) with the file, mmap
+                and mem backends: the segment files, the manifest and the
+                replays
+    handoff     a hot restart (-H) with rolled and dropped segments and a
+                connection still open on the old server
+    binary      binary requests of every length up to PACKET_MAX_LEN,
+                pipelined and split, and one byte more
+    ranges      the clamp edges of AESDSOCKET_READ, AESDSOCKET_LAST and of
+                their binary counterparts, and reads before the oldest byte
+                kept
+    stats       the metrics served on -s after a few appends, and the exact
+                histogram bucket bounds
+    flush       every -f mode: the replies, and the data in the segment files
+                after the syncs each mode does
+    channels    -C: a port, a data path, and metrics per channel, with the
+                data of each channel kept apart
+    cache       the shared replay image (-c) with concurrent clients, without
+                and with the byte retention
+The server options after -- are added to every section, e.g. -- -m epoll.
+Prints what failed and exits with 1 if anything did. Each section runs for
+less than TIMESTAMP_PERIOD_S, before the first timestamp is appended.
+"""
+
+import glob
+import os
+import random
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+PORT = 9000
+DATAPATH = '/var/tmp/aesdsocketdata'
+HANDOFF_PATH = '/tmp/aesdsocket-clienttest.handoff'
+STATS_PATH = '/tmp/aesdsocket-clienttest.stats'
+PACKET_MAX_LEN = 16 << 20           # packet.h
+SEGMENT_LEN = 1 << 20               # AESD_SEGMENT_LEN, aesdsocket.h
+U64_MAX = 2**64 - 1
+
+MAGIC = b'\xae'
+HDR = struct.Struct('!BBHIQQ')      # struct proto_hdr
+REPLY = struct.Struct('!BB6sQQ')    # struct proto_reply
+APPEND, SEEK, READ, RANGE, LAST = 1, 2, 3, 4, 5
+
+failures = []
+
+
+def check(what, ok, detail=''):
+    if not ok:
+        failures.append(what)
+        print('FAIL %s %s' % (what, detail))
+
+
+def describe(got, want):
+    return 'got %d bytes, want %d' % (len(got), len(want))
+
+
+class Server:
+    def __init__(self, binary, args):
+        self.proc = subprocess.Popen([binary] + args,
+                                     stdout=subprocess.DEVNULL,
+                                     stderr=subprocess.DEVNULL)
+
+    def stop(self):
+        """Stops the server, @returns its exit status or 'hung'."""
+        if self.proc.poll() is None:
+            self.proc.terminate()
+        try:
+            return self.proc.wait(10)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+            return 'hung'
+
+
+def connect(binary=False, port=PORT):
+    for _ in range(100):
+        try:
+            s = socket.create_connection(('127.0.0.1', port))
+            break
+        except ConnectionRefusedError:
+            time.sleep(0.05)
+    else:
+        raise ConnectionRefusedError('no server on port %d' % port)
+    s.settimeout(10)
+    if binary:
+        s.sendall(MAGIC)
+    return s
+
+
+def recvn(s, n):
+    buf = bytearray()
+    while len(buf) < n:
+        d = s.recv(min(n - len(buf), 1 << 20))
+        if not d:
+            raise EOFError('closed after %d of %d bytes' % (len(buf), n))
+        buf += d
+    return bytes(buf)
+
+
+def closed(s):
+    """@returns whether the server closes s without sending anything."""
+    try:
+        return s.recv(1) == b''
+    except ConnectionResetError:
+        return True
+    except socket.timeout:
+        return False
+
+
+def request(s, op, data=b'', a0=0, a1=0):
+    s.sendall(HDR.pack(op, 0, 0, len(data), a0, a1) + data)
+
+
+def reply(s):
+    """@returns (op, status, start, data) of the next binary reply."""
+    op, status, _, start, length = REPLY.unpack(recvn(s, REPLY.size))
+    return op, status, start, recvn(s, length)
+
+
+def snapshot():
+    """@returns (start, data) of what the server keeps."""
+    s = connect(binary=True)
+    request(s, READ)
+    _, _, start, data = reply(s)
+    s.close()
+    return start, data
+
+
+def text(s, line, n):
+    s.sendall(line)
+    return recvn(s, n)
+
+
+def clean_data():
+    for f in glob.glob(DATAPATH + '*'):
+        os.unlink(f)
+
+
+def segments():
+    return sorted(os.path.basename(f)
+                  for f in glob.glob(DATAPATH + '.[0-9]*'))
+
+
+def manifest():
+    with open(DATAPATH) as f:
+        return dict(l.split(' ', 1) for l in f.read().split('\n')[1:] if l)
+
+
+def clamp(lo, hi, start, end):
+    """proto_clamp(): [start, end) narrowed down to [lo, hi)."""
+    if lo > start:
+        start = lo if lo < end else end
+    if hi < end:
+        end = hi if hi > start else start
+    return start, end
+
+
+def scrape(path):
+    """@returns the values served on the -s socket at path, by metric."""
+    for _ in range(100):
+        s = socket.socket(socket.AF_UNIX)
+        try:
+            s.connect(path)
+            break
+        except (FileNotFoundError, ConnectionRefusedError):
+            s.close()
+            time.sleep(0.05)
+    else:
+        raise ConnectionRefusedError('no stats socket at %s' % path)
+    s.settimeout(10)
+    buf = b''
+    while True:
+        d = s.recv(1 << 16)
+        if not d:
+            break
+        buf += d
+    s.close()
+    return dict(l.rsplit(' ', 1) for l in buf.decode().split('\n')
+                if l and not l.startswith('#'))
+
+
+def quiet(s, wait=0.3):
+    """@returns what s receives until it is quiet for wait seconds."""
+    s.settimeout(wait)
+    buf = b''
+    try:
+        while True:
+            d = s.recv(1 << 20)
+            if not d:
+                break
+            buf += d
+    except socket.timeout:
+        pass
+    s.settimeout(10)
+    return buf
+
+
+def lines(binary, args):
+    srv = Server(binary, args)
+    s = connect()
+
+    # Two packets in one send get a replay each
+    s.sendall(b'a\nb\n')
+    want = b'a\n' + b'a\nb\n'
+    got = recvn(s, len(want))
+    check('lines: two packets in one send', got == want, got)
+
+    # Nothing is replayed before the newline
+    s.sendall(b'hel')
+    got = quiet(s)
+    check('lines: no replay before the newline', got == b'', got)
+    s.sendall(b'lo\n')
+    want = b'a\nb\nhello\n'
+    got = recvn(s, len(want))
+    check('lines: packet split over two sends', got == want, got)
+
+    # Up to the packet buffer's limit, which the buffer grows to
+    line = b't' * (PACKET_MAX_LEN - 1) + b'\n'
+    want += line
+    got = text(s, line, len(want))
+    check('lines: packet of PACKET_MAX_LEN bytes', got == want,
+          describe(got, want))
+    got = text(s, b'small\n', len(want) + 6)
+    want += b'small\n'
+    check('lines: small packet after a long one', got == want,
+          describe(got, want))
+    s.close()
+    t = connect()
+    t.sendall(b'u' * PACKET_MAX_LEN + b'\n')
+    check('lines: packet over PACKET_MAX_LEN closed', closed(t))
+    t.close()
+    _, got = snapshot()
+    check('lines: nothing appended by the oversized packet', got == want,
+          describe(got, want))
+    rc = srv.stop()
+    check('lines: server exit status', rc == 0, rc)
+
+
+def subscribe(binary, args):
+    srv = Server(binary, args)
+    t = connect()
+    want = b'before\n'
+    text(t, want, len(want))
+
+    # The data once, then only what is appended, by others or by itself
+    sub = connect()
+    got = text(sub, b'AESDSOCKET_SUBSCRIBE\n', len(want))
+    check('subscribe: data once', got == want, got)
+    for i in range(5):
+        p = b'other %d\n' % i
+        want += p
+        text(t, p, len(want))
+        got = recvn(sub, len(p))
+        check('subscribe: append %d streamed' % i, got == p, got)
+    p = b'own\n'
+    want += p
+    got = text(sub, p, len(p))
+    check('subscribe: own append streamed', got == p, got)
+    sub.sendall(b'AESDSOCKET_SUBSCRIBE\n')
+    got = quiet(sub)
+    check('subscribe: subscribing again sends nothing', got == b'', got)
+    p = b'after\n'
+    want += p
+    text(t, p, len(want))
+    got = recvn(sub, len(p))
+    check('subscribe: still streaming', got == p, got)
+
+    # A reply couldn't be told apart from the stream: any other request
+    # closes the subscriber
+    for line in (b'AESDSOCKET_READ:0\n', b'AESDSOCKET_LAST:1\n',
+                 b'AESDCHAR_IOCSEEKTO:0,0\n'):
+        sub.sendall(line)
+        check('subscribe: %s closes it' % line.strip().decode(),
+              quiet(sub) == b'' and closed(sub))
+        sub.close()
+        sub = connect()
+        text(sub, b'AESDSOCKET_SUBSCRIBE\n', len(want))
+    sub.close()
+    t.close()
+    _, got = snapshot()
+    check('subscribe: data unchanged', got == want, describe(got, want))
+    rc = srv.stop()
+    check('subscribe: server exit status', rc == 0, rc)
+
+
+def slow(binary, args):
+    srv = Server(binary, ['-o', '1m', '-s', STATS_PATH] + args)
+    w = connect()
+    text(w, b'AESDSOCKET_SUBSCRIBE\n', 0)
+    big = b'b' * ((4 << 20) - 1) + b'\n'
+    text(w, big, len(big))
+
+    # A first replay far larger than the cap doesn't count against a client
+    # that stops reading; only what is appended afterwards does
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    s.connect(('127.0.0.1', PORT))
+    s.settimeout(10)
+    s.sendall(b'AESDSOCKET_SUBSCRIBE\n')
+    time.sleep(0.5)
+    dropped = scrape(STATS_PATH).get('aesdsocket_clients_dropped_total')
+    check('slow: not dropped for its first replay', dropped == '0', dropped)
+    sent = len(big)
+    for i in range(4):
+        p = (b'%d' % i) * ((1 << 20) - 1) + b'\n'
+        got = text(w, p, len(p))
+        check('slow: append %d streamed to a reader' % i, got == p,
+              describe(got, p))
+        sent += len(p)
+    for _ in range(20):
+        dropped = scrape(STATS_PATH).get('aesdsocket_clients_dropped_total')
+        if dropped != '0':
+            break
+        time.sleep(0.05)
+    check('slow: dropped once 4m behind', dropped == '1', dropped)
+    n = 0
+    try:
+        while True:
+            d = s.recv(1 << 20)
+            if not d:
+                break
+            n += len(d)
+    except (ConnectionResetError, socket.timeout):
+        pass
+    check('slow: closed before it got everything', n < sent,
+          '%d of %d bytes' % (n, sent))
+    s.close()
+
+    # The client that keeps reading is still served
+    p = b'after\n'
+    got = text(w, p, len(p))
+    check('slow: reader still streamed', got == p, got)
+    w.close()
+    rc = srv.stop()
+    check('slow: server exit status', rc == 0, rc)
+
+
+def append_packets(what, packets, alldata, kept):
+    """Appends packets one connection each, checking that every replay is the
+    end of alldata and no longer than kept bytes.
+    @returns alldata with the packets.
+    """
+    for i, p in enumerate(packets):
+        alldata += p
+        s = connect()
+        s.sendall(p)
+        got = b''
+        while not got.endswith(p) and len(got) <= kept:
+            d = s.recv(1 << 20)
+            if not d:
+                break
+            got += d
+        s.close()
+        check('%s: replay %d' % (what, i),
+              alldata.endswith(got) and got.endswith(p) and len(got) <= kept,
+              describe(got, alldata))
+    return alldata
+
+
+def segment_packets(n, first=0):
+    """Packets of 300 KiB: three fit in a segment, the fourth rolls it."""
+    size = 300 << 10
+    return [(b'%03d' % (first + i) * size)[:size - 1] + b'\n'
+            for i in range(n)]
+
+
+def check_kept(what, alldata, start, segs, backend):
+    got_start, got = snapshot()
+    check('%s: kept from %d' % (what, start),
+          got_start == start and got == alldata[start:],
+          'start %d %s' % (got_start, describe(got, alldata[start:])))
+    if backend != 'mem':
+        names = ['aesdsocketdata.%06d' % n for n in segs]
+        check('%s: segment files %s' % (what, segs), segments() == names,
+              segments())
+        m = manifest()
+        check('%s: manifest' % what,
+              int(m['first']) == segs[0] and int(m['last']) == segs[-1]
+              and int(m['start']) == start, m)
+
+
+def seglog(binary, args):
+    retain = 2 << 20
+    for backend in ('file', 'mmap', 'mem'):
+        what = 'seglog -b %s' % backend
+        clean_data()
+        srv = Server(binary, ['-b', backend, '-r', '2m'] + args)
+        # 1, 2 and 3 hold three packets each, 4 the last one; 1 is dropped
+        # once all of it is older than the last 2m, 2 is not yet
+        alldata = append_packets(what, segment_packets(10), b'',
+                                 retain + SEGMENT_LEN)
+        check_kept(what, alldata, 3 * (300 << 10), [2, 3, 4], backend)
+
+        # A packet longer than a segment gets one of its own, and 2 goes
+        big = b'B' * (3 << 19) + b'\n'
+        alldata = append_packets(what + ' long packet', [big], alldata,
+                                 retain + SEGMENT_LEN)
+        check_kept(what + ' long packet', alldata, 6 * (300 << 10),
+                   [3, 4, 5], backend)
+        start, got = snapshot()
+        check('%s: at least the last 2m kept' % what, len(got) >= retain,
+              len(got))
+
+        rc = srv.stop()
+        check('%s: server exit status' % what, rc == 0, rc)
+        left = glob.glob(DATAPATH + '*')
+        check('%s: data removed on exit' % what, not left, left)
+
+
+def handoff(binary, args):
+    clean_data()
+    opts = ['-r', '2m', '-H', HANDOFF_PATH] + args
+    old = Server(binary, opts)
+    # 1, 2 and 3 full, 4 with one packet; 1 is dropped
+    alldata = append_packets('handoff: old server', segment_packets(10),
+                             b'', 3 << 20)
+    start = 3 * (300 << 10)
+    check_kept('handoff: old server', alldata, start, [2, 3, 4], 'file')
+
+    # Kept open across the handoff: the old server serves it until it closes
+    held = connect(binary=True)
+    request(held, READ)
+    reply(held)
+    new = Server(binary, opts)
+    time.sleep(0.5)
+    p = b'held open\n'
+    request(held, APPEND, p)
+    alldata += p
+    _, _, rstart, got = reply(held)
+    check('handoff: old server serves its connection',
+          rstart == start and got == alldata[start:], describe(
+              got, alldata[start:]))
+
+    # Queued in the backlog meanwhile, served by the new server
+    result = {}
+
+    def waiting():
+        s = connect()
+        result['got'] = text(s, b'AESDSOCKET_READ:%d\n' % (len(alldata) -
+                                                            len(p)), len(p))
+        s.close()
+    w = threading.Thread(target=waiting)
+    w.start()
+    time.sleep(0.2)
+    held.close()
+    try:
+        rc = old.proc.wait(10)
+    except subprocess.TimeoutExpired:
+        rc = 'hung'
+    check('handoff: old server exits cleanly', rc == 0, rc)
+    w.join(10)
+    check('handoff: waiting client served', result.get('got') == p,
+          result.get('got'))
+
+    # Same offsets, same segments, and the retention carries on
+    check_kept('handoff: new server', alldata, start, [2, 3, 4], 'file')
+    alldata = append_packets('handoff: new server', segment_packets(3, 10),
+                             alldata, 3 << 20)
+    start = 6 * (300 << 10)
+    check_kept('handoff: new server after appends', alldata, start,
+               [3, 4, 5], 'file')
+    rc = new.stop()
+    check('handoff: new server exit status', rc == 0, rc)
+    left = glob.glob(DATAPATH + '*')
+    check('handoff: data removed on exit', not left, left)
+
+
+def binary_requests(binary, args):
+    srv = Server(binary, args)
+    rnd = random.Random(1)
+    want = b''
+
+    # Payloads are opaque: newlines and the magic byte in them don't matter
+    s = connect(binary=True)
+    maxlen = PACKET_MAX_LEN - HDR.size
+    for n in (0, 1, 2, 23, 24, 25, 1023, 1024, 1025, 65536, maxlen):
+        p = bytes(rnd.getrandbits(8) for _ in range(min(n, 4096)))
+        p = (p * (n // 4096 + 1))[:n]
+        request(s, APPEND, p)
+        want += p
+        op, status, start, got = reply(s)
+        check('binary: append of %d bytes' % n,
+              op == (APPEND if n else READ) and status == 0 and start == 0
+              and got == want, 'op %d %s' % (op, describe(got, want)))
+
+    # Pipelined, and a header split over several sends
+    frames = b''.join(HDR.pack(APPEND, 0, 0, 2, 0, 0) + b'%02d' % i
+                      for i in range(20))
+    s.sendall(frames)
+    for i in range(20):
+        want += b'%02d' % i
+        _, _, _, got = reply(s)
+        check('binary: pipelined append %d' % i, got == want[:len(got)])
+    check('binary: pipelined appends', got == want, describe(got, want))
+    frame = HDR.pack(APPEND, 0, 0, 3, 0, 0) + b'end'
+    for i in range(0, len(frame), 5):
+        s.sendall(frame[i:i+5])
+        time.sleep(0.01)
+    want += b'end'
+    _, _, _, got = reply(s)
+    check('binary: split header', got == want, describe(got, want))
+
+    # One byte over the buffer: the connection is dropped, nothing appended
+    big = connect(binary=True)
+    request(big, APPEND, b'x' * (maxlen + 1))
+    check('binary: request over PACKET_MAX_LEN closed', closed(big))
+    big.close()
+    _, got = snapshot()
+    check('binary: nothing appended by the oversized request', got == want,
+          describe(got, want))
+
+    # A seek the driver can't take: the connection is dropped
+    for a0, a1 in ((1 << 32, 0), (0, 1 << 32)):
+        bad = connect(binary=True)
+        request(bad, SEEK, a0=a0, a1=a1)
+        check('binary: seek %d,%d closed' % (a0, a1), closed(bad))
+        bad.close()
+
+    # Text clients see the same data
+    t = connect()
+    want += b'text\n'
+    got = text(t, b'text\n', len(want))
+    check('binary: text replay', got == want, describe(got, want))
+    t.close()
+    request(s, READ)
+    _, _, _, got = reply(s)
+    check('binary: read after text', got == want, describe(got, want))
+    s.close()
+    rc = srv.stop()
+    check('binary: server exit status', rc == 0, rc)
+
+
+def ranges(binary, args):
+    srv = Server(binary, args)
+    packets = [b'packet %d %s\n' % (i, b'r' * (i * 37 % 500))
+               for i in range(50)]
+    t = connect()
+    for i, p in enumerate(packets):
+        want = b''.join(packets[:i+1])
+        got = text(t, p, len(want))
+        check('ranges: append %d' % i, got == want, describe(got, want))
+    start, data = snapshot()
+    L = len(data)
+    check('ranges: data kept', start == 0 and data == want)
+
+    # An empty reply sends nothing to a text client, so each one is followed
+    # by a one byte read to tell them apart
+    mark = b'AESDSOCKET_READ:0,1\n'
+    reads = [(0, None), (0, 1), (5, 5), (10, 5), (7, None), (L - 1, None),
+             (L, None), (L + 100, None), (L - 10, L), (L - 10, L + 1),
+             (0, U64_MAX), (U64_MAX, None), (U64_MAX, U64_MAX)]
+    for lo, hi in reads:
+        if hi is None:
+            line = b'AESDSOCKET_READ:%d\n' % lo
+            hi = U64_MAX
+        else:
+            line = b'AESDSOCKET_READ:%d,%d\n' % (lo, hi)
+        a, b = clamp(lo, hi, 0, L)
+        want = data[a:b] + data[:1]
+        got = text(t, line + mark, len(want))
+        check('ranges: text %s' % line.strip().decode(), got == want,
+              describe(got, want))
+    # No numbers at all is the whole data
+    want = data + data[:1]
+    got = text(t, b'AESDSOCKET_READ:\n' + mark, len(want))
+    check('ranges: text AESDSOCKET_READ:', got == want, describe(got, want))
+
+    counts = (0, 1, 2, len(packets) - 1, len(packets), len(packets) + 1,
+              U64_MAX)
+    for n in counts:
+        want = b''.join(packets[-n:]) if n else b''
+        got = text(t, b'AESDSOCKET_LAST:%d\n' % n + mark, len(want) + 1)
+        check('ranges: text AESDSOCKET_LAST:%d' % n, got == want + data[:1],
+              describe(got, want))
+
+    # Nothing else was sent
+    t.settimeout(0.3)
+    try:
+        extra = t.recv(1)
+    except socket.timeout:
+        extra = b''
+    check('ranges: nothing sent past the replies', extra == b'', extra)
+    t.close()
+
+    b = connect(binary=True)
+    for lo, hi in reads:
+        hi = U64_MAX if hi is None else hi
+        a, e = clamp(lo, hi, 0, L)
+        request(b, RANGE, a0=lo, a1=hi)
+        op, status, rstart, got = reply(b)
+        check('ranges: binary range %d,%d' % (lo, hi),
+              op == RANGE and status == 0 and rstart == a
+              and got == data[a:e], 'start %d %s' % (rstart, describe(
+                  got, data[a:e])))
+    for n in counts:
+        want = b''.join(packets[-n:]) if n else b''
+        request(b, LAST, a0=n)
+        op, status, rstart, got = reply(b)
+        check('ranges: binary last %d' % n,
+              op == LAST and rstart == L - len(want) and got == want,
+              'start %d %s' % (rstart, describe(got, want)))
+
+    # Polling for what is new since the last reply
+    pos = L
+    for i in range(10):
+        p = b'poll %d\n' % i
+        request(b, APPEND, p)
+        reply(b)
+        request(b, RANGE, a0=pos, a1=U64_MAX)
+        _, _, rstart, got = reply(b)
+        check('ranges: poll %d' % i, rstart == pos and got == p)
+        pos += len(got)
+    b.close()
+    rc = srv.stop()
+    check('ranges: server exit status', rc == 0, rc)
+
+    # Reads before the oldest byte kept start at it
+    clean_data()
+    srv = Server(binary, ['-r', '2m'] + args)
+    alldata = append_packets('ranges: retention', segment_packets(11), b'',
+                             (2 << 20) + SEGMENT_LEN)
+    start, _ = snapshot()
+    check('ranges: retention dropped data', start > 0, start)
+    t = connect()
+    got = text(t, b'AESDSOCKET_READ:0,%d\n' % (start + 10), 10)
+    check('ranges: read before the start', got == alldata[start:start+10],
+          got)
+    t.close()
+    b = connect(binary=True)
+    request(b, RANGE, a0=0, a1=start)
+    _, _, rstart, got = reply(b)
+    check('ranges: binary range before the start',
+          rstart == start and got == b'', rstart)
+    request(b, LAST, a0=100)
+    _, _, rstart, got = reply(b)
+    check('ranges: last packets dropped',
+          rstart == start and got == alldata[start:], rstart)
+    b.close()
+    rc = srv.stop()
+    check('ranges: retention server exit status', rc == 0, rc)
+
+
+def stats(binary, args):
+    srv = Server(binary, ['-s', STATS_PATH] + args)
+    packets = [b'stats %d\n' % i for i in range(5)]
+    for i, p in enumerate(packets):
+        s = connect()
+        text(s, p, len(b''.join(packets[:i+1])))
+        s.close()
+    want = {
+        'aesdsocket_connections_accepted_total': str(len(packets)),
+        'aesdsocket_packets_appended_total': str(len(packets)),
+        'aesdsocket_received_bytes_total': str(sum(map(len, packets))),
+        'aesdsocket_data_bytes': str(sum(map(len, packets))),
+    }
+    # The counters of a connection are added after its reply
+    for _ in range(20):
+        got = scrape(STATS_PATH)
+        if all(got.get(k) == v for k, v in want.items()):
+            break
+        time.sleep(0.05)
+    for k, v in sorted(want.items()):
+        check('stats: %s' % k, got.get(k) == v, '%s, want %s' % (got.get(k), v))
+
+    # The bucket bounds are powers of two microseconds, printed exactly
+    name = 'aesdsocket_replay_seconds'
+    bounds = ['%d.%06d' % divmod(1 << b, 1000000) for b in range(24)]
+    buckets = [k[len(name)+12:-2] for k in got
+               if k.startswith(name + '_bucket{')]
+    check('stats: bucket bounds', buckets == bounds + ['+Inf'], buckets)
+    count = got.get(name + '_count')
+    check('stats: +Inf is the count',
+          got.get(name + '_bucket{le="+Inf"}') == count, count)
+    check('stats: every replay counted', count == str(len(packets)), count)
+    rc = srv.stop()
+    check('stats: server exit status', rc == 0, rc)
+
+
+def flush(binary, args):
+    packets = [b'flush %d\n' % i for i in range(5)]
+    want = b''.join(packets)
+    for mode in ('none', 'periodic', 'batch', 'packet'):
+        what = 'flush -f %s' % mode
+        clean_data()
+        srv = Server(binary, ['-f', mode, '-s', STATS_PATH] + args)
+        for i, p in enumerate(packets):
+            s = connect(binary=(i % 2 == 1))
+            if i % 2:
+                request(s, APPEND, p)
+                _, _, _, got = reply(s)
+            else:
+                got = text(s, p, len(b''.join(packets[:i+1])))
+            check('%s: replay %d' % (what, i),
+                  got == b''.join(packets[:i+1]), got)
+            s.close()
+        _, got = snapshot()
+        check('%s: data' % what, got == want, describe(got, want))
+        ondisk = b''
+        for name in segments():
+            with open(os.path.join(os.path.dirname(DATAPATH), name),
+                      'rb') as f:
+                ondisk += f.read()
+        check('%s: segment files' % what, ondisk == want,
+              describe(ondisk, want))
+        # None at all, one a second, at least one per batch and one per
+        # packet before its reply
+        if mode == 'periodic':
+            time.sleep(1.5)
+        syncs = int(scrape(STATS_PATH).get('aesdsocket_sync_seconds_count'))
+        ok = {'none': syncs == 0, 'periodic': syncs >= 1,
+              'batch': syncs >= 1, 'packet': syncs >= len(packets)}[mode]
+        check('%s: syncs' % what, ok, syncs)
+        rc = srv.stop()
+        check('%s: server exit status' % what, rc == 0, rc)
+
+
+def channels(binary, args):
+    names = ['a', 'b', 'c']
+    srv = Server(binary, ['-C', ','.join(names), '-s', STATS_PATH] + args)
+    want = {}
+    # Interleaved, each channel on its own port only replays its own data
+    for r in range(3):
+        for i, name in enumerate(names[:2 + r % 2]):
+            p = b'%s %d\n' % (name.encode(), r)
+            want[name] = want.get(name, b'') + p
+            s = connect(port=PORT + i)
+            got = text(s, p, len(want[name]))
+            check('channels: %s replay %d' % (name, r), got == want[name],
+                  describe(got, want[name]))
+            s.close()
+    for i, name in enumerate(names):
+        s = connect(binary=True, port=PORT + i)
+        request(s, READ)
+        _, _, _, got = reply(s)
+        s.close()
+        check('channels: %s data' % name, got == want[name],
+              describe(got, want[name]))
+        files = glob.glob('%s-%s.[0-9]*' % (DATAPATH, name))
+        check('channels: %s segment files' % name, len(files) == 1, files)
+        packets = scrape('%s-%s' % (STATS_PATH, name)).get(
+            'aesdsocket_packets_appended_total')
+        n = str(want[name].count(b'\n'))
+        check('channels: %s metrics' % name, packets == n,
+              '%s packets, want %s' % (packets, n))
+    rc = srv.stop()
+    check('channels: server exit status', rc == 0, rc)
+    left = glob.glob(DATAPATH + '*')
+    check('channels: data removed on exit', not left, left)
+
+
+def cache_clients(what, clients, rounds, retain):
+    """Appends rounds packets of 4 KiB from each of clients concurrent binary
+    connections, checking that every reply holds its packet, and at least the
+    last retain bytes when the server has dropped data.
+    @returns the last reply of each client, as (start, data).
+    """
+    last = {}
+
+    def client(i):
+        try:
+            s = connect(binary=True)
+            for r in range(rounds):
+                p = (b'%02d %03d ' % (i, r) * 1024)[:4095] + b'\n'
+                request(s, APPEND, p)
+                _, _, start, got = reply(s)
+                check('%s: client %d packet %d in its replay' % (what, i, r),
+                      p in got, 'start %d, %d bytes' % (start, len(got)))
+                check('%s: client %d replay %d kept' % (what, i, r),
+                      start == 0 or len(got) >= retain, len(got))
+            last[i] = (start, got)
+            s.close()
+        except (OSError, EOFError) as e:
+            check('%s: client %d' % (what, i), False, e)
+    threads = [threading.Thread(target=client, args=(i,))
+               for i in range(clients)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join(60)
+    return last
+
+
+def cache(binary, args):
+    # Without retention every append goes into the shared image: nothing is
+    # read back from the data file, and every replay is the data so far
+    srv = Server(binary, ['-c', '-s', STATS_PATH] + args)
+    last = cache_clients('cache', 8, 20, 0)
+    start, data = snapshot()
+    for i, (rstart, got) in sorted(last.items()):
+        check('cache: client %d replay is the data' % i,
+              rstart == 0 and data.startswith(got), describe(got, data))
+    loads = scrape(STATS_PATH).get('aesdsocket_cache_loads_total')
+    check('cache: no image loads', loads == '0', loads)
+    rc = srv.stop()
+    check('cache: server exit status', rc == 0, rc)
+
+    # With the byte retention the image is reloaded after every drop while
+    # replays are in flight; -r as large as a segment used to leave only the
+    # new segment right after a roll, and lose the packets of the replays
+    # deferred to the end of an event loop round
+    clean_data()
+    retain = SEGMENT_LEN
+    srv = Server(binary, ['-c', '-r', '1m'] + args)
+    last = cache_clients('cache -r 1m', 16, 40, retain)
+    start, data = snapshot()
+    check('cache -r 1m: data dropped', start > 0, start)
+    for i, (rstart, got) in sorted(last.items()):
+        # Compared where it overlaps what is kept now
+        a, e = max(rstart, start), rstart + len(got)
+        check('cache -r 1m: client %d replay is the data' % i,
+              e <= a or got[a-rstart:] == data[a-start:e-start],
+              'start %d, %d bytes, kept from %d' % (rstart, len(got), start))
+    rc = srv.stop()
+    check('cache -r 1m: server exit status', rc == 0, rc)
+
+
+SECTIONS = {
+    'lines': lines,
+    'subscribe': subscribe,
+    'slow': slow,
+    'seglog': seglog,
+    'handoff': handoff,
+    'binary': binary_requests,
+    'ranges': ranges,
+    'stats': stats,
+    'flush': flush,
+    'channels': channels,
+    'cache': cache,
+}
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(__doc__)
+        return 2
+    binary = argv[1]
+    rest = argv[2:]
+    args = []
+    if '--' in rest:
+        args = rest[rest.index('--')+1:]
+        rest = rest[:rest.index('--')]
+    names = rest or list(SECTIONS)
+    for name in names:
+        if name not in SECTIONS:
+            print('unknown section %s' % name)
+            return 2
+    for name in names:
+        print('%s %s' % (name, ' '.join(args)))
+        clean_data()
+        try:
+            SECTIONS[name](binary, args)
+        except (OSError, EOFError) as e:
+            check('%s: %s' % (name, type(e).__name__), False, e)
+            subprocess.run(['pkill', '-x', os.path.basename(binary)])
+            time.sleep(1)
+        clean_data()
+    print('%d checks failed' % len(failures) if failures else 'all passed')
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+#include "handoff.h"
+#include "backend.h"
+#include "shutdown.h"
+#include "alog.h"
+
+#define HANDOFF_MAGIC       "aesdsocket-handoff 1"
+#define HANDOFF_MAX_FDS     64          // descriptors per message
+#define HANDOFF_DRAIN_MS    5000        // then the old server shuts down
+#define HANDOFF_ACK_MS      1000        // for the new server to accept
+
+/* Comments:
+ *  A hot restart, with -H path on both servers:
+ *   1. The new server connects to the old one on the Unix socket at path,
+ *      before it creates any data, and receives the listening sockets with
+ *      SCM_RIGHTS along with the name of the backend. It only acknowledges
+ *      them if it uses the same backend; otherwise the old server carries on.
+ *   2. The old server stops listening on path and drains (see shutdown.c):
+ *      it stops accepting and serves its open connections until they close,
+ *      for up to HANDOFF_DRAIN_MS, then shuts the rest down. The listening
+ *      sockets never close meanwhile, so clients that connect wait in the
+ *      backlog instead of being refused.
+ *   3. Once its appends are over the old server hands the data over on the
+ *      same connection (the open segments, again with SCM_RIGHTS, see
+ *      seglog.c) instead of deleting it, and exits.
+ *   4. The new server adopts the data, so offsets, replays and the retention
+ *      carry on where the old one stopped, starts its own handoff socket and
+ *      starts accepting.
+ *  The new server only starts serving once the old one is done with the
+ *  data, so there is always a single appender. With -d, the new server's
+ *  parent returns once the takeover is complete.
+ *
+ *  The connection is a SOCK_SEQPACKET socket, so every message arrives whole
+ *  with its descriptors.
+ */
+
+struct handoff_hello {
+    char magic[sizeof(HANDOFF_MAGIC)];
+    char backend[16];
+    int32_t nsfds;
+};
+
+static struct {
+    bool running;
+    int lfd;                        // Listening Unix socket
+    int conn;                       // To the other server, once connected
+    bool done;                      // Our sockets were taken over
+    const int *sfds;
+    int nsfds;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pthread_t thread;
+} handoff = {
+    .running = false,
+    .lfd = -1,
+    .conn = -1,
+    .done = false
+};
+
+static void *handoff_thread(void *thread_param);
+static int handoff_offer(int cfd);
+static int handoff_addr(const char *path, struct sockaddr_un *addr);
+
+int handoff_connect(const char *path, int **sfds, int *nsfds) {
+    struct sockaddr_un addr;
+    struct handoff_hello hello;
+    int fds[HANDOFF_MAX_FDS];
+    int nfds = 0;
+    char ack = 'y';
+
+    if(handoff_addr(path, &addr)) return -1;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if(sock == -1) return -1;
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int errnoshadow = errno;
+        robustclose(sock);
+        errno = errnoshadow;
+        if(errno == ENOENT || errno == ECONNREFUSED) return 0;
+        return -1;
+    }
+
+    ssize_t rc = handoff_recvfds(sock, &hello, sizeof(hello), fds, &nfds,
+                                 HANDOFF_MAX_FDS);
+    if(rc != sizeof(hello) || memcmp(hello.magic, HANDOFF_MAGIC,
+                                     sizeof(hello.magic)) ||
+       hello.nsfds != nfds || nfds < 1) {
+        alog(LOG_ERR, "%s: not a handoff from aesdsocket", path);
+        errno = EPROTO;
+        goto errorcleanup;
+    }
+    hello.backend[sizeof(hello.backend) - 1] = '\0';
+    if(strcmp(hello.backend, backend->name) != 0) {
+        alog(LOG_ERR, "the running server uses the %s backend, not %s",
+             hello.backend, backend->name);
+        errno = EINVAL;
+        goto errorcleanup;
+    }
+    *sfds = malloc(nfds * sizeof(int));
+    if(*sfds == NULL) goto errorcleanup;
+    if(send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+        free(*sfds);
+        goto errorcleanup;
+    }
+    memcpy(*sfds, fds, nfds * sizeof(int));
+    *nsfds = nfds;
+    handoff.sfds = *sfds;
+    handoff.nsfds = nfds;
+    handoff.conn = sock;
+    alog(LOG_INFO, "took over %i listening sockets from %s", nfds, path);
+    return 1;
+
+    errorcleanup:;
+    int errnoshadow = errno;
+    for(int i = 0; i < nfds; i++)
+        robustclose(fds[i]);
+    robustclose(sock);
+    errno = errnoshadow;
+    return -1;
+}
+
+int handoff_takeover(const char *datapath) {
+    alog(LOG_DEBUG, "waiting for the old server to hand its data over");
+    int r = backend->take_over(handoff.conn, datapath);
+    if(r)
+        log_errno("handoff_takeover(): take_over()");
+    robustclose(handoff.conn);
+    handoff.conn = -1;
+    // The old server stopped accepting; -m epoll left the sockets
+    // non-blocking, which the other modes don't expect
+    for(int i = 0; i < handoff.nsfds; i++) {
+        int flags = fcntl(handoff.sfds[i], F_GETFL);
+        if(flags == -1 ||
+           fcntl(handoff.sfds[i], F_SETFL, flags & ~O_NONBLOCK) == -1)
+            log_errno("handoff_takeover(): fcntl()");
+    }
+    return r;
+}
+
+int handoff_start(const char *path, const int *sfds, int nsfds) {
+    struct sockaddr_un addr;
+    if(handoff_addr(path, &addr)) return -1;
+    strcpy(handoff.path, path);
+    handoff.sfds = sfds;
+    handoff.nsfds = nsfds;
+
+    handoff.lfd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if(handoff.lfd == -1) return -1;
+    unlink(path);       // left by a server that didn't stop cleanly
+    if(bind(handoff.lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+       listen(handoff.lfd, 1) == -1)
+        goto errorcleanup;
+    int r = pthread_create(&handoff.thread, NULL, handoff_thread, NULL);
+    if(r) {
+        errno = r;
+        unlink(path);
+        goto errorcleanup;
+    }
+    handoff.running = true;
+    alog(LOG_DEBUG, "listening for handoffs on %s", path);
+    return 0;
+
+    errorcleanup:;
+    int errnoshadow = errno;
+    robustclose(handoff.lfd);
+    handoff.lfd = -1;
+    errno = errnoshadow;
+    return -1;
+}
+
+void handoff_stop(void) {
+    if(!handoff.running) return;
+    shutdown_request(0);
+    pthread_join(handoff.thread, NULL);
+    handoff.running = false;
+    if(handoff.lfd != -1) {
+        robustclose(handoff.lfd);
+        handoff.lfd = -1;
+        unlink(handoff.path);
+    }
+}
+
+bool handoff_done(void) {
+    return handoff.done;
+}
+
+int handoff_finish(void) {
+    int r = backend->hand_over(handoff.conn);
+    if(r)
+        log_errno("handoff_finish(): hand_over()");
+    else
+        alog(LOG_INFO, "handed the data over to the new server");
+    robustclose(handoff.conn);
+    handoff.conn = -1;
+    return r;
+}
+
+static void *handoff_thread(void *thread_param) {
+    for(;;) {
+        int w = shutdown_wait(handoff.lfd);
+        if(w != 1) {
+            if(w == -1) log_errno("handoff_thread(): shutdown_wait()");
+            return thread_param;
+        }
+        int cfd = accept4(handoff.lfd, NULL, NULL, SOCK_CLOEXEC);
+        if(cfd == -1) {
+            if(errno != EINTR && errno != ECONNABORTED)
+                log_errno("handoff_thread(): accept4()");
+            continue;
+        }
+        if(handoff_offer(cfd) == 0) {
+            handoff.conn = cfd;
+            break;
+        }
+        robustclose(cfd);
+    }
+
+    // Nobody else may connect to us, the next server listens on path
+    robustclose(handoff.lfd);
+    handoff.lfd = -1;
+    unlink(handoff.path);
+    handoff.done = true;
+    alog(LOG_INFO, "a new server took the listening sockets over, draining");
+    shutdown_drain();
+
+    struct pollfd stop = { .fd = shutdown_fd(), .events = POLLIN };
+    int n;
+    while((n = poll(&stop, 1, HANDOFF_DRAIN_MS)) == -1 && errno == EINTR);
+    if(n == 0) {
+        alog(LOG_NOTICE, "connections still open after %i ms, closing them",
+             HANDOFF_DRAIN_MS);
+        shutdown_request(0);
+    }
+    return thread_param;
+}
+
+/* Sends our listening sockets to the server connected on cfd and waits for
+ * it to accept them.
+ * @returns 0 once they were accepted, -1 otherwise.
+ */
+static int handoff_offer(int cfd) {
+    struct handoff_hello hello;
+    char ack;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic));
+    strncpy(hello.backend, backend->name, sizeof(hello.backend) - 1);
+    hello.nsfds = handoff.nsfds;
+    if(handoff_sendfds(cfd, &hello, sizeof(hello), handoff.sfds,
+                       handoff.nsfds)) {
+        log_errno("handoff_offer(): sendmsg()");
+        return -1;
+    }
+    struct pollfd p = { .fd = cfd, .events = POLLIN };
+    if(poll(&p, 1, HANDOFF_ACK_MS) != 1 || recv(cfd, &ack, 1, 0) != 1 ||
+       ack != 'y') {
+        alog(LOG_NOTICE, "the new server refused the handoff");
+        return -1;
+    }
+    return 0;
+}
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_sendfds(int sock, const void *buf, size_t len,
+                    const int *fds, int nfds) {
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if(nfds > HANDOFF_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(nfds > 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    ssize_t wc;
+    while((wc = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    if(wc == -1) return -1;
+    if((size_t)wc != len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t handoff_recvfds(int sock, void *buf, size_t len,
+                        int *fds, int *nfds, int maxfds) {
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf)
+    };
+    *nfds = 0;
+    ssize_t rc;
+    while((rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+          errno == EINTR);
+    if(rc == -1) return -1;
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if(*nfds < maxfds)
+                fds[(*nfds)++] = fd;
+            else
+                robustclose(fd);
+        }
+    }
+    if(msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+        for(int i = 0; i < *nfds; i++)
+            robustclose(fds[i]);
+        *nfds = 0;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return rc;
+}
@@ -0,0 +1,57 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Connects to the server listening for handoffs on path, if there is one,
+ * and takes its listening sockets over. The old server starts draining.
+ * @returns 1 with the sockets in *sfds (malloc()ed) and *nsfds, 0 if no
+ * server is listening on path, -1 on error.
+ */
+int handoff_connect(const char *path, int **sfds, int *nsfds);
+
+/* After handoff_connect() returned 1: waits until the old server is done
+ * with the data and adopts it (backend->take_over()) instead of creating
+ * empty data.
+ * @returns 0 on success, -1 on error.
+ */
+int handoff_takeover(const char *datapath);
+
+/* Starts the thread listening for handoffs on the Unix socket at path. The
+ * first new server that connects gets the nsfds sockets of sfds, and this
+ * one drains its connections and stops, or shuts them down after
+ * HANDOFF_DRAIN_MS.
+ * @returns 0 on success, -1 on error.
+ */
+int handoff_start(const char *path, const int *sfds, int nsfds);
+
+/* Stops the thread and removes the socket, if handoff_start() was called. */
+void handoff_stop(void);
+
+/* @returns true once a new server took the listening sockets over. */
+bool handoff_done(void);
+
+/* Hands the data over to the new server (backend->hand_over()) and closes
+ * the connection to it. The data is not deleted.
+ * @returns 0 on success, -1 on error.
+ */
+int handoff_finish(void);
+
+/* Sends len bytes of buf with the nfds descriptors of fds attached, as one
+ * message on the handoff connection sock.
+ * @returns 0 on success, -1 on error.
+ */
+int handoff_sendfds(int sock, const void *buf, size_t len,
+                    const int *fds, int nfds);
+
+/* Receives one message sent by handoff_sendfds(): up to len bytes into buf
+ * and up to maxfds descriptors into fds, their number in *nfds.
+ * @returns the number of bytes received, 0 if the other side closed, -1 on
+ * error.
+ */
+ssize_t handoff_recvfds(int sock, void *buf, size_t len,
+                        int *fds, int *nfds, int maxfds);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+#include "outq.h"
+#include "stats.h"
+#include "alog.h"
+
+/* Comments:
+ *  Every handler sends a client its replies from the data file or the tail
+ *  ring (see replay.c and tail.c) and only holds a cursor into them, so the
+ *  output queue of a connection is the data between its cursor and the end
+ *  of the data file. When the client doesn't read, its socket fills up, the
+ *  handler stops reading its packets and waits for it to become writable
+ *  (EPOLLOUT, POLLOUT or a pending io_uring send); the data it owes keeps
+ *  growing with every append.
+ *
+ *  With -o the appending thread drops the clients that fall further behind
+ *  than the cap. It only looks at the stalled list, which is empty when every
+ *  client keeps up, and it only shuts the socket down: the handler that owns
+ *  the connection wakes up with an error and closes it as usual, releasing
+ *  its thread or worker, its replay and the segment or image it was reading.
+ *
+ *  Offsets are those of the tail ring, the bytes appended since the server
+ *  started, which with the file backend are also data file offsets.
+ *
+ *  Only what was appended since the socket filled up counts: a client is
+ *  behind by the distance from its position, or from where the data ended
+ *  when it stalled if that is later, to the end. So the first replay of a
+ *  new client may be far larger than the cap without getting it dropped,
+ *  and the char backend, whose replays have no position, still gets the cap
+ *  for the appends piling up while the client doesn't read.
+ */
+
+static struct {
+    uint64_t cap;
+    _Atomic uint64_t end;           // Bytes appended so far
+    atomic_int nstalled;            // Entries in stalled
+    pthread_mutex_t mutex;          // Protects stalled and the listed flags
+    LIST_HEAD(outq_head, outq_ent) stalled;
+} outq = {
+    .cap = 0,
+    .end = 0,
+    .nstalled = 0,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint64_t outq_behind(struct outq_ent *e, uint64_t end);
+static void outq_drop(struct outq_ent *e, uint64_t behind);
+
+void outq_init(uint64_t cap) {
+    outq.cap = cap;
+    atomic_store(&outq.end, 0);
+    LIST_INIT(&outq.stalled);
+}
+
+void outq_stall(struct outq_ent *e, int rsfd, uint64_t pos) {
+    atomic_store(&e->pos, pos);
+    if(outq.cap == 0) return;
+    pthread_mutex_lock(&outq.mutex);
+    uint64_t end = atomic_load(&outq.end);
+    if(!e->listed) {
+        e->rsfd = rsfd;
+        e->base = end;
+        e->listed = true;
+        LIST_INSERT_HEAD(&outq.stalled, e, nodes);
+        atomic_fetch_add(&outq.nstalled, 1);
+    }
+    uint64_t behind = outq_behind(e, end);
+    if(behind > outq.cap)
+        outq_drop(e, behind);
+    pthread_mutex_unlock(&outq.mutex);
+}
+
+void outq_progress(struct outq_ent *e, uint64_t pos) {
+    atomic_store(&e->pos, pos);
+}
+
+void outq_resume(struct outq_ent *e) {
+    if(outq.cap == 0) return;
+    pthread_mutex_lock(&outq.mutex);
+    if(e->listed) {
+        LIST_REMOVE(e, nodes);
+        e->listed = false;
+        atomic_fetch_sub(&outq.nstalled, 1);
+    }
+    pthread_mutex_unlock(&outq.mutex);
+}
+
+void outq_check(uint64_t end) {
+    struct outq_ent *e, *next;
+    atomic_store(&outq.end, end);
+    if(atomic_load(&outq.nstalled) == 0) return;
+    pthread_mutex_lock(&outq.mutex);
+    for(e = LIST_FIRST(&outq.stalled); e != NULL; e = next) {
+        next = LIST_NEXT(e, nodes);
+        uint64_t behind = outq_behind(e, end);
+        if(behind > outq.cap)
+            outq_drop(e, behind);
+    }
+    pthread_mutex_unlock(&outq.mutex);
+}
+
+/* @returns how far the stalled e is behind end. Called with outq.mutex
+ * held.
+ */
+static uint64_t outq_behind(struct outq_ent *e, uint64_t end) {
+    uint64_t pos = atomic_load(&e->pos);
+    if(pos == OUTQ_NOPOS || pos < e->base)
+        pos = e->base;
+    return (end > pos) ? end - pos : 0;
+}
+
+/* Unlists e and shuts its socket down. Called with outq.mutex held. */
+static void outq_drop(struct outq_ent *e, uint64_t behind) {
+    LIST_REMOVE(e, nodes);
+    e->listed = false;
+    atomic_fetch_sub(&outq.nstalled, 1);
+    stats_add(STATS_DROPPED, 1);
+    alog(LOG_ERR, "client on #%i fell %" PRIu64 " bytes behind, dropping it",
+           e->rsfd, behind);
+    if(shutdown(e->rsfd, SHUT_RDWR) == -1)
+        log_errno("outq_drop(): shutdown()");
+}
@@ -0,0 +1,49 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* The output backlog of one connection: how far behind the end of the data
+ * file the next byte it will be sent is. A connection is only listed while
+ * its socket is full, so clients that keep up cost nothing.
+ */
+#define OUTQ_NOPOS          UINT64_MAX  // Position the backend can't tell
+
+struct outq_ent {
+    int rsfd;                       // Socket shut down to drop the client
+    _Atomic uint64_t pos;           // Data offset of the next byte to send
+    uint64_t base;                  // Data end when the socket filled up
+    bool listed;                    // In the stalled list
+    LIST_ENTRY(outq_ent) nodes;
+};
+
+/* Sets the per-client cap.
+ * @param cap is the most bytes a client may be behind, 0 for no cap.
+ */
+void outq_init(uint64_t cap);
+
+/* Lists e as stalled: rsfd would block with the next byte to send at data
+ * offset pos, or OUTQ_NOPOS when the backend can't tell (char). Calling it
+ * again only updates pos. If the client is already further behind than the
+ * cap it is dropped right away.
+ */
+void outq_stall(struct outq_ent *e, int rsfd, uint64_t pos);
+
+/* Records that a stalled client took the bytes before pos. */
+void outq_progress(struct outq_ent *e, uint64_t pos);
+
+/* Unlists e once its output is flushed. Must be called before rsfd is
+ * closed, so the socket shut down by outq_check() is still the client's.
+ */
+void outq_resume(struct outq_ent *e);
+
+/* Records that the data file now ends at end and drops the stalled clients
+ * that are further behind than the cap: their socket is shut down, so the
+ * thread serving them sees an error or a hang up and closes it. Called for
+ * every append, from tail_append().
+ */
+void outq_check(uint64_t end);
+
+#endif /* OUTQ_H */
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "packet.h"
+#include "scan.h"
+#include "proto.h"
+
+/* Comments:
+ *  The old handlers treated every read shorter than their 1024 byte buffer as
+ *  the end of a packet. That depends on how TCP happens to segment the
+ *  stream: a packet split across reads was written in pieces (which other
+ *  clients could interleave with) and replayed once per piece, and two
+ *  packets in one read were replayed once. Here packets are delimited by
+ *  '\n' only, each one is handed over whole, and the caller replays once per
+ *  packet.
+ *
+ *  The first byte of a connection decides how it is framed. PROTO_MAGIC is
+ *  dropped and starts binary framing, where a request's length is in its
+ *  header and no byte is scanned; anything else is a text line.
+ *
+ *  Consumed packets only move start forward. The remaining bytes are moved
+ *  to the front when more room is needed, so a read holding many small
+ *  packets is not shifted once per packet.
+ *
+ *  A connection that sends one large packet after another would pay a
+ *  realloc() up and down for each one if the buffer shrank every time it
+ *  was drained, so it only goes back to PACKET_MIN_CAP once
+ *  PACKET_SHRINK_AFTER packets in a row have fitted in a quarter of it.
+ */
+
+static int packet_resize(struct packet_buf *p, size_t cap);
+static void packet_empty(struct packet_buf *p);
+
+int packet_init(struct packet_buf *p) {
+    memset(p, 0, sizeof(struct packet_buf));
+    return packet_resize(p, PACKET_MIN_CAP);
+}
+
+void packet_free(struct packet_buf *p) {
+    free(p->buf);
+    p->buf = NULL;
+    p->cap = 0;
+}
+
+void packet_reset(struct packet_buf *p) {
+    p->framing = PACKET_UNKNOWN;
+    packet_empty(p);
+    // The next connection has nothing to do with this one's packet sizes
+    if(p->cap > PACKET_MIN_CAP)
+        packet_resize(p, PACKET_MIN_CAP);
+    p->small = 0;
+}
+
+/* Drops the buffered bytes, keeping the framing of the connection. */
+static void packet_empty(struct packet_buf *p) {
+    if(p->end > p->peak) p->peak = p->end;
+    if(p->peak > p->cap / 4)
+        p->small = 0;
+    else if(p->small < PACKET_SHRINK_AFTER)
+        p->small++;
+    p->start = 0;
+    p->end = 0;
+    p->scanned = 0;
+    p->peak = 0;
+    p->buf[0] = '\0';
+    if(p->cap > PACKET_MIN_CAP && p->small >= PACKET_SHRINK_AFTER) {
+        packet_resize(p, PACKET_MIN_CAP);   // keeps the old buffer on failure
+        p->small = 0;
+    }
+}
+
+char *packet_space(struct packet_buf *p, size_t *avail) {
+    if(p->end == p->cap && p->start > 0) {
+        if(p->end > p->peak) p->peak = p->end;
+        size_t n = p->end - p->start;
+        memmove(p->buf, p->buf + p->start, n);
+        p->scanned -= p->start;
+        p->end = n;
+        p->start = 0;
+        p->buf[p->end] = '\0';
+    }
+    if(p->end == p->cap) {
+        if(p->cap >= PACKET_MAX_LEN) {
+            errno = EMSGSIZE;
+            return NULL;
+        }
+        size_t cap = p->cap * 2;
+        if(cap > PACKET_MAX_LEN) cap = PACKET_MAX_LEN;
+        if(packet_resize(p, cap)) return NULL;
+    }
+    *avail = p->cap - p->end;
+    return p->buf + p->end;
+}
+
+void packet_commit(struct packet_buf *p, size_t n) {
+    p->end += n;
+    p->buf[p->end] = '\0';
+}
+
+size_t packet_next(struct packet_buf *p) {
+    if(p->framing == PACKET_UNKNOWN) {
+        if(p->end == p->start) return 0;
+        if((unsigned char)p->buf[p->start] == PROTO_MAGIC) {
+            p->framing = PACKET_BINARY;
+            packet_consume(p, 1);
+        }
+        else {
+            p->framing = PACKET_TEXT;
+        }
+    }
+    if(p->framing == PACKET_BINARY) {
+        size_t len = proto_framelen(p->buf + p->start, p->end - p->start);
+        return (len > 0 && p->end - p->start >= len) ? len : 0;
+    }
+    size_t n = p->end - p->scanned;
+    size_t nl = scan_packet(p->buf + p->scanned, n, NULL);
+    if(nl == n) {
+        p->scanned = p->end;
+        return 0;
+    }
+    p->scanned += nl;
+    return p->scanned + 1 - p->start;
+}
+
+char *packet_data(struct packet_buf *p) {
+    return p->buf + p->start;
+}
+
+void packet_consume(struct packet_buf *p, size_t n) {
+    p->start += n;
+    if(p->scanned < p->start) p->scanned = p->start;
+    if(p->start == p->end)
+        packet_empty(p);
+}
+
+bool packet_binary(const struct packet_buf *p) {
+    return p->framing == PACKET_BINARY;
+}
+
+size_t packet_pending(const struct packet_buf *p) {
+    return p->end - p->start;
+}
+
+static int packet_resize(struct packet_buf *p, size_t cap) {
+    char *buf = realloc(p->buf, cap + 1);
+    if(buf == NULL) return -1;
+    p->buf = buf;
+    p->cap = cap;
+    p->buf[p->end] = '\0';
+    return 0;
+}
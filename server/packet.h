@@ -0,0 +1,72 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Receive buffer that frames the byte stream of one connection into packets
+ * terminated by '\n', or into binary requests when the first byte of the
+ * connection is PROTO_MAGIC (see proto.c). The buffer grows to hold a packet
+ * of any size (up to PACKET_MAX_LEN), and keeps that size until
+ * PACKET_SHRINK_AFTER packets in a row have used a quarter of it at most.
+ *
+ *  buf          start          scanned       end            cap
+ *   |  consumed  | next packet... |  not yet     |     free     |
+ *                                    searched
+ */
+struct packet_buf {
+    char *buf;              // cap+1 bytes, buf[end] is always '\0'
+    size_t cap;
+    size_t start;           // First byte of the next packet
+    size_t end;             // End of the received bytes
+    size_t scanned;         // Bytes before this hold no '\n' after start
+    int framing;            // PACKET_TEXT or PACKET_BINARY, once known
+    size_t peak;            // Largest end since the buffer was last drained
+    unsigned small;         // Drains in a row with peak <= cap / 4
+};
+
+#define PACKET_UNKNOWN      0       // Nothing received yet
+#define PACKET_TEXT         1
+#define PACKET_BINARY       2
+
+#define PACKET_MIN_CAP      1024
+#define PACKET_SHRINK_AFTER 64
+#define PACKET_MAX_LEN      (16 << 20)
+
+/* @returns 0 on success, -1 on error (errno is set). */
+int packet_init(struct packet_buf *p);
+void packet_free(struct packet_buf *p);
+
+/* Drops everything buffered, for reuse by another connection. */
+void packet_reset(struct packet_buf *p);
+
+/* Makes room for more received bytes, growing the buffer if it is full.
+ * @param avail is set to the number of bytes that fit at the returned address.
+ * @returns where to receive into, or NULL on error (errno is EMSGSIZE when
+ * a packet would be longer than PACKET_MAX_LEN).
+ */
+char *packet_space(struct packet_buf *p, size_t *avail);
+
+/* Accounts for n bytes received at the address given by packet_space(). */
+void packet_commit(struct packet_buf *p, size_t n);
+
+/* Looks for the end of the next packet, only searching the bytes that arrived
+ * since the last call (binary requests are framed by their length).
+ * @returns the length of the packet at packet_data() including its '\n' or
+ * its header, or 0 if it isn't complete yet.
+ */
+size_t packet_next(struct packet_buf *p);
+
+/* @returns true if the connection speaks the binary protocol. */
+bool packet_binary(const struct packet_buf *p);
+
+/* @returns the first byte of the next packet. */
+char *packet_data(struct packet_buf *p);
+
+/* Drops the first n bytes, the packet returned by packet_next(). */
+void packet_consume(struct packet_buf *p, size_t n);
+
+/* @returns the number of buffered bytes not consumed yet. */
+size_t packet_pending(const struct packet_buf *p);
+
+#endif /* PACKET_H */
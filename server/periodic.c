@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "aesdsocket.h"
+#include "periodic.h"
+#include "shutdown.h"
+#include "alog.h"
+
+#define PERIODIC_MAX_TASKS  8
+
+/* Comments:
+ *  The timestamps used to have a thread of their own, and every other job
+ *  that has to run on a clock (the age retention of the data file, for one)
+ *  would have wanted another. Instead the jobs are registered here at start
+ *  up and one thread runs them all from a single timerfd, armed with an
+ *  absolute time for the earliest deadline. It sleeps in shutdown_wait()
+ *  like the other threads, so it costs nothing between ticks and stops with
+ *  the server.
+ *
+ *  Deadlines advance by whole periods from when the task was started, so a
+ *  slow task doesn't make the next ones drift; ticks missed while a task ran
+ *  late are skipped rather than run back to back. If the timer can't be
+ *  read or armed again, the thread stops the server.
+ */
+
+struct periodic_task {
+    uint64_t period_ns;
+    uint64_t next;                  // CLOCK_MONOTONIC deadline
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+static struct {
+    int tfd;
+    bool running;
+    pthread_t thread;
+    int ntasks;
+    struct periodic_task tasks[PERIODIC_MAX_TASKS];
+} periodic = {
+    .tfd = -1,
+    .running = false,
+    .ntasks = 0
+};
+
+static void *periodic_thread(void *thread_param);
+static int periodic_arm(void);
+
+static uint64_t periodic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int periodic_add(unsigned period_ms, void (*fn)(void *arg), void *arg) {
+    if(periodic.ntasks == PERIODIC_MAX_TASKS || period_ms == 0) {
+        errno = (period_ms == 0) ? EINVAL : ENOSPC;
+        return -1;
+    }
+    struct periodic_task *t = &periodic.tasks[periodic.ntasks++];
+    t->period_ns = (uint64_t)period_ms * 1000000ULL;
+    t->fn = fn;
+    t->arg = arg;
+    return 0;
+}
+
+int periodic_start(void) {
+    if(periodic.ntasks == 0) return 0;
+    periodic.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if(periodic.tfd == -1) return -1;
+    uint64_t now = periodic_now();
+    for(int i = 0; i < periodic.ntasks; i++)
+        periodic.tasks[i].next = now + periodic.tasks[i].period_ns;
+    if(periodic_arm()) goto errorcleanup;
+    int r = pthread_create(&periodic.thread, NULL, periodic_thread, NULL);
+    if(r) {
+        errno = r;
+        goto errorcleanup;
+    }
+    periodic.running = true;
+    alog(LOG_DEBUG, "running %i periodic tasks", periodic.ntasks);
+    return 0;
+
+    errorcleanup:;
+    int errnoshadow = errno;
+    robustclose(periodic.tfd);
+    periodic.tfd = -1;
+    errno = errnoshadow;
+    return -1;
+}
+
+void periodic_stop(void) {
+    if(!periodic.running) return;
+    shutdown_request(0);
+    pthread_join(periodic.thread, NULL);
+    periodic.running = false;
+    robustclose(periodic.tfd);
+    periodic.tfd = -1;
+}
+
+static void *periodic_thread(void *thread_param) {
+    uint64_t expirations;
+    for(;;) {
+        int w = shutdown_wait(periodic.tfd);
+        if(w != 1) {
+            if(w == -1) log_errno("periodic_thread(): shutdown_wait()");
+            break;
+        }
+        if(read(periodic.tfd, &expirations, sizeof(expirations)) == -1) {
+            if(errno == EAGAIN || errno == EINTR) continue;
+            log_errno("periodic_thread(): timerfd read()");
+            goto errorcleanup;
+        }
+        for(int i = 0; i < periodic.ntasks; i++) {
+            struct periodic_task *t = &periodic.tasks[i];
+            if(t->next > periodic_now()) continue;
+            t->fn(t->arg);
+            uint64_t now = periodic_now();
+            while(t->next <= now)
+                t->next += t->period_ns;
+        }
+        if(periodic_arm()) {
+            log_errno("periodic_thread(): periodic_arm()");
+            goto errorcleanup;
+        }
+    }
+    return thread_param;
+
+    errorcleanup:
+    // Without the timer nothing would append the timestamps or drop old
+    // data any more, so stop the server rather than run on without them
+    shutdown_request(0);
+    return thread_param;
+}
+
+/* Sets the timer to the earliest deadline of the tasks. */
+static int periodic_arm(void) {
+    uint64_t next = periodic.tasks[0].next;
+    for(int i = 1; i < periodic.ntasks; i++)
+        if(periodic.tasks[i].next < next) next = periodic.tasks[i].next;
+    struct itimerspec its = {
+        .it_interval = { 0, 0 },
+        .it_value = {
+            .tv_sec = next / 1000000000ULL,
+            .tv_nsec = next % 1000000000ULL
+        }
+    };
+    return timerfd_settime(periodic.tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
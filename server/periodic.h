@@ -0,0 +1,18 @@
+#ifndef PERIODIC_H
+#define PERIODIC_H
+
+/* Registers fn(arg) to run every period_ms milliseconds, the first time one
+ * period after periodic_start(). Call it before periodic_start().
+ * @returns 0 on success, -1 if there are too many tasks.
+ */
+int periodic_add(unsigned period_ms, void (*fn)(void *arg), void *arg);
+
+/* Starts the timer thread that runs the registered tasks, if there are any.
+ * @returns 0 on success, -1 on error.
+ */
+int periodic_start(void);
+
+/* Stops the timer thread, waiting for a running task to return. */
+void periodic_stop(void);
+
+#endif /* PERIODIC_H */
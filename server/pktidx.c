@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pktidx.h"
+
+#define PKTIDX_LEN          65536       // packets whose offsets are kept
+
+/* Comments:
+ *  Clients that only want the last N packets (AESDSOCKET_LAST, see proto.c)
+ *  shouldn't cost a scan of the data for newlines. Every append records the
+ *  stream offset it ends at in a ring of the last PKTIDX_LEN of them, so
+ *  finding where the last N packets start is one lookup, and the replay
+ *  then only reads those.
+ *
+ *  Appends are serialised by the data file mutex already; the index has its
+ *  own mutex for the readers, which don't hold that one.
+ */
+
+static struct {
+    pthread_mutex_t mutex;          // Protects everything below
+    uint64_t *ends;                 // Stream offset after each packet
+    uint64_t count;                 // Packets appended since pktidx_init()
+    uint64_t head;                  // Stream offset of the next append
+} idx = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .ends = NULL
+};
+
+int pktidx_init(uint64_t head) {
+    idx.ends = malloc(PKTIDX_LEN * sizeof(uint64_t));
+    if(idx.ends == NULL) return -1;
+    idx.count = 0;
+    idx.head = head;
+    return 0;
+}
+
+void pktidx_destroy(void) {
+    pthread_mutex_lock(&idx.mutex);
+    free(idx.ends);
+    idx.ends = NULL;
+    pthread_mutex_unlock(&idx.mutex);
+}
+
+void pktidx_append(size_t len) {
+    pthread_mutex_lock(&idx.mutex);
+    idx.head += len;
+    if(idx.ends != NULL)
+        idx.ends[idx.count++ % PKTIDX_LEN] = idx.head;
+    pthread_mutex_unlock(&idx.mutex);
+}
+
+void pktidx_last(uint64_t n, uint64_t *start, uint64_t *end) {
+    pthread_mutex_lock(&idx.mutex);
+    *end = idx.head;
+    if(n == 0)
+        *start = idx.head;
+    else if(idx.ends == NULL || n >= idx.count || n >= PKTIDX_LEN)
+        *start = 0;             // from the oldest byte kept
+    else
+        *start = idx.ends[(idx.count - n - 1) % PKTIDX_LEN];
+    pthread_mutex_unlock(&idx.mutex);
+}
@@ -0,0 +1,29 @@
+#ifndef PKTIDX_H
+#define PKTIDX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Starts the index of the packets appended from now on. Offsets are stream
+ * offsets, as in tail.h.
+ * @param head is the stream offset of the next append: 0, or the end of the
+ * data taken over from another server (see handoff.c).
+ * @returns 0 on success, -1 on error.
+ */
+int pktidx_init(uint64_t head);
+void pktidx_destroy(void);
+
+/* Records one packet (or timestamp) of len bytes appended to the data file.
+ * Called where tail_append() is, with the same locking.
+ */
+void pktidx_append(size_t len);
+
+/* Finds the last n packets appended.
+ * @param start is set to the stream offset of the first of them, or to 0
+ * when the index doesn't go back that far.
+ * @param end is set to the stream offset right after the last one.
+ */
+void pktidx_last(uint64_t n, uint64_t *start, uint64_t *end);
+
+#endif /* PKTIDX_H */
@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "pool.h"
+#include "shutdown.h"
+#include "alog.h"
+
+/* Comments:
+ *  The listening thread only accepts. Accepted connections go into a bounded
+ *  ring buffer and the first idle worker takes them, and no thread is created
+ *  on the accept path.
+ *
+ *  A worker serves its connection while the client keeps it busy. Once the
+ *  client has nothing to send, or doesn't read its replay fast enough, and
+ *  other connections are waiting in the queue, the worker parks it in an
+ *  epoll set and takes the next one; the listening thread puts a parked
+ *  connection back in the queue when it can make progress: the client sent
+ *  something, there is room for the rest of its replay, or, for a
+ *  subscriber, there are new appends for it. So idle clients, slow readers
+ *  and subscribers only hold a worker while nobody else needs it. The
+ *  connection keeps its append_t, with the partial packet, the replay and
+ *  the subscription, while parked; the append_t of closed connections are
+ *  kept for the next ones, up to one per worker, so the buffers and data
+ *  file descriptors are mostly allocated once.
+ *
+ *  Each queued connection wakes one worker: an idle one waiting on the queue
+ *  if there is one, or else one busy worker, through its own yield eventfd,
+ *  which makes it park its connection and come back for the queued one. A
+ *  shared descriptor would wake every busy worker, and they would all park
+ *  their connections for one that only needs one of them.
+ *
+ *  When the queue is full the listening thread stops accepting, and putting
+ *  parked connections back, until a worker takes one from the queue and
+ *  signals roomfd. The extra connections wait in the kernel backlog, and the
+ *  parked ones in the epoll set.
+ *
+ *  Threads waiting on the queue sleep without a timeout; a shutdown hook
+ *  broadcasts both condition variables when the server stops. On a drain the
+ *  parked connections go back to the queue and are served until they close.
+ */
+
+struct pool_worker;
+
+struct conn_queue {
+    struct append_t **conns;        // Ring buffer of connections to serve
+    int cap;
+    int head;                       // Next connection to hand out
+    int count;
+    struct pool_worker *workers;
+    int nworkers;
+    int next;                       // Next busy worker to ask to yield
+    int idle;                       // Workers waiting in queue_pop()
+    int woken;                      // Of those, the ones signaled to wake
+    int asked;                      // Busy workers asked to yield
+    int roomfd;                     // eventfd, written when a slot frees up
+    int parkfd;                     // epoll of the parked connections
+    struct append_head_t parked;
+    struct append_head_t spare;     // append_t to reuse
+    int nspare;
+    int maxspare;
+    bool draining;                  // No more parking, ends once all closed
+    pthread_mutex_t *dfdmutex;
+    pthread_mutex_t mutex;          // Protects everything above
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct pool_worker {
+    struct conn_queue *q;
+    pthread_t thread;
+    int yieldfd;                    // eventfd, readable when it should yield
+    bool busy;                      // Serving a connection
+    bool yielding;                  // yieldfd written since it last popped
+};
+
+static void *pool_workerthread(void *thread_param);
+static void pool_accept(struct conn_queue *q, int sfd);
+static int pool_park(struct conn_queue *q, struct append_t *a);
+static void pool_unwatch(struct conn_queue *q, struct append_t *a);
+static void pool_unpark(struct conn_queue *q);
+static void pool_drain(struct conn_queue *q);
+static void pool_close(struct conn_queue *q, struct append_t *a);
+static int queue_init(struct conn_queue *q, int cap, pthread_mutex_t *dfdmutex,
+                      int maxspare);
+static void queue_destroy(struct conn_queue *q);
+static int queue_put(struct conn_queue *q, struct append_t *a);
+static struct append_t *queue_pop(struct conn_queue *q, struct pool_worker *w);
+static void pool_wake(struct conn_queue *q);
+static void pool_wakeall(void *arg);
+
+int pool_run(int sfd, pthread_mutex_t *dfdmutex, int nworkers, int qdepth) {
+    int r = -1;
+    int started = 0;
+    struct conn_queue q;
+    struct pool_worker *workers;
+
+    if(queue_init(&q, qdepth, dfdmutex, nworkers)) {
+        log_errno("pool_run(): queue_init()");
+        return -1;
+    }
+    workers = calloc(nworkers, sizeof(struct pool_worker));
+    if(workers == NULL) {
+        log_errno("pool_run(): calloc()");
+        queue_destroy(&q);
+        return -1;
+    }
+
+    if(shutdown_hook(pool_wakeall, &q)) {
+        log_errno("pool_run(): shutdown_hook()");
+        free(workers);
+        queue_destroy(&q);
+        return -1;
+    }
+    q.workers = workers;
+    for(started = 0; started < nworkers; started++) {
+        struct pool_worker *w = &workers[started];
+        w->q = &q;
+        w->yieldfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if(w->yieldfd == -1) {
+            log_errno("pool_run(): eventfd()");
+            r = -1;
+            goto errorcleanup;
+        }
+        pthread_mutex_lock(&q.mutex);
+        q.nworkers = started + 1;
+        pthread_mutex_unlock(&q.mutex);
+        r = pthread_create(&w->thread, NULL, pool_workerthread, w);
+        if(r) {
+            errno = r;
+            log_errno("pool_run(): pthread_create()");
+            robustclose(w->yieldfd);
+            pthread_mutex_lock(&q.mutex);
+            q.nworkers = started;
+            pthread_mutex_unlock(&q.mutex);
+            goto errorcleanup;
+        }
+    }
+    alog(LOG_DEBUG, "started %i workers, queue depth %i", nworkers, qdepth);
+
+    while(flag_accepting_connections) {
+        pthread_mutex_lock(&q.mutex);
+        bool full = (q.count == q.cap);
+        pthread_mutex_unlock(&q.mutex);
+        struct pollfd fds[4] = {
+            { .fd = full ? -1 : sfd,      .events = POLLIN },
+            { .fd = full ? -1 : q.parkfd, .events = POLLIN },
+            { .fd = shutdown_drain_fd(),  .events = POLLIN },
+            { .fd = q.roomfd,             .events = POLLIN }
+        };
+        int w = shutdown_poll(fds, 4);
+        if(w == -1) {
+            log_errno("pool_run(): shutdown_poll()");
+            goto errorcleanup;
+        }
+        if(w == 0) break;
+        if(fds[2].revents) {
+            pool_drain(&q);
+            break;
+        }
+        uint64_t count;
+        if(fds[3].revents && read(q.roomfd, &count, sizeof(count)) == -1)
+            log_errno("pool_run(): eventfd read()");
+        if(fds[1].revents)
+            pool_unpark(&q);
+        if(fds[0].revents)
+            pool_accept(&q, sfd);
+    }
+    r = 0;
+
+    errorcleanup:
+    if(r) {
+        r = -1;
+        shutdown_request(0);
+    }
+    // The hooks may still be running for the request or drain that ended
+    // the loop, so wake the workers here as well before unhooking
+    pool_wakeall(&q);
+    shutdown_unhook(pool_wakeall, &q);
+    for(int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        robustclose(workers[i].yieldfd);
+    }
+    free(workers);
+    queue_destroy(&q);
+    return r;
+}
+
+static void *pool_workerthread(void *thread_param) {
+    struct pool_worker *w = (struct pool_worker *)thread_param;
+    struct append_t *a;
+    while((a = queue_pop(w->q, w)) != NULL) {
+        int r = appendserve(a, w->yieldfd);
+        if(r == 1 && pool_park(w->q, a) == 0)
+            continue;
+        if(r == 1)
+            r = appendserve(a, -1);     // draining, see it to the end
+        a->ret = r;
+        pool_close(w->q, a);
+    }
+    return thread_param;
+}
+
+/* Accepts a connection and queues it with an append_t of its own. */
+static void pool_accept(struct conn_queue *q, int sfd) {
+    struct append_t *a;
+    int rsfd = acceptconnection(sfd);
+    if(rsfd == -1) {
+        if(errno != EAGAIN)
+            log_errno("pool_accept(): acceptconnection()");
+        return;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    a = TAILQ_FIRST(&q->spare);
+    if(a != NULL) {
+        TAILQ_REMOVE(&q->spare, a, nodes);
+        q->nspare--;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    if(a == NULL) {
+        a = allocappend(q->dfdmutex);
+        if(a == NULL) {
+            log_errno("pool_accept(): allocappend()");
+            closesocket(rsfd);
+            return;
+        }
+    }
+
+    a->rsfd = rsfd;
+    if(appendopen(a)) {
+        pool_close(q, a);
+        return;
+    }
+    pthread_mutex_lock(&q->mutex);
+    int r = queue_put(q, a);
+    pthread_mutex_unlock(&q->mutex);
+    if(r)
+        pool_close(q, a);
+}
+
+/* Parks a's connection until its client (or, for a subscriber, the tail of
+ * the data) has something for it.
+ * @returns 0 on success, -1 if it can't be parked and the worker keeps it.
+ */
+static int pool_park(struct conn_queue *q, struct append_t *a) {
+    int r = -1;
+    // A replay or subscriber waiting for room only wakes up for it
+    bool full = a->replaying || a->tail_blocked;
+    struct epoll_event ev = {
+        .events = a->replaying ? EPOLLOUT :
+                  EPOLLIN|EPOLLRDHUP|(a->tail_blocked ? EPOLLOUT : 0),
+        .data.ptr = a
+    };
+    struct epoll_event tailev = { .events = EPOLLIN, .data.ptr = a };
+
+    pthread_mutex_lock(&q->mutex);
+    if(q->draining)
+        goto errorcleanup;
+    if(epoll_ctl(q->parkfd, EPOLL_CTL_ADD, a->rsfd, &ev) == -1) {
+        log_errno("pool_park(): epoll_ctl()");
+        goto errorcleanup;
+    }
+    if(a->subscribed && !full &&
+       epoll_ctl(q->parkfd, EPOLL_CTL_ADD, a->tail.efd, &tailev) == -1) {
+        log_errno("pool_park(): epoll_ctl()");
+        epoll_ctl(q->parkfd, EPOLL_CTL_DEL, a->rsfd, NULL);
+        goto errorcleanup;
+    }
+    TAILQ_INSERT_TAIL(&q->parked, a, nodes);
+    r = 0;
+    errorcleanup:
+    pthread_mutex_unlock(&q->mutex);
+    return r;
+}
+
+/* Stops watching a parked connection. Called with q->mutex held. */
+static void pool_unwatch(struct conn_queue *q, struct append_t *a) {
+    TAILQ_REMOVE(&q->parked, a, nodes);
+    epoll_ctl(q->parkfd, EPOLL_CTL_DEL, a->rsfd, NULL);
+    if(a->subscribed)   // ENOENT if it waited for room
+        epoll_ctl(q->parkfd, EPOLL_CTL_DEL, a->tail.efd, NULL);
+}
+
+/* Puts the parked connection that has something to do back in the queue.
+ * Events are taken one at a time: unwatching a connection also drops its
+ * other pending event, so none can refer to a connection closed since.
+ */
+static void pool_unpark(struct conn_queue *q) {
+    struct epoll_event ev;
+    int r = 0;
+    pthread_mutex_lock(&q->mutex);
+    int n = epoll_wait(q->parkfd, &ev, 1, 0);
+    if(n == 1) {
+        pool_unwatch(q, ev.data.ptr);
+        r = queue_put(q, ev.data.ptr);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    if(n == -1 && errno != EINTR)
+        log_errno("pool_unpark(): epoll_wait()");
+    if(r)
+        pool_close(q, ev.data.ptr);
+}
+
+/* Stops parking and puts every parked connection back in the queue, for the
+ * workers to serve them until they close.
+ */
+static void pool_drain(struct conn_queue *q) {
+    pthread_mutex_lock(&q->mutex);
+    q->draining = true;
+    while(!TAILQ_EMPTY(&q->parked)) {
+        struct append_t *a = TAILQ_FIRST(&q->parked);
+        pool_unwatch(q, a);
+        if(queue_put(q, a)) {
+            // Shut down meanwhile, queue_destroy() closes it
+            TAILQ_INSERT_TAIL(&q->parked, a, nodes);
+            break;
+        }
+    }
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* Closes a's connection and keeps a for the next one, or frees it. */
+static void pool_close(struct conn_queue *q, struct append_t *a) {
+    appendclose(a);
+    closesocket(a->rsfd);
+    a->rsfd = -1;
+    pthread_mutex_lock(&q->mutex);
+    if(q->nspare < q->maxspare) {
+        TAILQ_INSERT_TAIL(&q->spare, a, nodes);
+        q->nspare++;
+        a = NULL;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    if(a != NULL)
+        freeappend(a);
+}
+
+static int queue_init(struct conn_queue *q, int cap, pthread_mutex_t *dfdmutex,
+                      int maxspare) {
+    q->conns = malloc(cap * sizeof(struct append_t *));
+    if(q->conns == NULL) return -1;
+    q->roomfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(q->roomfd == -1) {
+        free(q->conns);
+        return -1;
+    }
+    q->parkfd = epoll_create1(EPOLL_CLOEXEC);
+    if(q->parkfd == -1) {
+        robustclose(q->roomfd);
+        free(q->conns);
+        return -1;
+    }
+    q->cap = cap;
+    q->head = 0;
+    q->count = 0;
+    q->workers = NULL;
+    q->nworkers = 0;
+    q->next = 0;
+    q->idle = 0;
+    q->woken = 0;
+    q->asked = 0;
+    TAILQ_INIT(&q->parked);
+    TAILQ_INIT(&q->spare);
+    q->nspare = 0;
+    q->maxspare = maxspare;
+    q->draining = false;
+    q->dfdmutex = dfdmutex;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+/* Closes the connections nobody picked up and frees the queue. */
+static void queue_destroy(struct conn_queue *q) {
+    struct append_t *a;
+    for(; q->count > 0; q->count--) {
+        a = q->conns[q->head];
+        q->head = (q->head + 1) % q->cap;
+        appendclose(a);
+        closesocket(a->rsfd);
+        freeappend(a);
+    }
+    while((a = TAILQ_FIRST(&q->parked)) != NULL) {
+        pool_unwatch(q, a);
+        appendclose(a);
+        closesocket(a->rsfd);
+        freeappend(a);
+    }
+    while((a = TAILQ_FIRST(&q->spare)) != NULL) {
+        TAILQ_REMOVE(&q->spare, a, nodes);
+        freeappend(a);
+    }
+    robustclose(q->parkfd);
+    robustclose(q->roomfd);
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->conns);
+}
+
+/* Adds a to the queue and wakes a worker for it. The listening thread only
+ * puts connections while there is room, except when draining, where it waits
+ * for it. Called with q->mutex held.
+ * @returns 0 on success, -1 if the server stopped before a slot freed up.
+ */
+static int queue_put(struct conn_queue *q, struct append_t *a) {
+    while(q->count == q->cap && flag_accepting_connections)
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    if(q->count == q->cap)
+        return -1;
+    q->conns[(q->head + q->count) % q->cap] = a;
+    q->count++;
+    pool_wake(q);
+    return 0;
+}
+
+/* Takes the oldest connection from the queue for w, waiting while the queue
+ * is empty.
+ * @returns The connection, or NULL once the server stops accepting
+ * connections (or drains and has no connection left to serve).
+ */
+static struct append_t *queue_pop(struct conn_queue *q, struct pool_worker *w) {
+    struct append_t *a = NULL;
+    uint64_t count;
+    pthread_mutex_lock(&q->mutex);
+    w->busy = false;
+    if(w->yielding) {
+        // Whichever connection it yielded for, it is here for one now
+        if(read(w->yieldfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+            log_errno("queue_pop(): eventfd read()");
+        w->yielding = false;
+        q->asked--;
+    }
+    while(q->count == 0 && flag_accepting_connections &&
+          !(q->draining && TAILQ_EMPTY(&q->parked))) {
+        q->idle++;
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+        q->idle--;
+        if(q->woken > 0) q->woken--;
+    }
+    if(q->count > 0 && flag_accepting_connections) {
+        uint64_t one = 1;
+        a = q->conns[q->head];
+        q->head = (q->head + 1) % q->cap;
+        if(q->count-- == q->cap && write(q->roomfd, &one, sizeof(one)) == -1)
+            log_errno("queue_pop(): eventfd write()");
+        pthread_cond_signal(&q->not_full);
+        w->busy = true;
+        // Connections queued while every worker was busy and asked to yield
+        // got nobody; w can be asked now
+        pool_wake(q);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return a;
+}
+
+/* Wakes one more worker if there are more queued connections than workers
+ * already on their way: an idle one that wasn't woken yet, or else the next
+ * busy one not already asked to yield. Called with q->mutex held.
+ */
+static void pool_wake(struct conn_queue *q) {
+    uint64_t one = 1;
+    if(q->count <= q->woken + q->asked)
+        return;
+    if(q->idle > q->woken) {
+        q->woken++;
+        pthread_cond_signal(&q->not_empty);
+        return;
+    }
+    for(int i = 0; i < q->nworkers; i++) {
+        struct pool_worker *w = &q->workers[(q->next + i) % q->nworkers];
+        if(w->busy && !w->yielding) {
+            q->next = (q->next + i + 1) % q->nworkers;
+            w->yielding = true;
+            q->asked++;
+            if(write(w->yieldfd, &one, sizeof(one)) == -1)
+                log_errno("pool_wake(): eventfd write()");
+            return;
+        }
+    }
+}
+
+/* Shutdown hook: wakes every thread waiting on the queue so it sees that
+ * flag_accepting_connections is down.
+ */
+static void pool_wakeall(void *arg) {
+    struct conn_queue *q = arg;
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+}
@@ -0,0 +1,21 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+/* Runs the worker pool server mode: the calling thread accepts connections on
+ * sfd and queues them, nworkers threads take them from the queue and serve
+ * them with appendserve(). A worker parks its connection when the client is
+ * idle and others are queued, and it is queued again once the client sends
+ * something. When qdepth connections are already waiting, accepting pauses
+ * until a worker frees a slot. Returns when flag_accepting_connections goes
+ * false and all the workers have exited.
+ * @param sfd is the bound and listening socket.
+ * @param dfdmutex is the mutex protecting writes to the data file.
+ * @param nworkers is the number of worker threads to start.
+ * @param qdepth is the capacity of the connection queue.
+ * @returns 0 on success, -1 on error (errno is set).
+ */
+int pool_run(int sfd, pthread_mutex_t *dfdmutex, int nworkers, int qdepth);
+
+#endif /* POOL_H */
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <errno.h>
+#include <endian.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+#include "aesdsocket.h"
+#include "proto.h"
+#include "replay.h"
+#include "backend.h"
+#include "pktidx.h"
+#include "alog.h"
+
+/* Comments:
+ *  Text clients send lines: the line is appended, or it is one of the
+ *  AESDCHAR_IOCSEEKTO:X,Y and AESDSOCKET_SUBSCRIBE commands, and every line
+ *  is answered with the whole data file. Finding the end of a line and
+ *  telling the commands apart means scanning every byte received.
+ *
+ *  Clients that only want part of the data ask for it instead of taking the
+ *  whole file every time:
+ *      AESDSOCKET_READ:X,Y     the bytes at offsets [X, Y) that are kept,
+ *                              Y may be left out for "up to the end"
+ *      AESDSOCKET_LAST:N       the last N packets (timestamps count)
+ *  A client polling for new data asks for [end of the last reply, end), and
+ *  the replay reads only those bytes, from the cached image with -c. The
+ *  last N packets are found with the packet offset index (pktidx.c) rather
+ *  than by looking for newlines. With the char backend the offsets are the
+ *  driver's, which only keeps its last writes, so its window moves under X
+ *  and Y; the last N packets are the ones at the end of the window.
+ *
+ *  A connection whose first byte is PROTO_MAGIC (0xAE, which no text client
+ *  sends) speaks the binary protocol instead, on the same port. Every request
+ *  is a fixed struct proto_hdr followed by len bytes, so packet.c frames it
+ *  from the length alone and nothing looks at the payload:
+ *      PROTO_APPEND    appends the len bytes as they are
+ *      PROTO_SEEK      sends AESDCHAR_IOCSEEKTO arg[0],arg[1] to the driver
+ *      PROTO_READ      only asks for the data
+ *      PROTO_RANGE     asks for the bytes [arg[0], arg[1]), like AESDSOCKET_READ
+ *      PROTO_LAST      asks for the last arg[0] packets, like AESDSOCKET_LAST
+ *  Each one is answered with a struct proto_reply giving the offset and the
+ *  length of the data that follows: the data kept when the reply starts.
+ *  The client reads exactly that many bytes, and they are exactly the ones
+ *  announced (see replay_range()).
+ *
+ *  Both protocols end up as a struct proto_cmd, so the engines handle
+ *  requests the same way whichever protocol they came in.
+ */
+
+_Static_assert(sizeof(struct proto_hdr) == 24, "proto_hdr is a wire format");
+_Static_assert(sizeof(struct proto_reply) == 24, "proto_reply is a wire format");
+
+static const char *proto_textargs(const char *pkt, size_t pktlen,
+                                  const char *name);
+static void proto_clamp(off_t *start, off_t *end, uint64_t lo, uint64_t hi);
+
+size_t proto_framelen(const char *buf, size_t n) {
+    struct proto_hdr hdr;
+    if(n < sizeof(hdr)) return 0;
+    memcpy(&hdr, buf, sizeof(hdr));
+    return sizeof(hdr) + ntohl(hdr.len);
+}
+
+int proto_parse(const char *pkt, size_t pktlen, bool binary,
+                struct proto_cmd *cmd) {
+    cmd->binary = binary;
+    if(!binary) {
+        ssize_t ioccmdpos;
+        const char *args;
+        if(is_subscribe_command(pkt, pktlen)) {
+            cmd->op = PROTO_SUBSCRIBE;
+        }
+        else if((args = proto_textargs(pkt, pktlen,
+                                       AESD_SOCKET_READ_STRING)) != NULL) {
+            cmd->op = PROTO_RANGE;
+            cmd->start = 0;
+            cmd->end = UINT64_MAX;
+            sscanf(args, "%" SCNu64 ",%" SCNu64, &cmd->start, &cmd->end);
+        }
+        else if((args = proto_textargs(pkt, pktlen,
+                                       AESD_SOCKET_LAST_STRING)) != NULL) {
+            cmd->op = PROTO_LAST;
+            cmd->count = 0;
+            sscanf(args, "%" SCNu64, &cmd->count);
+        }
+        else if((ioccmdpos = find_ioc_command(pkt, pktlen)) >= 0) {
+            cmd->op = PROTO_SEEK;
+            parse_ioc_command(pkt, ioccmdpos, &cmd->seekto);
+        }
+        else {
+            cmd->op = PROTO_APPEND;
+            cmd->data = pkt;
+            cmd->len = pktlen;
+        }
+        return 0;
+    }
+
+    struct proto_hdr hdr;
+    memcpy(&hdr, pkt, sizeof(hdr));
+    cmd->op = hdr.op;
+    cmd->data = pkt + sizeof(hdr);
+    cmd->len = pktlen - sizeof(hdr);
+    switch(hdr.op) {
+        case PROTO_APPEND:
+            if(cmd->len == 0)
+                cmd->op = PROTO_READ;   // nothing to append
+            return 0;
+        case PROTO_SEEK:
+            // struct aesd_seekto only has room for 32 bits each
+            if(be64toh(hdr.arg[0]) > UINT32_MAX ||
+               be64toh(hdr.arg[1]) > UINT32_MAX) {
+                alog(LOG_ERR, "binary seek out of range");
+                errno = EPROTO;
+                return -1;
+            }
+            cmd->seekto.write_cmd = be64toh(hdr.arg[0]);
+            cmd->seekto.write_cmd_offset = be64toh(hdr.arg[1]);
+            return 0;
+        case PROTO_READ:
+            return 0;
+        case PROTO_RANGE:
+            cmd->start = be64toh(hdr.arg[0]);
+            cmd->end = be64toh(hdr.arg[1]);
+            return 0;
+        case PROTO_LAST:
+            cmd->count = be64toh(hdr.arg[0]);
+            return 0;
+        default:
+            alog(LOG_ERR, "unknown binary request %u", hdr.op);
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+int proto_subscribed(const struct proto_cmd *cmd) {
+    if(cmd->op == PROTO_APPEND || cmd->op == PROTO_SUBSCRIBE)
+        return 0;
+    alog(LOG_ERR, "subscribed client sent a request other than an append");
+    errno = EPROTO;
+    return -1;
+}
+
+void proto_rewind(struct replay_t *r, const struct proto_cmd *cmd, int dfd) {
+    replay_rewind(r);
+    if(!cmd->binary && cmd->op != PROTO_RANGE && cmd->op != PROTO_LAST)
+        return;
+
+    // What is kept now. The retention may move start while we reply, and then
+    // the replay fails rather than sending fewer bytes; not with -c, where
+    // the replay holds the image the range is taken from
+    off_t start, end;
+    if(replay_snapshot(r, dfd, &start, &end)) {
+        start = backend->start();
+        end = backend->size();
+    }
+    if(start == -1 || end == -1 || end < start)
+        start = end = 0;
+    if(cmd->op == PROTO_RANGE) {
+        proto_clamp(&start, &end, cmd->start, cmd->end);
+    }
+    else if(cmd->op == PROTO_LAST) {
+        uint64_t from, to;
+        pktidx_last(cmd->count, &from, &to);
+        if(!backend->follows_appends) {
+            // The driver's window ends where the stream does
+            from = (to - from < (uint64_t)end) ? end - (to - from) : 0;
+            to = end;
+        }
+        proto_clamp(&start, &end, from, to);
+    }
+    replay_range(r, start, end);
+    if(!cmd->binary) return;
+    struct proto_reply reply = {
+        .op = cmd->op,
+        .status = 0,
+        .start = htobe64(start),
+        .len = htobe64(end - start)
+    };
+    replay_prefix(r, &reply, sizeof(reply));
+}
+
+/* @returns the arguments of the text command name if pkt is one, or NULL. */
+static const char *proto_textargs(const char *pkt, size_t pktlen,
+                                  const char *name) {
+    size_t l = strlen(name);
+    if(pktlen <= l || memcmp(pkt, name, l) != 0 || pkt[l] != ':')
+        return NULL;
+    return pkt + l + 1;
+}
+
+/* Narrows [*start, *end) down to the part of it inside [lo, hi). */
+static void proto_clamp(off_t *start, off_t *end, uint64_t lo, uint64_t hi) {
+    if(lo > (uint64_t)*start)
+        *start = (lo < (uint64_t)*end) ? (off_t)lo : *end;
+    if(hi < (uint64_t)*end)
+        *end = (hi > (uint64_t)*start) ? (off_t)hi : *start;
+}
@@ -0,0 +1,85 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "replay.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#define PROTO_MAGIC         0xAE    // First byte of a binary connection
+
+/* Header of a binary request, followed by len bytes. Integers are in network
+ * byte order.
+ */
+struct proto_hdr {
+    uint8_t op;                     // One of enum proto_op but SUBSCRIBE
+    uint8_t flags;                  // 0
+    uint16_t reserved;
+    uint32_t len;                   // Bytes following the header
+    uint64_t arg[2];                // PROTO_SEEK: write_cmd, write_cmd_offset
+                                    //   (up to UINT32_MAX)
+                                    // PROTO_RANGE: start, end
+                                    // PROTO_LAST: packets, 0
+};
+
+/* Header of the reply to a binary request, followed by len bytes of data
+ * starting at offset start.
+ */
+struct proto_reply {
+    uint8_t op;                     // The request's
+    uint8_t status;                 // 0
+    uint8_t reserved[6];
+    uint64_t start;
+    uint64_t len;
+};
+
+enum proto_op {
+    PROTO_APPEND = 1,               // Append the bytes, reply with the data
+    PROTO_SEEK = 2,                 // AESDCHAR_IOCSEEKTO, reply with the data
+    PROTO_READ = 3,                 // Reply with the data
+    PROTO_RANGE = 4,                // Reply with the data in [start, end)
+    PROTO_LAST = 5,                 // Reply with the last packets appended
+    PROTO_SUBSCRIBE = 0x80          // AESDSOCKET_SUBSCRIBE, text only
+};
+
+/* A request of either protocol, parsed from one packet. */
+struct proto_cmd {
+    enum proto_op op;
+    bool binary;                    // Reply with a struct proto_reply
+    const char *data;               // PROTO_APPEND: bytes to append
+    size_t len;
+    struct aesd_seekto seekto;      // PROTO_SEEK
+    uint64_t start;                 // PROTO_RANGE
+    uint64_t end;
+    uint64_t count;                 // PROTO_LAST
+};
+
+/* For packet.c: the length of the binary request starting at buf, of which
+ * n bytes were received.
+ * @returns the length with the header, or 0 if the header isn't complete.
+ */
+size_t proto_framelen(const char *buf, size_t n);
+
+/* Parses the packet pkt of pktlen bytes, a text line or a binary request
+ * framed by packet_next().
+ * @returns 0 on success, -1 if the binary request is not valid.
+ */
+int proto_parse(const char *pkt, size_t pktlen, bool binary,
+                struct proto_cmd *cmd);
+
+/* Checks that a subscribed connection may send cmd: an append, whose packet
+ * it gets with the stream, or AESDSOCKET_SUBSCRIBE again. A reply to
+ * anything else couldn't be told apart from the stream.
+ * @returns 0, or -1 with errno set to EPROTO.
+ */
+int proto_subscribed(const struct proto_cmd *cmd);
+
+/* Starts the replay of dfd that answers cmd: the whole data file, or the part
+ * of it a PROTO_RANGE or PROTO_LAST asked for; for a binary request only the
+ * data kept right now, after its reply header.
+ */
+void proto_rewind(struct replay_t *r, const struct proto_cmd *cmd, int dfd);
+
+#endif /* PROTO_H */
@@ -0,0 +1,722 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <poll.h>
+
+#include "aesdsocket.h"
+#include "reactor.h"
+#include "replay.h"
+#include "packet.h"
+#include "proto.h"
+#include "cache.h"
+#include "writer.h"
+#include "tail.h"
+#include "pktidx.h"
+#include "outq.h"
+#include "stats.h"
+#include "shutdown.h"
+#include "backend.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "alog.h"
+
+#define REACTOR_MAX_EVENTS  64
+#define REACTOR_BUF_LEN     1024    // replay bounce buffer, as appenddata()
+
+static char reactor_shutdown_tag;       // epoll data.ptr of the shutdown fd
+static char reactor_drain_tag;          // epoll data.ptr of the drain fd
+
+/* Comments:
+ *  Every event loop owns an epoll instance and a data file descriptor. The
+ *  listening socket is registered in all of them with EPOLLEXCLUSIVE, so the
+ *  kernel wakes a single loop per incoming connection and that loop keeps the
+ *  client for its whole life. All sockets are non-blocking.
+ *
+ *  A connection is receiving, appending or replaying. Received bytes are
+ *  framed into packets (see packet.c); each complete packet is appended and
+ *  then replayed, one at a time, before the next one buffered is looked at.
+ *  While a packet is in flight we stop watching EPOLLIN, which keeps the
+ *  replies in order and pushes back on clients that don't read them.
+ *
+ *  With the writer thread (-g) an append is queued with writer_submit() and
+ *  the connection waits, unwatched, until the writer hands it back through
+ *  the loop's completion list and wakes the loop with its eventfd. The loop
+ *  never blocks on the data file mutex.
+ *
+ *  With the replay cache (-c) the replays don't start right after their
+ *  appends but at the end of the loop's round, once every packet the round
+ *  received is in the data file: the replays of a burst then all find the
+ *  same image, so it is read from the data once for all of them instead of
+ *  once per client after each append moved the generation on (see cache.c).
+ *
+ *  A subscribed connection (AESDSOCKET_SUBSCRIBE) gets one replay and then
+ *  only the new appends. The appending thread queues it on the loop's
+ *  tail_ready list and wakes the loop through the same eventfd; while it is
+ *  receiving the loop sends it what is new, watching EPOLLOUT when its socket
+ *  is full.
+ *
+ *  A connection whose socket is full is listed as stalled while it waits for
+ *  EPOLLOUT (see outq.c). With -o it is dropped once it falls too far behind,
+ *  and the hang up closes it like any other.
+ *
+ *  The shutdown eventfd is in every epoll set too, so epoll_wait() has no
+ *  timeout and an idle loop doesn't wake up until there is something to do.
+ *  So is the drain eventfd: on a drain (see handoff.c) the loop stops
+ *  watching the listening socket and returns once its last connection is
+ *  closed.
+ */
+
+enum reactor_state {
+    CONN_RECEIVING,
+    CONN_APPENDING,                 // The writer thread owns req and the packet
+    CONN_REPLAYING
+};
+
+struct reactor_loop;
+
+struct reactor_conn {
+    int rsfd;                       // Socket file descriptor
+    uint32_t events;                // Events currently watched by epoll
+    enum reactor_state state;
+    size_t pktlen;                  // Packet being appended or replayed
+    struct proto_cmd cmd;           // The request it holds
+    bool closing;                   // Close as soon as the writer is done
+    struct reactor_loop *loop;
+    struct writer_req req;          // Append queued on the writer thread
+    struct reactor_conn *done_next; // Link in loop->done_head
+    struct packet_buf in;           // Received bytes, framed into packets
+    struct replay_t replay;         // Replay state, borrows buf
+    struct tail_sub tail;           // New appends, once subscribed
+    bool subscribed;
+    bool tail_ready;                // In loop->tail_ready
+    LIST_ENTRY(reactor_conn) tail_nodes;
+    bool replay_queued;             // In loop->replays
+    LIST_ENTRY(reactor_conn) replay_nodes;
+    struct outq_ent out;            // Listed while rsfd is full
+    bool closed;                    // Closed, freed at the end of the round
+    struct reactor_conn *closed_next; // Link in loop->closed_head
+    char buf[REACTOR_BUF_LEN+1];    // Replay bounce buffer
+    LIST_ENTRY(reactor_conn) nodes;
+};
+
+struct reactor_loop {
+    int epfd;                       // epoll instance
+    int sfd;                        // Listening socket file descriptor
+    int dfd;                        // Data file descriptor
+    int wakefd;                     // eventfd signalled by the writer thread
+    pthread_mutex_t *dfdmutex;      // Mutex for data file descriptor
+    pthread_mutex_t done_mutex;     // Protects done_head and tail_ready
+    struct reactor_conn *done_head; // Appends finished by the writer
+    LIST_HEAD(tail_ready_head, reactor_conn) tail_ready; // Subscribers to feed
+    LIST_HEAD(replay_head, reactor_conn) replays;   // To start after the round
+    struct reactor_conn *closed_head; // Closed conns still in events[]
+    int inflight;                   // Appends queued on the writer
+    bool draining;                  // Not accepting, ends with the last conn
+    pthread_t thread;               // Thread ID
+    int ret;                        // Return value
+    LIST_HEAD(conn_head, reactor_conn) conns;
+};
+
+static void *reactor_loopthread(void *thread_param);
+static int reactor_loop(struct reactor_loop *loop);
+static void reactor_accept(struct reactor_loop *loop);
+static int reactor_receive(struct reactor_loop *loop, struct reactor_conn *c);
+static int reactor_replay(struct reactor_loop *loop, struct reactor_conn *c);
+static int reactor_process(struct reactor_loop *loop, struct reactor_conn *c);
+static int reactor_startreplay(struct reactor_loop *loop,
+                               struct reactor_conn *c);
+static int reactor_defer(struct reactor_loop *loop, struct reactor_conn *c);
+static void reactor_replays(struct reactor_loop *loop);
+static void reactor_appended(struct writer_req *req);
+static void reactor_completions(struct reactor_loop *loop);
+static int reactor_tail(struct reactor_loop *loop, struct reactor_conn *c);
+static int reactor_stall(struct reactor_loop *loop, struct reactor_conn *c);
+static void reactor_tailready(struct tail_sub *s);
+static int reactor_watch(struct reactor_loop *loop, struct reactor_conn *c,
+                         uint32_t events);
+static void reactor_close(struct reactor_loop *loop, struct reactor_conn *c);
+static void reactor_reap(struct reactor_loop *loop);
+
+int reactor_run(int sfd, pthread_mutex_t *dfdmutex, int nloops) {
+    int r = -1;
+    int started = 0;
+    struct reactor_loop *loops = calloc(nloops, sizeof(struct reactor_loop));
+    if(loops == NULL) {
+        log_errno("reactor_run(): calloc()");
+        return -1;
+    }
+
+    int flags = fcntl(sfd, F_GETFL);
+    if(flags == -1 || fcntl(sfd, F_SETFL, flags|O_NONBLOCK) == -1) {
+        log_errno("reactor_run(): fcntl()");
+        goto errorcleanup;
+    }
+
+    for(started = 0; started < nloops; started++) {
+        struct reactor_loop *loop = &loops[started];
+        loop->sfd = sfd;
+        loop->dfdmutex = dfdmutex;
+        LIST_INIT(&loop->conns);
+        LIST_INIT(&loop->tail_ready);
+        LIST_INIT(&loop->replays);
+
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epfd == -1) {
+            log_errno("reactor_run(): epoll_create1()");
+            goto errorcleanup;
+        }
+        loop->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if(loop->wakefd == -1) {
+            log_errno("reactor_run(): eventfd()");
+            robustclose(loop->epfd);
+            goto errorcleanup;
+        }
+        struct epoll_event ev = {
+            .events = EPOLLIN|EPOLLEXCLUSIVE,
+            .data.ptr = NULL            // NULL marks the listening socket
+        };
+        struct epoll_event wakeev = {
+            .events = EPOLLIN,
+            .data.ptr = loop            // the loop itself marks wakefd
+        };
+        struct epoll_event stopev = {
+            .events = EPOLLIN,
+            .data.ptr = &reactor_shutdown_tag
+        };
+        struct epoll_event drainev = {
+            .events = EPOLLIN,
+            .data.ptr = &reactor_drain_tag
+        };
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sfd, &ev) == -1 ||
+           epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &wakeev) == -1 ||
+           epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shutdown_fd(), &stopev) == -1 ||
+           epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shutdown_drain_fd(),
+                     &drainev) == -1) {
+            log_errno("reactor_run(): epoll_ctl()");
+            robustclose(loop->wakefd);
+            robustclose(loop->epfd);
+            goto errorcleanup;
+        }
+        loop->dfd = opendatafile();
+        if(loop->dfd == -1) {
+            log_errno("reactor_run(): opendatafile()");
+            robustclose(loop->wakefd);
+            robustclose(loop->epfd);
+            goto errorcleanup;
+        }
+        pthread_mutex_init(&loop->done_mutex, NULL);
+        r = pthread_create(&loop->thread, NULL, reactor_loopthread, loop);
+        if(r) {
+            errno = r;
+            log_errno("reactor_run(): pthread_create()");
+            pthread_mutex_destroy(&loop->done_mutex);
+            robustclose(loop->dfd);
+            robustclose(loop->wakefd);
+            robustclose(loop->epfd);
+            goto errorcleanup;
+        }
+        alog(LOG_DEBUG, "started event loop %i", started);
+    }
+    r = 0;
+
+    errorcleanup:
+    if(r) {
+        shutdown_request(0);
+        r = -1;
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        if(loops[i].ret) r = -1;
+        pthread_mutex_destroy(&loops[i].done_mutex);
+        robustclose(loops[i].dfd);
+        robustclose(loops[i].wakefd);
+        robustclose(loops[i].epfd);
+    }
+    free(loops);
+    return r;
+}
+
+static void *reactor_loopthread(void *thread_param) {
+    struct reactor_loop *loop = (struct reactor_loop *)thread_param;
+    loop->ret = reactor_loop(loop);
+    return thread_param;
+}
+
+static int reactor_loop(struct reactor_loop *loop) {
+    int r = -1;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while(flag_accepting_connections &&
+          !(loop->draining && LIST_EMPTY(&loop->conns) && loop->inflight == 0)) {
+        int n = epoll_wait(loop->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            log_errno("reactor_loop(): epoll_wait()");
+            goto errorcleanup;
+        }
+        for(int i = 0; i < n; i++) {
+            struct reactor_conn *c = events[i].data.ptr;
+            if(c == NULL) {
+                reactor_accept(loop);
+                continue;
+            }
+            if(events[i].data.ptr == loop) {
+                reactor_completions(loop);
+                continue;
+            }
+            if(events[i].data.ptr == &reactor_shutdown_tag)
+                continue;               // the while condition ends the loop
+            if(events[i].data.ptr == &reactor_drain_tag) {
+                // Leave the new connections to the next server
+                epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->sfd, NULL);
+                epoll_ctl(loop->epfd, EPOLL_CTL_DEL, shutdown_drain_fd(), NULL);
+                loop->draining = true;
+                continue;
+            }
+            if(c->closed)
+                continue;               // earlier in this round
+            if(c->state == CONN_APPENDING) {
+                // Only EPOLLERR/EPOLLHUP get here. The writer still owns buf,
+                // so stop watching and close when it hands the conn back.
+                c->closing = true;
+                epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->rsfd, NULL);
+                continue;
+            }
+            if(events[i].events & EPOLLERR) {
+                reactor_close(loop, c);
+                continue;
+            }
+            if(c->replay_queued)
+                continue;               // reactor_replays() gets to it
+            if(c->state == CONN_REPLAYING)
+                r = reactor_replay(loop, c);
+            else if(c->subscribed && !(events[i].events & ~EPOLLOUT))
+                r = reactor_tail(loop, c);
+            else
+                r = reactor_receive(loop, c);
+            if(r)
+                reactor_close(loop, c);
+        }
+        reactor_replays(loop);
+        reactor_reap(loop);
+    }
+
+    r = 0;
+    errorcleanup:
+    while(loop->inflight > 0) {
+        struct pollfd wake_poll = { .fd = loop->wakefd, .events = POLLIN };
+        poll(&wake_poll, 1, -1);
+        reactor_completions(loop);
+    }
+    while(!LIST_EMPTY(&loop->conns)) {
+        reactor_close(loop, LIST_FIRST(&loop->conns));
+    }
+    reactor_reap(loop);
+    return r;
+}
+
+static void reactor_accept(struct reactor_loop *loop) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+
+    for(;;) {
+        client_addr_len = sizeof(client_addr);
+        int rsfd = accept4(loop->sfd, (struct sockaddr *)&client_addr,
+                           &client_addr_len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if(rsfd == -1) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                log_errno("reactor_accept(): accept4()");
+            return;
+        }
+
+        if(alog_enabled(LOG_INFO)) {
+            char hoststr[NI_MAXHOST];
+            char portstr[NI_MAXSERV];
+            if (getnameinfo((struct sockaddr *)&client_addr, client_addr_len,
+                            hoststr, sizeof(hoststr), portstr, sizeof(portstr),
+                            NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+                alog(LOG_INFO,"Incoming connection from %s port %s", hoststr, portstr);
+            }
+        }
+        alog(LOG_DEBUG,"Opened new rsfd descriptor # %i",rsfd);
+
+        struct reactor_conn *c = malloc(sizeof(struct reactor_conn));
+        if(c == NULL) {
+            log_errno("reactor_accept(): malloc()");
+            closesocket(rsfd);
+            return;
+        }
+        memset(c, 0, offsetof(struct reactor_conn, buf));
+        c->rsfd = rsfd;
+        c->loop = loop;
+        c->state = CONN_RECEIVING;
+        if(packet_init(&c->in)) {
+            log_errno("reactor_accept(): packet_init()");
+            closesocket(rsfd);
+            free(c);
+            return;
+        }
+        replay_init(&c->replay, c->buf, REACTOR_BUF_LEN);
+        c->events = EPOLLIN|EPOLLRDHUP;
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, rsfd, &ev) == -1) {
+            log_errno("reactor_accept(): epoll_ctl()");
+            closesocket(rsfd);
+            packet_free(&c->in);
+            free(c);
+            return;
+        }
+        LIST_INSERT_HEAD(&loop->conns, c, nodes);
+        stats_add(STATS_ACCEPTED, 1);
+        stats_add(STATS_ACTIVE, 1);
+    }
+}
+
+/* Reads what the client sent and processes the packets it completes.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int reactor_receive(struct reactor_loop *loop, struct reactor_conn *c) {
+    ssize_t readcount;
+    size_t avail;
+
+    char *space = packet_space(&c->in, &avail);
+    if(space == NULL) {
+        log_errno("reactor_receive(): packet_space()");
+        return -1;
+    }
+    readcount = recv(c->rsfd, space, avail, 0);
+    if(readcount == -1) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        log_errno("reactor_receive(): recv()");
+        return -1;
+    }
+    else if(readcount == 0) {
+        alog(LOG_DEBUG,"reactor_receive received FIN from client");
+        if(packet_pending(&c->in))
+            alog(LOG_DEBUG,"dropping %zu bytes without a newline",
+                   packet_pending(&c->in));
+        return -1;
+    }
+    packet_commit(&c->in, readcount);
+    stats_add(STATS_BYTES_IN, readcount);
+    return reactor_process(loop, c);
+}
+
+/* Appends the buffered packets and replays the data file after each one, for
+ * as long as nothing blocks. Writes the packet into the data file (or sends
+ * the seek command to the driver) itself, or queues it on the writer thread
+ * and lets reactor_completions() pick up from there.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int reactor_process(struct reactor_loop *loop, struct reactor_conn *c) {
+    ssize_t writecount;
+
+    while((c->pktlen = packet_next(&c->in)) > 0) {
+        char *pkt = packet_data(&c->in);
+        int64_t start = -1;
+        if(proto_parse(pkt, c->pktlen, packet_binary(&c->in), &c->cmd))
+            return -1;
+        if(c->subscribed && proto_subscribed(&c->cmd))
+            return -1;
+        if(c->cmd.op == PROTO_SUBSCRIBE) {
+            if(!c->subscribed) {
+                start = tail_subscribe(&c->tail, reactor_tailready, c);
+                if(start == -1) {
+                    log_errno("reactor_process(): tail_subscribe()");
+                    return -1;
+                }
+                c->subscribed = true;
+            }
+        }
+        else if(c->cmd.op == PROTO_SEEK) {
+            backend->seek(loop->dfd, &c->cmd.seekto);
+            cache_invalidate();
+        }
+        else if(c->cmd.op == PROTO_APPEND && writer_enabled()) {
+            c->req.buf = c->cmd.data;
+            c->req.len = c->cmd.len;
+            c->req.done = reactor_appended;
+            c->req.arg = c;
+            c->state = CONN_APPENDING;
+            loop->inflight++;
+            if(reactor_watch(loop, c, 0))
+                c->closing = true;
+            stats_add(STATS_PACKETS, 1);
+            writer_submit(&c->req);
+            return 0;
+        }
+        else if(c->cmd.op == PROTO_APPEND) {
+            int syncerr;
+            stats_lock(loop->dfdmutex);
+            writecount = datawrite(loop->dfd, c->cmd.data, c->cmd.len,
+                                   &syncerr);
+            if(writecount != -1) {
+                cache_append(c->cmd.data, writecount);
+                tail_append(c->cmd.data, writecount);
+                pktidx_append(writecount);
+            }
+            pthread_mutex_unlock(loop->dfdmutex);
+            if(writecount != -1 && syncerr) {
+                errno = syncerr;
+                writecount = -1;
+            }
+            if(writecount == -1) {
+                log_errno("reactor_process(): data write()");
+                return -1;
+            }
+            stats_add(STATS_PACKETS, 1);
+        }
+
+        if(c->subscribed && start == -1) {
+            // Subscribers get the packet with the other appends instead
+            packet_consume(&c->in, c->pktlen);
+            continue;
+        }
+        c->state = CONN_REPLAYING;
+        proto_rewind(&c->replay, &c->cmd, loop->dfd);
+        if(start != -1 && backend->follows_appends)
+            replay_limit(&c->replay, start);
+        if(cache_enabled())
+            return reactor_defer(loop, c);
+        int r = replay_continue(&c->replay, loop->dfd, c->rsfd);
+        if(r == -1)
+            return -1;
+        if(r == 0)
+            return reactor_stall(loop, c);
+        alog(LOG_DEBUG,"reactor_process copied datafile to the socket");
+        packet_consume(&c->in, c->pktlen);
+        c->state = CONN_RECEIVING;
+    }
+    if(c->subscribed)
+        return reactor_tail(loop, c);
+    return reactor_watch(loop, c, EPOLLIN|EPOLLRDHUP);
+}
+
+static int reactor_startreplay(struct reactor_loop *loop,
+                               struct reactor_conn *c) {
+    c->state = CONN_REPLAYING;
+    proto_rewind(&c->replay, &c->cmd, loop->dfd);
+    if(cache_enabled())
+        return reactor_defer(loop, c);
+    return reactor_replay(loop, c);
+}
+
+/* Queues the replay of c for the end of the round (see reactor_replays()).
+ * @returns 0.
+ */
+static int reactor_defer(struct reactor_loop *loop, struct reactor_conn *c) {
+    LIST_INSERT_HEAD(&loop->replays, c, replay_nodes);
+    c->replay_queued = true;
+    return 0;
+}
+
+/* Starts the replays queued during the round, now that its appends are all
+ * in the data file. A replay that completes moves on to the next packet,
+ * which may queue another one.
+ */
+static void reactor_replays(struct reactor_loop *loop) {
+    struct reactor_conn *c;
+    while((c = LIST_FIRST(&loop->replays)) != NULL) {
+        LIST_REMOVE(c, replay_nodes);
+        c->replay_queued = false;
+        if(reactor_replay(loop, c))
+            reactor_close(loop, c);
+    }
+}
+
+/* Called on the writer thread when c->req is in the data file. Hands the
+ * connection back to its loop.
+ */
+static void reactor_appended(struct writer_req *req) {
+    struct reactor_conn *c = req->arg;
+    struct reactor_loop *loop = c->loop;
+    bool wake;
+    pthread_mutex_lock(&loop->done_mutex);
+    c->done_next = loop->done_head;
+    loop->done_head = c;
+    wake = (c->done_next == NULL);
+    pthread_mutex_unlock(&loop->done_mutex);
+    if(wake) {
+        uint64_t one = 1;
+        if(write(loop->wakefd, &one, sizeof(one)) == -1)
+            log_errno("reactor_appended(): eventfd write()");
+    }
+}
+
+/* Picks up the connections whose appends the writer finished and moves them
+ * on to their replay, then feeds the subscribers new appends are ready for.
+ */
+static void reactor_completions(struct reactor_loop *loop) {
+    uint64_t count;
+    struct reactor_conn *c, *next;
+    if(read(loop->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        log_errno("reactor_completions(): eventfd read()");
+
+    pthread_mutex_lock(&loop->done_mutex);
+    c = loop->done_head;
+    loop->done_head = NULL;
+    pthread_mutex_unlock(&loop->done_mutex);
+
+    for(; c != NULL; c = next) {
+        next = c->done_next;
+        loop->inflight--;
+        c->state = CONN_RECEIVING;
+        if(c->req.ret == -1) {
+            errno = c->req.err;
+            log_errno("reactor_completions(): data write()");
+            reactor_close(loop, c);
+        }
+        else if(c->closing || !flag_accepting_connections) {
+            reactor_close(loop, c);
+        }
+        else if(c->subscribed) {
+            packet_consume(&c->in, c->pktlen);
+            if(reactor_process(loop, c))
+                reactor_close(loop, c);
+        }
+        else if(reactor_startreplay(loop, c)) {
+            reactor_close(loop, c);
+        }
+    }
+
+    // Subscribers busy replaying or appending get to the new data when they
+    // are done, in reactor_process()
+    for(;;) {
+        pthread_mutex_lock(&loop->done_mutex);
+        c = LIST_FIRST(&loop->tail_ready);
+        if(c != NULL) {
+            LIST_REMOVE(c, tail_nodes);
+            c->tail_ready = false;
+        }
+        pthread_mutex_unlock(&loop->done_mutex);
+        if(c == NULL) break;
+        if(c->state == CONN_RECEIVING && reactor_tail(loop, c))
+            reactor_close(loop, c);
+    }
+}
+
+/* Sends a subscribed connection what was appended since the last time, and
+ * watches EPOLLOUT as well as EPOLLIN while its socket is full. Only for
+ * connections that are receiving.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int reactor_tail(struct reactor_loop *loop, struct reactor_conn *c) {
+    int r = tail_continue(&c->tail, c->rsfd);
+    if(r == -1)
+        return -1;
+    if(r == 0) {
+        outq_stall(&c->out, c->rsfd, tail_position(&c->tail));
+        return reactor_watch(loop, c, EPOLLIN|EPOLLOUT|EPOLLRDHUP);
+    }
+    outq_resume(&c->out);
+    return reactor_watch(loop, c, EPOLLIN|EPOLLRDHUP);
+}
+
+/* Called by tail_append() on the appending thread when a subscriber that had
+ * caught up has something new. Hands it to its loop.
+ */
+static void reactor_tailready(struct tail_sub *s) {
+    struct reactor_conn *c = s->arg;
+    struct reactor_loop *loop = c->loop;
+    bool wake = false;
+    pthread_mutex_lock(&loop->done_mutex);
+    if(!c->tail_ready) {
+        wake = LIST_EMPTY(&loop->tail_ready);
+        LIST_INSERT_HEAD(&loop->tail_ready, c, tail_nodes);
+        c->tail_ready = true;
+    }
+    pthread_mutex_unlock(&loop->done_mutex);
+    if(wake) {
+        uint64_t one = 1;
+        if(write(loop->wakefd, &one, sizeof(one)) == -1)
+            log_errno("reactor_tailready(): eventfd write()");
+    }
+}
+
+/* Sends as much of the data file as the socket accepts without blocking.
+ * When the socket is full we wait for EPOLLOUT and continue from where the
+ * replay stopped. Once the replay is done the next buffered packet is
+ * processed.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int reactor_replay(struct reactor_loop *loop, struct reactor_conn *c) {
+    int r = replay_continue(&c->replay, loop->dfd, c->rsfd);
+    if(r == -1)
+        return -1;
+    if(r == 0)
+        return reactor_stall(loop, c);
+    alog(LOG_DEBUG,"reactor_replay copied datafile to the socket");
+    outq_resume(&c->out);
+    packet_consume(&c->in, c->pktlen);
+    c->state = CONN_RECEIVING;
+    return reactor_process(loop, c);
+}
+
+/* The replay filled the socket: lists c as stalled until it is done and
+ * waits for EPOLLOUT.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int reactor_stall(struct reactor_loop *loop, struct reactor_conn *c) {
+    off_t pos = replay_position(&c->replay);
+    outq_stall(&c->out, c->rsfd, (pos == -1) ? OUTQ_NOPOS : pos);
+    return reactor_watch(loop, c, EPOLLOUT|EPOLLRDHUP);
+}
+
+static int reactor_watch(struct reactor_loop *loop, struct reactor_conn *c,
+                         uint32_t events) {
+    if(c->events == events) return 0;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->rsfd, &ev) == -1) {
+        log_errno("reactor_watch(): epoll_ctl()");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+/* Closes a connection and releases everything it holds but its memory: it
+ * may still have events further in the batch epoll_wait() returned, whoever
+ * closes it (reactor_completions() on the wake event, a subscriber's tail...).
+ * reactor_loop() skips those and reactor_reap() frees it after the round.
+ */
+static void reactor_close(struct reactor_loop *loop, struct reactor_conn *c) {
+    LIST_REMOVE(c, nodes);
+    if(c->replay_queued)
+        LIST_REMOVE(c, replay_nodes);
+    if(c->subscribed) {
+        tail_unsubscribe(&c->tail);     // no reactor_tailready() after this
+        pthread_mutex_lock(&loop->done_mutex);
+        if(c->tail_ready)
+            LIST_REMOVE(c, tail_nodes);
+        pthread_mutex_unlock(&loop->done_mutex);
+    }
+    outq_resume(&c->out);
+    replay_release(&c->replay);
+    closesocket(c->rsfd);
+    packet_free(&c->in);
+    stats_add(STATS_ACTIVE, -1);
+    c->closed = true;
+    c->closed_next = loop->closed_head;
+    loop->closed_head = c;
+}
+
+static void reactor_reap(struct reactor_loop *loop) {
+    while(loop->closed_head != NULL) {
+        struct reactor_conn *c = loop->closed_head;
+        loop->closed_head = c->closed_next;
+        free(c);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+
+/* Runs the epoll server mode: nloops event-loop threads share the listening
+ * socket sfd and multiplex every accepted client socket. Returns when
+ * flag_accepting_connections goes false and all the loops have exited.
+ * @param sfd is the bound and listening socket.
+ * @param dfdmutex is the mutex protecting writes to the data file.
+ * @param nloops is the number of event-loop threads to start.
+ * @returns 0 on success, -1 on error (errno is set).
+ */
+int reactor_run(int sfd, pthread_mutex_t *dfdmutex, int nloops);
+
+#endif /* REACTOR_H */
@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "aesdsocket.h"
+#include "replay.h"
+#include "cache.h"
+#include "backend.h"
+#include "stats.h"
+#include "alog.h"
+
+#define REPLAY_CHUNK_LEN    (1 << 20)   // max bytes per sendfile()/splice()
+
+/* Comments:
+ *  Replays try the cheapest method first and fall back when the kernel
+ *  refuses it for the data file:
+ *   - sendfile() works for regular files (the /var/tmp/aesdsocketdata backend)
+ *     and copies the page cache straight into the socket.
+ *   - splice() through a pipe is tried next, for files that implement
+ *     splice_read.
+ *   - pread()/send() through a bounce buffer always works. This is what the
+ *     aesdchar driver ends up with, since it only implements .read.
+ *  The mmap backend skips all of them: its segments are mapped, so the
+ *  replay send()s straight from the mapping, and replay_peek() hands out
+ *  pointers into it instead of copying into the bounce buffer.
+ *  The first failure is remembered process-wide in replay_method_hint, so
+ *  later replays don't pay for a syscall that can't succeed.
+ *
+ *  When the replay cache is enabled (-c) none of the above touches the data
+ *  file: the replay sends the shared in-memory image instead (see cache.c),
+ *  and only falls back to the file if the image can't be loaded.
+ *
+ *  With the seglog backends the offsets are log offsets and the bytes are in
+ *  the segments (see seglog.c). Each method asks replay_locate(), and so the
+ *  backend, which descriptor and offset to use, so a read never crosses a
+ *  segment boundary, and a replay that starts before data the retention
+ *  deleted skips to the oldest byte kept.
+ *
+ *  Binary clients (see proto.c) are told how many bytes a reply holds before
+ *  they get them, so their replays are exact: a skip like the one above, or a
+ *  device returning less than its size, fails the replay and the connection
+ *  is closed rather than sending a different number of bytes. With -c the
+ *  reply announces what the image it sends holds (replay_snapshot()), and
+ *  the image is the replay's until it is done, so that can't happen. The reply
+ *  header goes out as the replay's prefix, so every engine sends it the way
+ *  it sends the data and none of them has to track it.
+ */
+
+static volatile int replay_method_hint = -1;
+
+static int replay_sendfile(struct replay_t *r, int dfd, int rsfd);
+static int replay_splice(struct replay_t *r, int dfd, int rsfd);
+static int replay_copy(struct replay_t *r, int dfd, int rsfd);
+static int replay_cache(struct replay_t *r, int dfd, int rsfd);
+static int replay_mapped(struct replay_t *r, int dfd, int rsfd);
+static int replay_downgrade(struct replay_t *r, int method);
+static size_t replay_room(struct replay_t *r, size_t len);
+static int replay_opencache(struct replay_t *r, int dfd);
+static int replay_cutcache(struct replay_t *r);
+static void replay_done(struct replay_t *r);
+static int replay_finish(struct replay_t *r);
+static int replay_sendprefix(struct replay_t *r, int rsfd);
+static size_t replay_locate(struct replay_t *r, int dfd, size_t len,
+                            int *fd, off_t *off);
+
+void replay_init(struct replay_t *r, char *buf, size_t buf_len) {
+    memset(r, 0, sizeof(struct replay_t));
+    r->method = cache_enabled() ? REPLAY_CACHE : replay_method_hint;
+    r->end = -1;
+    r->pipefd[0] = -1;
+    r->pipefd[1] = -1;
+    r->buf = buf;
+    r->buf_len = buf_len;
+}
+
+void replay_rewind(struct replay_t *r) {
+    r->started = stats_now();
+    r->pos = 0;
+    r->end = -1;
+    r->exact = false;
+    r->lost = false;
+    r->inpipe = 0;
+    r->pending_off = 0;
+    r->pending_len = 0;
+    r->prefix_off = 0;
+    r->prefix_len = 0;
+    cache_close(&r->cache);
+    if(r->ref) backend->release(r->ref);
+    r->ref = NULL;
+    r->method = cache_enabled() ? REPLAY_CACHE : replay_method_hint;
+}
+
+void replay_limit(struct replay_t *r, off_t end) {
+    r->end = end;
+}
+
+void replay_range(struct replay_t *r, off_t start, off_t end) {
+    r->pos = start;
+    r->end = end;
+    r->exact = true;
+    if(r->cache.img != NULL)
+        replay_cutcache(r);
+}
+
+int replay_snapshot(struct replay_t *r, int dfd, off_t *start, off_t *end) {
+    if(r->method != REPLAY_CACHE || cache_open(&r->cache, dfd))
+        return -1;
+    *start = r->cache.base;
+    *end = r->cache.base + r->cache.end;
+    return 0;
+}
+
+void replay_prefix(struct replay_t *r, const void *buf, size_t len) {
+    memcpy(r->prefix, buf, len);
+    r->prefix_off = 0;
+    r->prefix_len = len;
+}
+
+int replay_continue(struct replay_t *r, int dfd, int rsfd) {
+    if(r->prefix_off < r->prefix_len) {
+        int ret = replay_sendprefix(r, rsfd);
+        if(ret != 1) return ret;
+    }
+    for(;;) {
+        int ret;
+        if(r->method == -1) {
+            struct stat st;
+            if(backend->mapping != NULL)
+                r->method = REPLAY_MAPPED;
+            else if(fstat(dfd, &st) == 0 && S_ISREG(st.st_mode))
+                r->method = REPLAY_SENDFILE;
+            else
+                r->method = REPLAY_SPLICE;
+            if(replay_method_hint == -1)
+                replay_method_hint = r->method;
+        }
+        switch(r->method) {
+            case REPLAY_CACHE:
+                ret = replay_cache(r, dfd, rsfd);
+                break;
+            case REPLAY_MAPPED:
+                ret = replay_mapped(r, dfd, rsfd);
+                break;
+            case REPLAY_SENDFILE:
+                ret = replay_sendfile(r, dfd, rsfd);
+                break;
+            case REPLAY_SPLICE:
+                ret = replay_splice(r, dfd, rsfd);
+                break;
+            default:
+                ret = replay_copy(r, dfd, rsfd);
+                break;
+        }
+        if(ret == 1) ret = replay_finish(r);
+        if(ret != -EINVAL) return ret;
+        // Method not supported for this file; the next one picks up at r->pos
+    }
+}
+
+int replay_peek(struct replay_t *r, int dfd, const char **data, size_t *len) {
+    if(r->prefix_off < r->prefix_len) {
+        *data = r->prefix + r->prefix_off;
+        *len = r->prefix_len - r->prefix_off;
+        return 1;
+    }
+    if(r->method == REPLAY_CACHE) {
+        if(r->cache.img != NULL || replay_opencache(r, dfd) == 0) {
+            *len = cache_peek(&r->cache, data);
+            if(*len > 0) return 1;
+            cache_close(&r->cache);
+            replay_done(r);
+            return 0;
+        }
+    }
+    if(r->method == REPLAY_MAPPED) {
+        int fd;
+        off_t off;
+        size_t want = replay_locate(r, dfd, REPLAY_CHUNK_LEN, &fd, &off);
+        if(want == 0)
+            return (replay_finish(r) == 1) ? 0 : -1;
+        *data = backend->mapping(r->ref) + off;
+        *len = want;
+        return 1;
+    }
+    // sendfile() and splice() need the socket, so everything else is copied
+    r->method = REPLAY_COPY;
+    while(r->pending_len == 0) {
+        int fd;
+        off_t off;
+        size_t want = replay_locate(r, dfd, r->buf_len, &fd, &off);
+        if(want == 0)
+            return (replay_finish(r) == 1) ? 0 : -1;
+        ssize_t rc = pread(fd, r->buf, want, off);
+        if(rc == -1) {
+            if(errno == EINTR) continue;
+            log_errno("replay_peek(): file read()");
+            return -1;
+        }
+        if(rc == 0)
+            return (replay_finish(r) == 1) ? 0 : -1;
+        r->pos += rc;
+        r->pending_off = 0;
+        r->pending_len = rc;
+    }
+    *data = r->buf + r->pending_off;
+    *len = r->pending_len;
+    return 1;
+}
+
+void replay_advance(struct replay_t *r, size_t n) {
+    if(r->prefix_off < r->prefix_len) {
+        r->prefix_off += n;     // replay_peek() only returned the prefix
+        return;
+    }
+    if(r->method == REPLAY_CACHE) {
+        cache_advance(&r->cache, n);
+        return;
+    }
+    if(r->method == REPLAY_MAPPED) {
+        r->pos += n;
+        return;
+    }
+    r->pending_off += n;
+    r->pending_len -= n;
+}
+
+off_t replay_position(struct replay_t *r) {
+    if(!backend->follows_appends) return -1;
+    switch(r->method) {
+        case REPLAY_CACHE:
+            if(r->cache.img != NULL)
+                return r->cache.base + r->cache.pos;
+            return r->pos;
+        case REPLAY_SPLICE:
+            return r->pos - r->inpipe;
+        case REPLAY_COPY:
+            return r->pos - r->pending_len;
+        default:
+            return r->pos;
+    }
+}
+
+void replay_release(struct replay_t *r) {
+    if(r->pipefd[0] != -1) {
+        robustclose(r->pipefd[0]);
+        robustclose(r->pipefd[1]);
+        r->pipefd[0] = -1;
+        r->pipefd[1] = -1;
+    }
+    r->inpipe = 0;
+    cache_close(&r->cache);
+    if(r->ref) backend->release(r->ref);
+    r->ref = NULL;
+}
+
+static int replay_sendfile(struct replay_t *r, int dfd, int rsfd) {
+    for(;;) {
+        int fd;
+        off_t off;
+        size_t want = replay_locate(r, dfd, REPLAY_CHUNK_LEN, &fd, &off);
+        if(want == 0) return 1;
+        ssize_t n = sendfile(rsfd, fd, &off, want);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if(errno == EINVAL || errno == ENOSYS)
+                return replay_downgrade(r, REPLAY_SPLICE);
+            log_errno("replay_sendfile(): sendfile()");
+            return -1;
+        }
+        if(n == 0) return 1;
+        r->pos += n;
+        stats_add(STATS_BYTES_OUT, n);
+    }
+}
+
+static int replay_splice(struct replay_t *r, int dfd, int rsfd) {
+    if(r->pipefd[0] == -1) {
+        if(pipe2(r->pipefd, O_NONBLOCK|O_CLOEXEC) == -1) {
+            log_errno("replay_splice(): pipe2()");
+            r->pipefd[0] = -1;
+            return replay_downgrade(r, REPLAY_COPY);
+        }
+    }
+    for(;;) {
+        if(r->inpipe == 0) {
+            int fd;
+            off_t off;
+            size_t want = replay_locate(r, dfd, REPLAY_CHUNK_LEN, &fd, &off);
+            if(want == 0) return 1;
+            ssize_t n = splice(fd, &off, r->pipefd[1], NULL,
+                               want, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if(n == -1) {
+                if(errno == EINTR) continue;
+                if(errno == EINVAL || errno == ENOSYS) {
+                    replay_release(r);
+                    return replay_downgrade(r, REPLAY_COPY);
+                }
+                log_errno("replay_splice(): splice() from data file");
+                return -1;
+            }
+            if(n == 0) return 1;
+            r->pos += n;
+            r->inpipe = n;
+        }
+        ssize_t n = splice(r->pipefd[0], NULL, rsfd, NULL, r->inpipe,
+                           SPLICE_F_MOVE|SPLICE_F_NONBLOCK|SPLICE_F_MORE);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_errno("replay_splice(): splice() to socket");
+            return -1;
+        }
+        r->inpipe -= n;
+        stats_add(STATS_BYTES_OUT, n);
+    }
+}
+
+static int replay_copy(struct replay_t *r, int dfd, int rsfd) {
+    for(;;) {
+        if(r->pending_len == 0) {
+            int fd;
+            off_t off;
+            size_t want = replay_locate(r, dfd, r->buf_len, &fd, &off);
+            if(want == 0) return 1;
+            ssize_t rc = pread(fd, r->buf, want, off);
+            if(rc == -1) {
+                if(errno == EINTR) continue;
+                log_errno("replay_copy(): file read()");
+                return -1;
+            }
+            if(rc == 0) return 1;
+            r->pos += rc;
+            r->pending_off = 0;
+            r->pending_len = rc;
+        }
+        ssize_t wc = send(rsfd, r->buf + r->pending_off, r->pending_len,
+                          MSG_NOSIGNAL);
+        if(wc == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_errno("replay_copy(): socket send()");
+            return -1;
+        }
+        r->pending_off += wc;
+        r->pending_len -= wc;
+        stats_add(STATS_BYTES_OUT, wc);
+    }
+}
+
+/* Sends from the mapping of the segment holding r->pos. */
+static int replay_mapped(struct replay_t *r, int dfd, int rsfd) {
+    for(;;) {
+        int fd;
+        off_t off;
+        size_t want = replay_locate(r, dfd, REPLAY_CHUNK_LEN, &fd, &off);
+        if(want == 0) return 1;
+        ssize_t wc = send(rsfd, backend->mapping(r->ref) + off, want,
+                          MSG_NOSIGNAL);
+        if(wc == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_errno("replay_mapped(): socket send()");
+            return -1;
+        }
+        r->pos += wc;
+        stats_add(STATS_BYTES_OUT, wc);
+    }
+}
+
+static int replay_cache(struct replay_t *r, int dfd, int rsfd) {
+    if(r->cache.img == NULL) {
+        if(replay_opencache(r, dfd)) {
+            r->method = replay_method_hint;    // replay from the file instead
+            return -EINVAL;
+        }
+    }
+    int ret = cache_send(&r->cache, rsfd);
+    if(ret != 0) cache_close(&r->cache);
+    return ret;
+}
+
+/* Opens the cached image, cut at r->end and skipped to r->pos. */
+static int replay_opencache(struct replay_t *r, int dfd) {
+    if(cache_open(&r->cache, dfd)) return -1;
+    return replay_cutcache(r);
+}
+
+/* Cuts the open image at r->end and skips it to r->pos. An exact replay only
+ * uses an image holding all of its range; the data file has it otherwise.
+ * @returns 0, or -1 with the image closed.
+ */
+static int replay_cutcache(struct replay_t *r) {
+    if(r->end != -1) {
+        off_t end = (r->end > r->cache.base) ? r->end - r->cache.base : 0;
+        if(r->cache.end > (size_t)end)
+            r->cache.end = end;
+    }
+    if(r->exact && (r->cache.base > r->pos ||
+                    r->cache.end != (size_t)(r->end - r->cache.base))) {
+        cache_close(&r->cache);
+        return -1;
+    }
+    if(r->pos > r->cache.base)
+        cache_advance(&r->cache, r->pos - r->cache.base);
+    return 0;
+}
+
+/* Records how long the replay took, once. */
+static void replay_done(struct replay_t *r) {
+    if(r->started == 0) return;
+    stats_observe(STATS_REPLAY, stats_now() - r->started);
+    r->started = 0;
+}
+
+/* Ends the replay once the method found nothing more to send.
+ * @returns 1, or -1 if an exact replay didn't get all of its range.
+ */
+static int replay_finish(struct replay_t *r) {
+    replay_done(r);
+    if(r->exact && r->method != REPLAY_CACHE && (r->lost || r->pos < r->end)) {
+        alog(LOG_ERR, "bytes of an exact replay are gone, closing it");
+        errno = ENODATA;
+        return -1;
+    }
+    return 1;
+}
+
+/* Sends what is left of the prefix.
+ * @returns 1 once it was sent, 0 when rsfd would block, -1 on error.
+ */
+static int replay_sendprefix(struct replay_t *r, int rsfd) {
+    while(r->prefix_off < r->prefix_len) {
+        ssize_t wc = send(rsfd, r->prefix + r->prefix_off,
+                          r->prefix_len - r->prefix_off, MSG_NOSIGNAL|MSG_MORE);
+        if(wc == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_errno("replay_sendprefix(): socket send()");
+            return -1;
+        }
+        r->prefix_off += wc;
+        stats_add(STATS_BYTES_OUT, wc);
+    }
+    return 1;
+}
+
+/* @returns how many of the next len bytes the replay may still send. */
+static size_t replay_room(struct replay_t *r, size_t len) {
+    if(r->end == -1 || r->pos + (off_t)len <= r->end) return len;
+    return (r->pos < r->end) ? r->end - r->pos : 0;
+}
+
+/* Finds where the next bytes of the replay are: dfd at r->pos, or with the
+ * seglog backends the segment holding r->pos, which the replay keeps a
+ * reference on until it moves past it (see backend.h).
+ * @returns how many of the next len bytes can be read from *fd at *off, 0 at
+ * the end of the replay.
+ */
+static size_t replay_locate(struct replay_t *r, int dfd, size_t len,
+                            int *fd, off_t *off) {
+    off_t pos = r->pos;
+    len = backend->locate(dfd, &r->pos, len, &r->ref, fd, off);
+    if(r->exact && r->pos != pos) {
+        r->lost = true;         // replay_finish() fails it
+        return 0;
+    }
+    return len ? replay_room(r, len) : 0;
+}
+
+static int replay_downgrade(struct replay_t *r, int method) {
+    if(replay_method_hint < method) {
+        alog(LOG_DEBUG, "replay method %i not supported for %s, using %i",
+               r->method, datapath, method);
+        replay_method_hint = method;
+    }
+    r->method = method;
+    return -EINVAL;
+}
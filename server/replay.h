@@ -0,0 +1,103 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+#define REPLAY_PREFIX_LEN   32
+
+/* State of one replay of the data file into a client socket. A replay can be
+ * continued after the socket would block, so the reactor and the blocking
+ * handlers share it.
+ */
+struct replay_t {
+    int method;             // One of the REPLAY_ methods below
+    off_t pos;              // Next data file offset to send
+    off_t end;              // Offset to stop at, -1 for the end of the file
+    bool exact;             // Send exactly [pos, end) or fail, see replay_range()
+    bool lost;              // Bytes of an exact replay were deleted
+    void *ref;              // Held by the backend for pos (backend.h)
+    uint64_t started;       // stats_now() at the rewind, 0 once recorded
+    int pipefd[2];          // Pipe for splice(), opened on first use
+    size_t inpipe;          // Bytes spliced into the pipe but not sent yet
+    char *buf;              // Bounce buffer for the pread()/send() fallback
+    size_t buf_len;
+    size_t pending_off;     // Unsent part of buf
+    size_t pending_len;
+    struct cache_reader cache;  // Image being sent by REPLAY_CACHE
+    char prefix[REPLAY_PREFIX_LEN]; // Sent before the data, see replay_prefix()
+    size_t prefix_off;
+    size_t prefix_len;
+};
+
+#define REPLAY_SENDFILE     0
+#define REPLAY_SPLICE       1
+#define REPLAY_COPY         2
+#define REPLAY_CACHE        3
+#define REPLAY_MAPPED       4
+
+/* Prepares r for replays. buf is borrowed and only used by the copy
+ * fallback; it must stay valid until replay_release().
+ */
+void replay_init(struct replay_t *r, char *buf, size_t buf_len);
+
+/* Starts a new replay from the beginning of the data file. */
+void replay_rewind(struct replay_t *r);
+
+/* Stops the replay started by replay_rewind() at offset end instead of the
+ * end of the file, so it sends a known snapshot of a file still growing.
+ */
+void replay_limit(struct replay_t *r, off_t end);
+
+/* Makes the replay started by replay_rewind() send exactly the bytes [start,
+ * end), for a range read or a client that was told how many to expect: if
+ * some of them were deleted by the retention meanwhile, or the char device
+ * returns fewer, the replay fails instead of sending something else.
+ */
+void replay_range(struct replay_t *r, off_t start, off_t end);
+
+/* With the replay cache, opens the image the replay started by
+ * replay_rewind() will send, so a range taken from it with replay_range()
+ * can't be deleted by the retention before it is sent.
+ * @returns 0 with the bytes the image holds in [*start, *end), -1 without the
+ * cache or if the image couldn't be loaded.
+ */
+int replay_snapshot(struct replay_t *r, int dfd, off_t *start, off_t *end);
+
+/* Sends the len (up to REPLAY_PREFIX_LEN) bytes of buf before the data of the
+ * replay started by replay_rewind(), a reply header for example.
+ */
+void replay_prefix(struct replay_t *r, const void *buf, size_t len);
+
+/* Sends the data file to rsfd from r->pos until the end of the file or until
+ * the socket would block.
+ * @returns 1 when the whole file was sent, 0 when rsfd would block and the
+ * replay must be continued later, -1 on error.
+ */
+int replay_continue(struct replay_t *r, int dfd, int rsfd);
+
+/* For engines that send on the socket themselves (see uring.c): finds the
+ * next bytes of the replay (the prefix first), from the cached image or read
+ * into buf, without sending them.
+ * @returns 1 with the bytes in *data and *len, 0 when the whole file was
+ * sent, -1 on error.
+ */
+int replay_peek(struct replay_t *r, int dfd, const char **data, size_t *len);
+
+/* Marks n of the bytes returned by replay_peek() as sent. */
+void replay_advance(struct replay_t *r, size_t n);
+
+/* @returns the data file offset of the next byte the client will get, or -1
+ * when offsets don't follow the appends (the char device, whose reads only
+ * return its last writes).
+ */
+off_t replay_position(struct replay_t *r);
+
+/* Closes the splice pipe and drops the cached image and the segment, if any. */
+void replay_release(struct replay_t *r);
+
+#endif /* REPLAY_H */
@@ -0,0 +1,42 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "scan.h"
+
+#define SCAN_NEEDLE_MAX     64
+
+/* Comments:
+ *  Every packet is searched for its terminating newline and checked for the
+ *  AESDCHAR_IOCSEEKTO: command. A command is only one at the start of its
+ *  line, as it always was, so that check is a single memcmp() and the search
+ *  is a memchr() for '\n'. The C library already picks the widest vector
+ *  version the CPU supports at load time, and it is faster than the SSE2 and
+ *  AVX2 loops this file used to carry (see scanbench.c).
+ */
+
+static struct {
+    char needle[SCAN_NEEDLE_MAX];
+    size_t needle_len;
+} scan = {
+    .needle_len = 0
+};
+
+void scan_init(const char *needle) {
+    size_t n = strlen(needle);
+    if(n > SCAN_NEEDLE_MAX) n = SCAN_NEEDLE_MAX;
+    memcpy(scan.needle, needle, n);
+    scan.needle_len = n;
+}
+
+size_t scan_packet(const char *buf, size_t len, ssize_t *ioc) {
+    if(ioc) {
+        bool cmd = scan.needle_len > 0 && scan.needle_len <= len &&
+                   memcmp(buf, scan.needle, scan.needle_len) == 0;
+        *ioc = cmd ? 0 : -1;
+    }
+    const char *nl = memchr(buf, '\n', len);
+    return nl ? (size_t)(nl - buf) : len;
+}
@@ -0,0 +1,20 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Scans buf for the first '\n' and checks whether buf starts with the needle
+ * given to scan_init().
+ * @param ioc is set to 0 if buf starts with the needle, -1 otherwise. Pass
+ * NULL to only look for the newline.
+ * @returns the offset of the first '\n', or len if there is none.
+ */
+size_t scan_packet(const char *buf, size_t len, ssize_t *ioc);
+
+/* Sets the needle scan_packet() looks for. Call it once before starting any
+ * thread.
+ */
+void scan_init(const char *needle);
+
+#endif /* SCAN_H */
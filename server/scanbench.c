@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+#include "scan.h"
+
+/* Comments:
+ *  Microbenchmark for scan.c. It scans buffers of 1 KiB to 1 MiB of packet
+ *  text ending in a newline, once looking for the newline only (packet
+ *  framing) and once with the check for the command at its start
+ *  (find_ioc_command()), and prints the throughput. A bare memchr() is shown
+ *  as a reference, so what scan_packet() adds to it stands out.
+ *
+ *  Build with `make scanbench`, run with ./scanbench [seconds per case].
+ */
+
+#define BENCH_MIN_LEN       1024
+#define BENCH_MAX_LEN       (1 << 20)
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile size_t bench_sink;
+static const char *volatile bench_buf;  // keeps memchr() in the loop
+
+/* @returns the throughput in GB/s of scanning buf len bytes long. */
+static double bench_case(const char *buf, size_t len, bool ioc, bool libc,
+                         double seconds) {
+    size_t iters = 0, batch = (64 << 20) / len + 1;
+    bench_buf = buf;
+    ssize_t pos;
+    double t0 = bench_now(), t;
+    do {
+        for(size_t i = 0; i < batch; i++) {
+            if(libc)
+                bench_sink += (const char *)memchr(bench_buf, '\n', len) - buf;
+            else
+                bench_sink += scan_packet(buf, len, ioc ? &pos : NULL);
+        }
+        iters += batch;
+        t = bench_now() - t0;
+    } while(t < seconds);
+    return (double)len * iters / t / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 0.2;
+    char *buf = malloc(BENCH_MAX_LEN);
+    if(buf == NULL) return 1;
+
+    // Printable text, like what the clients send, without newlines
+    srand(1);
+    for(size_t i = 0; i < BENCH_MAX_LEN; i++)
+        buf[i] = ' ' + rand() % 95;
+
+    scan_init(AESD_SOCKET_IOC_STRING ":");
+    printf("%-8s %-12s %10s %12s\n", "len", "scanner", "newline",
+           "newline+ioc");
+    for(size_t len = BENCH_MIN_LEN; len <= BENCH_MAX_LEN; len *= 4) {
+        buf[len-1] = '\n';
+        printf("%-8zu %-12s %9.2f GB/s\n", len, "memchr",
+               bench_case(buf, len, false, true, seconds));
+        double nl = bench_case(buf, len, false, false, seconds);
+        double ioc = bench_case(buf, len, true, false, seconds);
+        printf("%-8zu %-12s %9.2f GB/s %9.2f GB/s\n",
+               len, "scan_packet", nl, ioc);
+        buf[len-1] = ' ';
+    }
+    free(buf);
+    return 0;
+}
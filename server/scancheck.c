@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "aesdsocket.h"
+#include "scan.h"
+
+/* Comments:
+ *  Consistency check for scan.c. scan_packet() must find the first newline
+ *  and tell the command at the start of a packet apart from everything else,
+ *  whatever the length, the alignment of the buffer and where the newline
+ *  is:
+ *   - every length up to CHECK_SHORT_LEN, at every alignment of a 64 byte
+ *     line, with no newline and then with one at every offset;
+ *   - a few long buffers with the newline near both ends;
+ *   - the command at the start, cut short, off by a byte and further in.
+ *  The text around the newline has bytes that only differ from '\n' in one
+ *  bit (0x0b, 0x8a...).
+ *
+ *  Build with `make scancheck`, run with ./scancheck. It prints the first
+ *  mismatches and exits with 1 if there are any.
+ */
+
+#define CHECK_SHORT_LEN     200
+#define CHECK_ALIGN         64
+#define CHECK_BUF_LEN       (CHECK_ALIGN + (1 << 16))
+#define CHECK_MAX_ERRORS    10
+
+static const size_t check_long[] = { 1023, 1024, 4096 + 17, 65535, 65536 };
+
+static int check_errors;
+
+static void check_fill(char *buf, size_t len) {
+    static const char near[] = { 0x0b, 0x08, 0x0e, 0x1a, 0x2a, 0x4a,
+                                 (char)0x8a, (char)0x8b, (char)0xff, 0x00 };
+    for(size_t i = 0; i < len; i++) {
+        int r = rand() % 4;
+        if(r == 0)
+            buf[i] = near[rand() % sizeof(near)];
+        else if(r == 1)
+            buf[i] = (char)(0x80 + rand() % 0x80);
+        else
+            buf[i] = ' ' + rand() % 95;
+    }
+}
+
+/* Compares scan_packet() on buf with a byte loop and the command check. */
+static void check_one(const char *buf, size_t len, const char *needle) {
+    size_t want = 0;
+    while(want < len && buf[want] != '\n')
+        want++;
+    size_t nlen = strlen(needle);
+    ssize_t wantioc = (nlen <= len && memcmp(buf, needle, nlen) == 0) ? 0 : -1;
+
+    ssize_t ioc = 1;
+    size_t got = scan_packet(buf, len, &ioc);
+    size_t gotnl = scan_packet(buf, len, NULL);
+    if(got == want && gotnl == want && ioc == wantioc)
+        return;
+    if(check_errors++ < CHECK_MAX_ERRORS)
+        printf("len %zu align %zu: newline at %zu/%zu instead of %zu, "
+               "command %zd instead of %zd\n", len,
+               (size_t)((uintptr_t)buf % CHECK_ALIGN), got, gotnl, want,
+               ioc, wantioc);
+}
+
+/* Checks buf len bytes long with no newline and with one at every offset,
+ * at every offset near the ends of a long buffer and some in its middle.
+ */
+static void check_len(char *buf, size_t len, const char *needle) {
+    check_fill(buf, len);
+    for(size_t i = 0; i < len; i++) {
+        if(buf[i] == '\n') buf[i] = ' ';
+    }
+    check_one(buf, len, needle);
+    for(size_t i = 0; i < len; i++) {
+        // Near the ends only, for a long buffer
+        if(len > CHECK_SHORT_LEN && i > 256 && len - i > 256 && i % 61 != 0)
+            continue;
+        buf[i] = '\n';
+        check_one(buf, len, needle);
+        if(i + 1 < len) {
+            // Only the first counts
+            char c = buf[len - 1];
+            buf[len - 1] = '\n';
+            check_one(buf, len, needle);
+            buf[len - 1] = c;
+        }
+        buf[i] = ' ';
+    }
+}
+
+static void check_command(char *buf, const char *needle) {
+    size_t nlen = strlen(needle);
+    const size_t lens[] = { 0, 1, nlen - 1, nlen, nlen + 1, nlen + 40, 300 };
+    for(size_t a = 0; a < CHECK_ALIGN; a++) {
+        for(size_t l = 0; l < sizeof(lens)/sizeof(lens[0]); l++) {
+            size_t len = lens[l];
+            char *b = buf + a;
+            check_fill(b, len);
+            // At the start, whole or cut short by len
+            memcpy(b, needle, (len < nlen) ? len : nlen);
+            if(len > nlen) b[len - 1] = '\n';
+            check_one(b, len, needle);
+            // Off by its last byte, and one byte in
+            if(len >= nlen) {
+                b[nlen - 1] ^= 0x20;
+                check_one(b, len, needle);
+                b[nlen - 1] ^= 0x20;
+            }
+            if(len > nlen) {
+                memmove(b + 1, b, nlen);
+                b[0] = ' ';
+                check_one(b, len, needle);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *needle = AESD_SOCKET_IOC_STRING ":";
+    char *buf = malloc(CHECK_BUF_LEN);
+    if(buf == NULL) return 1;
+
+    scan_init(needle);
+    srand(1);
+    for(size_t a = 0; a < CHECK_ALIGN; a++) {
+        for(size_t len = 0; len <= CHECK_SHORT_LEN; len++)
+            check_len(buf + a, len, needle);
+    }
+    for(size_t l = 0; l < sizeof(check_long)/sizeof(check_long[0]); l++) {
+        check_len(buf, check_long[l], needle);
+        check_len(buf + 1, check_long[l], needle);
+    }
+    check_command(buf, needle);
+    printf("scan_packet %s\n", check_errors ? "MISMATCH" : "ok");
+    free(buf);
+    return check_errors ? 1 : 0;
+}
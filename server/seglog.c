@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#include "aesdsocket.h"
+#include "seglog.h"
+#include "cache.h"
+#include "handoff.h"
+#include "alog.h"
+
+#define SEGLOG_MAGIC        "aesdsocket-seglog 1"
+#define SEGLOG_SEND_SEGS    32          // segments per handoff message
+
+/* Comments:
+ *  The data of the file backend is a list of segment files. Appends go to
+ *  the last one, the active segment, until it reaches seglen; then a new
+ *  segment is started. The retention only ever drops the oldest segment, so
+ *  a drop is one unlink() and a list operation however long the log is, and
+ *  a replay only reads what is kept. The byte retention drops a segment once
+ *  all of it is older than the last retain_bytes, so at least that much is
+ *  always kept; right after a roll, with retain_bytes about seglen, the log
+ *  would otherwise be down to the few bytes of the new active segment.
+ *
+ *  Positions are log offsets: bytes appended since the log was created. The
+ *  old data file offsets were the same thing, and so are the offsets of the
+ *  tail ring (tail.c), so replays, the cache and subscribers don't have to
+ *  care where the segment boundaries are.
+ *
+ *  The manifest is rewritten (to a temporary file, then renamed) every time
+ *  a segment is added or dropped. It says which segment files are in the log
+ *  and where the oldest one starts, so the log can be found again from the
+ *  path alone:
+ *      aesdsocket-seglog 1
+ *      segment_len 1048576
+ *      first 3
+ *      last 7
+ *      start 2097152
+ *
+ *  The memory backend (-b mem) keeps the same log in memfd_create() files
+ *  instead: nothing is written to disk, there is no manifest, and a dropped
+ *  segment is freed as soon as the last reader lets go of it. sendfile() and
+ *  splice() work on them like on the segment files.
+ *
+ *  The mmap backend (-b mmap) writes the same segment files, but allocates
+ *  each one whole with fallocate() when it is started and maps it. Appends
+ *  are a memcpy() into the mapping and reads a memcpy() out of it (or a
+ *  send() straight from it, see replay.c), so neither costs a system call.
+ *  The mapping lives as long as the segment: a reader holding a reference
+ *  can use it after the retention dropped the file. A segment is truncated
+ *  to the bytes it holds when the next one is started, so the files on disk
+ *  end where their data ends, as with the other stores.
+ *
+ *  seglog_sync() flushes what was appended since the last call, segment by
+ *  segment from where it stopped: fdatasync() for the segment files,
+ *  msync() of the new pages for the mapped ones. It remembers the log offset
+ *  it got to, so a segment that was rolled or dropped in between costs
+ *  nothing more than the bytes it still had to flush.
+ *
+ *  On a hot restart (-H, see handoff.c) the log moves to the new server as
+ *  it is: seglog_send() passes the open segment descriptors with their
+ *  numbers, offsets and ages, and seglog_recv() rebuilds the list around
+ *  them. Nothing is copied or reopened, so it works the same for the memfd
+ *  segments, which have no name, and the new server maps the segments again
+ *  itself.
+ *
+ *  Appends are serialized by the callers. The age retention also runs from
+ *  the timer thread (seglog_expire()), so the drops and the manifest writes
+ *  take retain_mutex. Readers take seglog.mutex only to
+ *  find a segment and take a reference; a segment's published length is
+ *  stored after its bytes are written, so they read up to it without a lock.
+ */
+
+struct seglog_seg {
+    uint64_t seq;                   // Number in the file name
+    uint64_t base;                  // Log offset of the first byte
+    _Atomic uint64_t len;           // Published length
+    int fd;
+    char *map;                      // Whole segment, with SEGLOG_MMAP
+    size_t cap;                     // Bytes allocated and mapped
+    _Atomic time_t last;            // Last append, for the age retention
+    atomic_int refs;                // The log's, plus one per reader
+    bool dropped;                   // Not in seglog.segs anymore
+    TAILQ_ENTRY(seglog_seg) nodes;
+};
+
+static struct {
+    bool enabled;
+    enum seglog_store store;
+    char path[PATH_MAX];
+    size_t seglen;
+    uint64_t retain_bytes;
+    time_t retain_secs;
+    pthread_mutex_t mutex;          // Protects segs and start
+    pthread_mutex_t retain_mutex;   // Serializes the drops and the manifest
+    pthread_mutex_t sync_mutex;     // Serializes seglog_sync(), protects synced
+    uint64_t synced;                // Log offset flushed up to
+    TAILQ_HEAD(seglog_head, seglog_seg) segs;
+    struct seglog_seg *active;      // Last of segs, only the appender changes it
+    _Atomic uint64_t start;
+} seglog = {
+    .enabled = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .retain_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .sync_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .synced = 0,
+    .active = NULL,
+    .start = 0
+};
+
+static struct seglog_seg *seg_create(uint64_t seq, uint64_t base, size_t cap);
+static int seg_map(struct seglog_seg *s, size_t cap);
+static void seg_name(char *buf, size_t len, uint64_t seq);
+static int seglog_roll(size_t need);
+static void seglog_retain(void);
+static int seglog_manifest(void);
+
+int seglog_open(const char *path, enum seglog_store store, size_t seglen,
+                uint64_t retain_bytes, time_t retain_secs) {
+    strncpy(seglog.path, path, sizeof(seglog.path) - 1);
+    seglog.store = store;
+    seglog.seglen = seglen;
+    seglog.retain_bytes = retain_bytes;
+    seglog.retain_secs = retain_secs;
+    TAILQ_INIT(&seglog.segs);
+    atomic_store(&seglog.start, 0);
+    seglog.synced = 0;
+
+    struct seglog_seg *s = seg_create(1, 0, seglen);
+    if(s == NULL) return -1;
+    TAILQ_INSERT_TAIL(&seglog.segs, s, nodes);
+    seglog.active = s;
+    if(seglog_manifest()) {
+        seglog_close(true);
+        return -1;
+    }
+    seglog.enabled = true;
+    alog(LOG_DEBUG, "segmented log %s, %zu byte segments%s", path, seglen,
+         (store == SEGLOG_MEMORY) ? " in memory" :
+         (store == SEGLOG_MMAP) ? " mapped" : "");
+    return 0;
+}
+
+void seglog_close(bool remove) {
+    struct seglog_seg *s;
+    char name[PATH_MAX+32];
+    seglog.enabled = false;
+    pthread_mutex_lock(&seglog.mutex);
+    while((s = TAILQ_FIRST(&seglog.segs)) != NULL) {
+        TAILQ_REMOVE(&seglog.segs, s, nodes);
+        s->dropped = true;
+        if(remove && seglog.store != SEGLOG_MEMORY) {
+            seg_name(name, sizeof(name), s->seq);
+            unlink(name);
+        }
+        pthread_mutex_unlock(&seglog.mutex);
+        seglog_put(s);
+        pthread_mutex_lock(&seglog.mutex);
+    }
+    seglog.active = NULL;
+    pthread_mutex_unlock(&seglog.mutex);
+}
+
+struct seglog_hello {
+    char magic[sizeof(SEGLOG_MAGIC)];
+    uint64_t start;
+    uint64_t nsegs;
+};
+
+struct seglog_sent {
+    uint64_t seq;
+    uint64_t base;
+    uint64_t len;
+    int64_t last;
+};
+
+int seglog_send(int sock) {
+    struct seglog_hello hello = { .magic = SEGLOG_MAGIC, .nsegs = 0 };
+    struct seglog_sent ents[SEGLOG_SEND_SEGS];
+    int fds[SEGLOG_SEND_SEGS];
+    struct seglog_seg *s;
+    int n = 0;
+
+    // Nothing appends or drops anymore, only readers could take the mutex
+    hello.start = atomic_load(&seglog.start);
+    TAILQ_FOREACH(s, &seglog.segs, nodes)
+        hello.nsegs++;
+    if(handoff_sendfds(sock, &hello, sizeof(hello), NULL, 0))
+        return -1;
+    TAILQ_FOREACH(s, &seglog.segs, nodes) {
+        ents[n].seq = s->seq;
+        ents[n].base = s->base;
+        ents[n].len = atomic_load(&s->len);
+        ents[n].last = atomic_load(&s->last);
+        fds[n++] = s->fd;
+        if(n == SEGLOG_SEND_SEGS || TAILQ_NEXT(s, nodes) == NULL) {
+            if(handoff_sendfds(sock, ents, n * sizeof(ents[0]), fds, n))
+                return -1;
+            n = 0;
+        }
+    }
+    alog(LOG_DEBUG, "sent %" PRIu64 " log segments", hello.nsegs);
+    seglog_close(false);
+    return 0;
+}
+
+int seglog_recv(int sock, const char *path, enum seglog_store store,
+                size_t seglen, uint64_t retain_bytes, time_t retain_secs) {
+    struct seglog_hello hello;
+    struct seglog_sent ents[SEGLOG_SEND_SEGS];
+    int fds[SEGLOG_SEND_SEGS];
+    int nfds = 0;
+    uint64_t got = 0;
+
+    strncpy(seglog.path, path, sizeof(seglog.path) - 1);
+    seglog.store = store;
+    seglog.seglen = seglen;
+    seglog.retain_bytes = retain_bytes;
+    seglog.retain_secs = retain_secs;
+    TAILQ_INIT(&seglog.segs);
+
+    ssize_t rc = handoff_recvfds(sock, &hello, sizeof(hello), fds, &nfds, 0);
+    if(rc == -1) return -1;
+    if(rc != sizeof(hello) || memcmp(hello.magic, SEGLOG_MAGIC,
+                                     sizeof(hello.magic)) || hello.nsegs == 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    while(got < hello.nsegs) {
+        rc = handoff_recvfds(sock, ents, sizeof(ents), fds, &nfds,
+                             SEGLOG_SEND_SEGS);
+        if(rc == -1) goto errorcleanup;
+        int n = rc / sizeof(ents[0]);
+        if(rc == 0 || rc % sizeof(ents[0]) || n != nfds) {
+            for(int i = 0; i < nfds; i++)
+                robustclose(fds[i]);
+            errno = EPROTO;
+            goto errorcleanup;
+        }
+        for(int i = 0; i < n; i++) {
+            struct seglog_seg *s = calloc(1, sizeof(struct seglog_seg));
+            if(s == NULL) {
+                for(; i < n; i++)
+                    robustclose(fds[i]);
+                goto errorcleanup;
+            }
+            s->seq = ents[i].seq;
+            s->base = ents[i].base;
+            atomic_init(&s->last, ents[i].last);
+            s->fd = fds[i];
+            s->cap = (ents[i].len > seglen) ? ents[i].len : seglen;
+            atomic_init(&s->len, ents[i].len);
+            atomic_init(&s->refs, 1);
+            TAILQ_INSERT_TAIL(&seglog.segs, s, nodes);
+        }
+        got += n;
+    }
+    seglog.active = TAILQ_LAST(&seglog.segs, seglog_head);
+    if(store == SEGLOG_MMAP) {
+        // Only the active segment still needs room to grow
+        struct seglog_seg *s;
+        TAILQ_FOREACH(s, &seglog.segs, nodes) {
+            size_t cap = (s == seglog.active) ? s->cap : atomic_load(&s->len);
+            if(cap > 0 && seg_map(s, cap)) goto errorcleanup;
+        }
+    }
+    atomic_store(&seglog.start, hello.start);
+    seglog.synced = hello.start;    // whatever the sender didn't flush
+    if(seglog_manifest()) goto errorcleanup;
+    seglog.enabled = true;
+    alog(LOG_DEBUG, "took over segmented log %s, %" PRIu64 " segments, "
+         "offsets %" PRIu64 " to %" PRIu64, path, got, hello.start,
+         seglog.active->base + atomic_load(&seglog.active->len));
+    return 0;
+
+    errorcleanup:;
+    int errnoshadow = errno;
+    seglog_close(false);
+    errno = errnoshadow;
+    return -1;
+}
+
+bool seglog_enabled(void) {
+    return seglog.enabled;
+}
+
+ssize_t seglog_writev(const struct iovec *iov, int iovcnt) {
+    struct seglog_seg *s = seglog.active;
+    uint64_t len = atomic_load_explicit(&s->len, memory_order_relaxed);
+
+    if(len > 0 && len + iov[0].iov_len > s->cap) {
+        if(seglog_roll(iov[0].iov_len)) return -1;
+        s = seglog.active;
+        len = 0;
+    }
+    else if(s->map != NULL && iov[0].iov_len > s->cap) {
+        // Nothing was published from this mapping yet, so no reader uses it
+        if(seg_map(s, iov[0].iov_len)) return -1;
+    }
+    size_t total = iov[0].iov_len;
+    int n = 1;
+    while(n < iovcnt && len + total + iov[n].iov_len <= s->cap)
+        total += iov[n++].iov_len;
+
+    ssize_t wc;
+    if(s->map != NULL) {
+        char *p = s->map + len;
+        for(int i = 0; i < n; i++) {
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        wc = total;
+    }
+    else {
+        wc = writev(s->fd, iov, n);
+        if(wc == -1) return -1;
+    }
+    atomic_store_explicit(&s->last, time(NULL), memory_order_relaxed);
+    atomic_store_explicit(&s->len, len + wc, memory_order_release);
+    if(seglog.retain_bytes || seglog.retain_secs)
+        seglog_retain();
+    return wc;
+}
+
+uint64_t seglog_start(void) {
+    return atomic_load(&seglog.start);
+}
+
+struct seglog_seg *seglog_get(uint64_t pos) {
+    struct seglog_seg *s;
+    pthread_mutex_lock(&seglog.mutex);
+    TAILQ_FOREACH(s, &seglog.segs, nodes) {
+        if(s == seglog.active ||
+           pos < s->base + atomic_load_explicit(&s->len, memory_order_acquire))
+            break;
+    }
+    if(s != NULL &&
+       pos > s->base + atomic_load_explicit(&s->len, memory_order_acquire))
+        s = NULL;
+    if(s != NULL)
+        atomic_fetch_add(&s->refs, 1);
+    pthread_mutex_unlock(&seglog.mutex);
+    return s;
+}
+
+struct seglog_seg *seglog_next(struct seglog_seg *s) {
+    struct seglog_seg *next;
+    pthread_mutex_lock(&seglog.mutex);
+    if(s->dropped)
+        next = TAILQ_FIRST(&seglog.segs);   // we fell behind the retention
+    else
+        next = TAILQ_NEXT(s, nodes);
+    if(next != NULL)
+        atomic_fetch_add(&next->refs, 1);
+    pthread_mutex_unlock(&seglog.mutex);
+    seglog_put(s);
+    return next;
+}
+
+void seglog_put(struct seglog_seg *s) {
+    if(atomic_fetch_sub(&s->refs, 1) != 1) return;
+    if(s->map != NULL)
+        munmap(s->map, s->cap);
+    robustclose(s->fd);
+    free(s);
+}
+
+int seglog_fd(struct seglog_seg *s) {
+    return s->fd;
+}
+
+const char *seglog_map(struct seglog_seg *s) {
+    return s->map;
+}
+
+uint64_t seglog_base(struct seglog_seg *s) {
+    return s->base;
+}
+
+uint64_t seglog_len(struct seglog_seg *s) {
+    return atomic_load_explicit(&s->len, memory_order_acquire);
+}
+
+uint64_t seglog_end(void) {
+    pthread_mutex_lock(&seglog.mutex);
+    struct seglog_seg *s = seglog.active;
+    uint64_t end = s ? s->base + seglog_len(s) : 0;
+    pthread_mutex_unlock(&seglog.mutex);
+    return end;
+}
+
+size_t seglog_locate(uint64_t *pos, size_t len, struct seglog_seg **seg,
+                     int *fd, off_t *off) {
+    for(;;) {
+        if(*seg == NULL) {
+            *seg = seglog_get(*pos);
+            if(*seg == NULL) return 0;
+        }
+        uint64_t base = seglog_base(*seg);
+        uint64_t seglen = seglog_len(*seg);
+        if(*pos < base)
+            *pos = base;        // deleted by the retention
+        if(*pos < base + seglen) {
+            if(len > base + seglen - *pos)
+                len = base + seglen - *pos;
+            *fd = seglog_fd(*seg);
+            *off = *pos - base;
+            return len;
+        }
+        // Done with this segment; NULL after the active one means the end
+        *seg = seglog_next(*seg);
+        if(*seg == NULL) return 0;
+    }
+}
+
+ssize_t seglog_pread(void *buf, size_t len, uint64_t pos) {
+    struct seglog_seg *s = seglog_get(pos);
+    if(s == NULL) return 0;
+    if(pos < s->base) {
+        seglog_put(s);
+        errno = ERANGE;
+        return -1;
+    }
+    uint64_t avail = seglog_len(s) - (pos - s->base);
+    if(len > avail) len = avail;
+    ssize_t rc;
+    if(s->map != NULL) {
+        if(len > 0)
+            memcpy(buf, s->map + (pos - s->base), len);
+        rc = len;
+    }
+    else do {
+        rc = pread(s->fd, buf, len, pos - s->base);
+    } while(rc == -1 && errno == EINTR);
+    seglog_put(s);
+    return rc;
+}
+
+static struct seglog_seg *seg_create(uint64_t seq, uint64_t base, size_t cap) {
+    char name[PATH_MAX+32];
+    struct seglog_seg *s = calloc(1, sizeof(struct seglog_seg));
+    if(s == NULL) return NULL;
+    seg_name(name, sizeof(name), seq);
+    if(seglog.store == SEGLOG_MEMORY)
+        s->fd = memfd_create(name, MFD_CLOEXEC);
+    else if(seglog.store == SEGLOG_MMAP)
+        s->fd = open(name, O_CREAT|O_TRUNC|O_RDWR|O_CLOEXEC, S_IRWXU|S_IRWXG);
+    else
+        s->fd = open(name, O_APPEND|O_CREAT|O_TRUNC|O_RDWR|O_CLOEXEC,
+                     S_IRWXU|S_IRWXG);
+    if(s->fd == -1) {
+        log_errno("seg_create(): open()");
+        free(s);
+        return NULL;
+    }
+    s->cap = cap;
+    if(seglog.store == SEGLOG_MMAP && seg_map(s, cap)) {
+        robustclose(s->fd);
+        unlink(name);
+        free(s);
+        return NULL;
+    }
+    s->seq = seq;
+    s->base = base;
+    atomic_init(&s->last, time(NULL));
+    atomic_init(&s->len, 0);
+    atomic_init(&s->refs, 1);
+    return s;
+}
+
+/* Allocates cap bytes of the segment file and maps them in place of the
+ * current mapping, which no reader may be using.
+ * @returns 0 on success, -1 on error.
+ */
+static int seg_map(struct seglog_seg *s, size_t cap) {
+    int r = fallocate(s->fd, 0, 0, cap);
+    if(r == -1 && errno == EOPNOTSUPP)
+        r = ftruncate(s->fd, cap);  // sparse, for file systems without it
+    if(r == -1) {
+        log_errno("seg_map(): fallocate()");
+        return -1;
+    }
+    char *map = mmap(NULL, cap, PROT_READ|PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if(map == MAP_FAILED) {
+        log_errno("seg_map(): mmap()");
+        return -1;
+    }
+    if(s->map != NULL)
+        munmap(s->map, s->cap);
+    s->map = map;
+    s->cap = cap;
+    return 0;
+}
+
+static void seg_name(char *buf, size_t len, uint64_t seq) {
+    snprintf(buf, len, "%s.%06" PRIu64, seglog.path, seq);
+}
+
+/* Closes the active segment and starts the next one, with room for at least
+ * need bytes.
+ */
+static int seglog_roll(size_t need) {
+    struct seglog_seg *old = seglog.active;
+    uint64_t len = atomic_load(&old->len);
+    struct seglog_seg *s = seg_create(old->seq + 1, old->base + len,
+                                      (need > seglog.seglen) ? need
+                                                             : seglog.seglen);
+    if(s == NULL) return -1;
+    // Readers only use the mapping up to len, so the rest can go
+    if(old->map != NULL && ftruncate(old->fd, len))
+        log_errno("seglog_roll(): ftruncate()");
+    pthread_mutex_lock(&seglog.mutex);
+    TAILQ_INSERT_TAIL(&seglog.segs, s, nodes);
+    seglog.active = s;
+    pthread_mutex_unlock(&seglog.mutex);
+    alog(LOG_DEBUG, "started log segment %" PRIu64 " at offset %" PRIu64,
+           s->seq, s->base);
+    pthread_mutex_lock(&seglog.retain_mutex);
+    int r = seglog_manifest();
+    pthread_mutex_unlock(&seglog.retain_mutex);
+    return r;
+}
+
+int seglog_sync(void) {
+    int r = 0;
+    if(!seglog.enabled || seglog.store == SEGLOG_MEMORY) return 0;
+    pthread_mutex_lock(&seglog.sync_mutex);
+    struct seglog_seg *s = seglog_get(seglog.synced);
+    while(s != NULL) {
+        uint64_t len = seglog_len(s);
+        uint64_t from = (seglog.synced > s->base) ? seglog.synced - s->base
+                                                  : 0;
+        if(from < len) {
+            if(s->map != NULL) {
+                from &= ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+                r = msync(s->map + from, len - from, MS_SYNC);
+            }
+            else {
+                r = fdatasync(s->fd);
+            }
+            if(r) {
+                log_errno("seglog_sync()");
+                seglog_put(s);
+                break;
+            }
+            seglog.synced = s->base + len;
+        }
+        s = seglog_next(s);
+    }
+    pthread_mutex_unlock(&seglog.sync_mutex);
+    return r;
+}
+
+void seglog_expire(void) {
+    if(seglog.enabled && seglog.retain_secs)
+        seglog_retain();
+}
+
+/* Drops the oldest segments while the log is over one of its limits. The
+ * active segment is always kept.
+ */
+static void seglog_retain(void) {
+    struct seglog_seg *s;
+    char name[PATH_MAX+32];
+    bool dropped = false;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&seglog.retain_mutex);
+    for(;;) {
+        pthread_mutex_lock(&seglog.mutex);
+        uint64_t end = seglog.active->base + atomic_load(&seglog.active->len);
+        s = TAILQ_FIRST(&seglog.segs);
+        // Only once none of its bytes are among the last retain_bytes
+        if(s == seglog.active ||
+           !((seglog.retain_bytes &&
+              end - (s->base + atomic_load(&s->len)) >= seglog.retain_bytes) ||
+             (seglog.retain_secs &&
+              now - atomic_load(&s->last) > seglog.retain_secs))) {
+            pthread_mutex_unlock(&seglog.mutex);
+            break;
+        }
+        TAILQ_REMOVE(&seglog.segs, s, nodes);
+        s->dropped = true;
+        atomic_store(&seglog.start, TAILQ_FIRST(&seglog.segs)->base);
+        pthread_mutex_unlock(&seglog.mutex);
+
+        seg_name(name, sizeof(name), s->seq);
+        if(seglog.store != SEGLOG_MEMORY && unlink(name))
+            log_errno("seglog_retain(): unlink()");
+        alog(LOG_DEBUG, "dropped log segment %" PRIu64, s->seq);
+        seglog_put(s);
+        dropped = true;
+    }
+    if(dropped) {
+        cache_invalidate();     // the image still holds the dropped bytes
+        seglog_manifest();
+    }
+    pthread_mutex_unlock(&seglog.retain_mutex);
+}
+
+/* Writes the manifest next to the segments and renames it into place. */
+static int seglog_manifest(void) {
+    if(seglog.store == SEGLOG_MEMORY) return 0;
+    char tmp[PATH_MAX+32];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", seglog.path);
+    FILE *f = fopen(tmp, "w");
+    if(f == NULL) {
+        log_errno("seglog_manifest(): fopen()");
+        return -1;
+    }
+    pthread_mutex_lock(&seglog.mutex);
+    fprintf(f, SEGLOG_MAGIC "\nsegment_len %zu\nfirst %" PRIu64 "\n"
+               "last %" PRIu64 "\nstart %" PRIu64 "\n",
+            seglog.seglen, TAILQ_FIRST(&seglog.segs)->seq,
+            seglog.active->seq, TAILQ_FIRST(&seglog.segs)->base);
+    pthread_mutex_unlock(&seglog.mutex);
+    if(fclose(f) == EOF) {
+        log_errno("seglog_manifest(): fclose()");
+        unlink(tmp);
+        return -1;
+    }
+    if(rename(tmp, seglog.path)) {
+        log_errno("seglog_manifest(): rename()");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
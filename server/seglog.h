@@ -0,0 +1,123 @@
+#ifndef SEGLOG_H
+#define SEGLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* One segment file of the log. Readers hold a reference (seglog_get()) while
+ * they use fd, so a segment dropped by the retention stays readable until
+ * they are done with it.
+ */
+struct seglog_seg;
+
+enum seglog_store {
+    SEGLOG_FILES,                   // Segment files next to a manifest
+    SEGLOG_MEMORY,                  // Anonymous memfd_create() files
+    SEGLOG_MMAP                     // Segment files, preallocated and mapped
+};
+
+/* Creates an empty log: the manifest at path and the segments next to it
+ * (path.000001, path.000002, ...), or with SEGLOG_MEMORY only segments in
+ * memory, named after path.
+ * @param seglen is the size at which the active segment is closed and a new
+ * one started. Appends are never split, so a segment can end up larger.
+ * @param retain_bytes drops the oldest segments once they are older than the
+ * last retain_bytes appended, so at least that many are kept; 0 for no limit.
+ * @param retain_secs drops the segments not appended to for this long, 0
+ * for no limit.
+ * @returns 0 on success, -1 on error.
+ */
+int seglog_open(const char *path, enum seglog_store store, size_t seglen,
+                uint64_t retain_bytes, time_t retain_secs);
+
+/* Closes the log, deleting the segment files if remove is true. */
+void seglog_close(bool remove);
+
+/* Sends the segments, with their descriptors, to the server that takes the
+ * log over on the handoff connection sock (see handoff.c), then closes the
+ * log without deleting anything. Nothing may append anymore.
+ * @returns 0 on success, -1 on error.
+ */
+int seglog_send(int sock);
+
+/* Takes over the log sent by seglog_send() on sock, instead of creating one
+ * with seglog_open() (same parameters). Offsets carry on where the sender
+ * stopped.
+ * @returns 0 on success, -1 on error.
+ */
+int seglog_recv(int sock, const char *path, enum seglog_store store,
+                size_t seglen, uint64_t retain_bytes, time_t retain_secs);
+
+bool seglog_enabled(void);
+
+/* Appends to the active segment as many of the iovcnt buffers as fit in it
+ * (at least one), starting a new segment first if the first one doesn't fit.
+ * The caller must be the only thread appending, as with writev() on the data
+ * file (see writer_flush()).
+ * @returns the number of bytes written, or -1 on error.
+ */
+ssize_t seglog_writev(const struct iovec *iov, int iovcnt);
+
+/* Flushes the bytes appended since the last call to the disk, segment by
+ * segment. Safe to call from any thread; a no-op with SEGLOG_MEMORY.
+ * @returns 0 on success, -1 on error.
+ */
+int seglog_sync(void);
+
+/* Drops the segments older than the age limit, for when nothing is being
+ * appended (appends check both limits themselves). Safe to call from any
+ * thread.
+ */
+void seglog_expire(void);
+
+/* @returns the log offset of the oldest byte still kept. Offsets count the
+ * bytes appended since the log was created.
+ */
+uint64_t seglog_start(void);
+
+/* @returns a reference on the segment holding log offset pos, or on the
+ * oldest segment if pos was dropped, or NULL when pos is past the end of
+ * the log.
+ */
+struct seglog_seg *seglog_get(uint64_t pos);
+
+/* @returns a reference on the segment that follows s, or NULL if s is the
+ * active one. The reference on s is dropped.
+ */
+struct seglog_seg *seglog_next(struct seglog_seg *s);
+
+void seglog_put(struct seglog_seg *s);
+
+/* Where the bytes of a segment are: its descriptor, the log offset of its
+ * first byte and the number of bytes published so far.
+ */
+int seglog_fd(struct seglog_seg *s);
+/* @returns the mapping of the segment with SEGLOG_MMAP, NULL otherwise. */
+const char *seglog_map(struct seglog_seg *s);
+uint64_t seglog_base(struct seglog_seg *s);
+uint64_t seglog_len(struct seglog_seg *s);
+
+/* @returns the log offset just past the last byte appended. */
+uint64_t seglog_end(void);
+
+/* Finds where the bytes at log offset *pos are, for a reader going through
+ * the log in order that keeps a reference in *seg (NULL to start with) on the
+ * segment it is reading. *pos moves to the oldest byte kept if it was
+ * dropped.
+ * @returns how many of the next len bytes can be read from *fd at *off, 0 at
+ * the end of the log.
+ */
+size_t seglog_locate(uint64_t *pos, size_t len, struct seglog_seg **seg,
+                     int *fd, off_t *off);
+
+/* Reads from log offset pos, like pread() on the old single data file.
+ * @returns the number of bytes read, 0 at the end of the log, or -1 on
+ * error (errno is ERANGE if pos was dropped by the retention).
+ */
+ssize_t seglog_pread(void *buf, size_t len, uint64_t pos);
+
+#endif /* SEGLOG_H */
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "shard.h"
+#include "shutdown.h"
+#include "alog.h"
+
+/* Comments:
+ *  With a single listening socket every accept() of the server goes through
+ *  one queue, and in the thread and pool modes through one thread. Here each
+ *  shard has its own SO_REUSEPORT socket, so the kernel balances connections
+ *  between the sockets by their addresses and each shard accepts only its
+ *  own, in parallel with the others. A shard is a whole server of the
+ *  selected mode; they only share the data file (and its mutex, writer and
+ *  cache).
+ */
+
+struct shard_t {
+    int sfd;                        // Listening socket of this shard
+    pthread_mutex_t *dfdmutex;      // Mutex for data file descriptor
+    int nthreads;
+    pthread_t thread;               // Thread ID
+    int ret;                        // Return value
+};
+
+static void *shard_thread(void *thread_param);
+
+int shard_run(const int *sfds, int nshards, pthread_mutex_t *dfdmutex,
+              int nthreads) {
+    int r = 0;
+    int started;
+    struct shard_t *shards = calloc(nshards, sizeof(struct shard_t));
+    if(shards == NULL) {
+        log_errno("shard_run(): calloc()");
+        return -1;
+    }
+
+    for(started = 0; started < nshards; started++) {
+        struct shard_t *s = &shards[started];
+        s->sfd = sfds[started];
+        s->dfdmutex = dfdmutex;
+        s->nthreads = nthreads;
+        int e = pthread_create(&s->thread, NULL, shard_thread, s);
+        if(e) {
+            errno = e;
+            log_errno("shard_run(): pthread_create()");
+            shutdown_request(0);
+            r = -1;
+            break;
+        }
+    }
+    alog(LOG_DEBUG, "started %i shards", started);
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(shards[i].thread, NULL);
+        if(shards[i].ret) r = -1;
+    }
+    free(shards);
+    return r;
+}
+
+static void *shard_thread(void *thread_param) {
+    struct shard_t *s = (struct shard_t *)thread_param;
+    s->ret = runserver(s->sfd, s->dfdmutex, s->nthreads);
+    if(s->ret) {
+        log_errno("shard_thread(): runserver()");
+        shutdown_request(0);        // one shard failing stops the server
+    }
+    return thread_param;
+}
@@ -0,0 +1,20 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+
+/* Runs one complete server per listening socket, each in its own thread with
+ * its own accept loop and connection handlers (see runserver()). The sockets
+ * share port 9000 through SO_REUSEPORT and the kernel spreads the incoming
+ * connections between them. Returns when all the shards have exited.
+ * @param sfds are the bound and listening sockets, one per shard.
+ * @param nshards is the number of sockets in sfds.
+ * @param dfdmutex is the mutex protecting writes to the data file.
+ * @param nthreads is the number of threads per shard for the modes that
+ * take one.
+ * @returns 0 on success, -1 if a shard failed.
+ */
+int shard_run(const int *sfds, int nshards, pthread_mutex_t *dfdmutex,
+              int nthreads);
+
+#endif /* SHARD_H */
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "aesdsocket.h"
+#include "shutdown.h"
+
+#define SHUTDOWN_MIN_HOOKS  8           // grown as needed (a pool per -l)
+#define SHUTDOWN_MAX_POLL   4           // descriptors per shutdown_poll()
+
+/* Comments:
+ *  Threads used to wake up every 20 ms to look at
+ *  flag_accepting_connections. Now every blocking wait also watches one
+ *  eventfd, which shutdown_request() makes readable and nobody ever reads
+ *  back, so it wakes all the waiters at once and keeps waking late ones.
+ *  Idle threads sleep until there is work or the server stops.
+ *
+ *  A drain (shutdown_drain(), for a hot restart, see handoff.c) is a second,
+ *  softer latch: only the accept loops watch it. They stop taking new
+ *  connections, the connections already open are served until they close,
+ *  and each mode returns from its run function once it has none left. The
+ *  listening sockets stay open, so the clients that connect meanwhile wait
+ *  in the backlog for the next server.
+ *
+ *  SIGINT and SIGTERM are blocked everywhere and read from a signalfd by a
+ *  thread of their own, so no code runs in signal context and no syscall of
+ *  the worker threads gets interrupted.
+ */
+
+static struct {
+    int efd;                        // Shutdown latch
+    int dfd;                        // Drain latch
+    volatile bool draining;
+    int sigfd;                      // SIGINT and SIGTERM
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t mutex;          // Protects hooks and nhooks
+    struct shutdown_hook {
+        void (*fn)(void *arg);
+        void *arg;
+    } *hooks;
+    int nhooks;
+} sd = {
+    .efd = -1,
+    .dfd = -1,
+    .draining = false,
+    .sigfd = -1,
+    .started = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .hooks = NULL,
+    .nhooks = 0
+};
+
+static void *shutdown_thread(void *thread_param);
+static void shutdown_runhooks(void);
+
+int shutdown_init(void) {
+    int r;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    r = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if(r) {
+        errno = r;
+        return -1;
+    }
+    sd.sigfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if(sd.sigfd == -1) return -1;
+    sd.efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(sd.efd == -1) {
+        robustclose(sd.sigfd);
+        return -1;
+    }
+    sd.dfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(sd.dfd == -1) {
+        robustclose(sd.efd);
+        robustclose(sd.sigfd);
+        return -1;
+    }
+    r = pthread_create(&sd.thread, NULL, shutdown_thread, NULL);
+    if(r) {
+        errno = r;
+        robustclose(sd.dfd);
+        robustclose(sd.efd);
+        robustclose(sd.sigfd);
+        return -1;
+    }
+    sd.started = true;
+    return 0;
+}
+
+void shutdown_destroy(void) {
+    if(!sd.started) return;
+    shutdown_request(0);
+    pthread_join(sd.thread, NULL);
+    sd.started = false;
+    robustclose(sd.dfd);
+    robustclose(sd.efd);
+    robustclose(sd.sigfd);
+    pthread_mutex_lock(&sd.mutex);
+    free(sd.hooks);
+    sd.hooks = NULL;
+    sd.nhooks = 0;
+    pthread_mutex_unlock(&sd.mutex);
+}
+
+void shutdown_request(int signo) {
+    if(signo)
+        last_signal_caught = signo;
+    flag_accepting_connections = false;
+    uint64_t one = 1;
+    if(write(sd.efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        log_errno("shutdown_request(): eventfd write()");
+    shutdown_runhooks();
+}
+
+void shutdown_drain(void) {
+    sd.draining = true;
+    uint64_t one = 1;
+    if(write(sd.dfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        log_errno("shutdown_drain(): eventfd write()");
+    shutdown_runhooks();
+}
+
+bool shutdown_draining(void) {
+    return sd.draining;
+}
+
+int shutdown_drain_fd(void) {
+    return sd.dfd;
+}
+
+static void shutdown_runhooks(void) {
+    pthread_mutex_lock(&sd.mutex);
+    for(int i = 0; i < sd.nhooks; i++) {
+        if(sd.hooks[i].fn)
+            sd.hooks[i].fn(sd.hooks[i].arg);
+    }
+    pthread_mutex_unlock(&sd.mutex);
+}
+
+int shutdown_fd(void) {
+    return sd.efd;
+}
+
+int shutdown_wait(int fd) {
+    struct pollfd fds = { .fd = fd, .events = POLLIN|POLLPRI };
+    return shutdown_poll(&fds, 1);
+}
+
+int shutdown_poll(struct pollfd *fds, int nfds) {
+    struct pollfd all[SHUTDOWN_MAX_POLL+1];
+    if(nfds > SHUTDOWN_MAX_POLL) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(all, fds, nfds * sizeof(struct pollfd));
+    all[nfds].fd = sd.efd;
+    all[nfds].events = POLLIN;
+    for(;;) {
+        if(!flag_accepting_connections) return 0;
+        int n = poll(all, nfds+1, -1);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            log_errno("shutdown_poll(): poll()");
+            return -1;
+        }
+        if(all[nfds].revents) return 0;
+        for(int i = 0; i < nfds; i++)
+            fds[i].revents = all[i].revents;
+        return 1;
+    }
+}
+
+int shutdown_hook(void (*fn)(void *arg), void *arg) {
+    int i;
+    pthread_mutex_lock(&sd.mutex);
+    for(i = 0; i < sd.nhooks && sd.hooks[i].fn != NULL; i++);
+    if(i == sd.nhooks) {
+        int n = sd.nhooks ? 2 * sd.nhooks : SHUTDOWN_MIN_HOOKS;
+        struct shutdown_hook *hooks = realloc(sd.hooks, n * sizeof(*hooks));
+        if(hooks == NULL) {
+            pthread_mutex_unlock(&sd.mutex);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(hooks + sd.nhooks, 0, (n - sd.nhooks) * sizeof(*hooks));
+        sd.hooks = hooks;
+        sd.nhooks = n;
+    }
+    sd.hooks[i].fn = fn;
+    sd.hooks[i].arg = arg;
+    pthread_mutex_unlock(&sd.mutex);
+    return 0;
+}
+
+void shutdown_unhook(void (*fn)(void *arg), void *arg) {
+    pthread_mutex_lock(&sd.mutex);
+    for(int i = 0; i < sd.nhooks; i++) {
+        if(sd.hooks[i].fn == fn && sd.hooks[i].arg == arg) {
+            sd.hooks[i].fn = NULL;
+            sd.hooks[i].arg = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sd.mutex);
+}
+
+/* Waits for SIGINT or SIGTERM and turns the first one into a shutdown
+ * request. Also returns when the shutdown comes from somewhere else.
+ */
+static void *shutdown_thread(void *thread_param) {
+    struct signalfd_siginfo si;
+    while(shutdown_wait(sd.sigfd) == 1) {
+        ssize_t rc = read(sd.sigfd, &si, sizeof(si));
+        if(rc == sizeof(si)) {
+            shutdown_request(si.ssi_signo);
+            break;
+        }
+        if(rc == -1 && errno != EAGAIN && errno != EINTR) {
+            log_errno("shutdown_thread(): signalfd read()");
+            break;
+        }
+    }
+    return thread_param;
+}
@@ -0,0 +1,63 @@
+#ifndef SHUTDOWN_H
+#define SHUTDOWN_H
+
+#include <stdbool.h>
+#include <poll.h>
+
+/* Blocks SIGINT and SIGTERM in the calling thread (and so in every thread it
+ * creates afterwards) and starts the thread that turns them into a shutdown
+ * request. Call it before any other thread is started.
+ * @returns 0 on success, -1 on error.
+ */
+int shutdown_init(void);
+
+/* Joins the signal thread and closes the descriptors. */
+void shutdown_destroy(void);
+
+/* Stops the server: clears flag_accepting_connections, wakes every thread
+ * blocked in shutdown_wait() or on the shutdown descriptor, and runs the
+ * hooks. Safe to call more than once and from any thread.
+ * @param signo is the signal that caused it, or 0.
+ */
+void shutdown_request(int signo);
+
+/* Starts draining the server: the accept loops stop and the modes return
+ * once their open connections are closed, without a shutdown. Runs the hooks
+ * too. Safe to call more than once and from any thread.
+ */
+void shutdown_drain(void);
+
+bool shutdown_draining(void);
+
+/* @returns the eventfd that becomes readable, and stays readable, once a
+ * drain is requested. The accept loops watch it.
+ */
+int shutdown_drain_fd(void);
+
+/* @returns the eventfd that becomes readable, and stays readable, once a
+ * shutdown is requested. Event loops add it to their epoll set.
+ */
+int shutdown_fd(void);
+
+/* Waits without a timeout until fd has something to read or the server shuts
+ * down.
+ * @returns 1 when fd is readable (or has an error to report), 0 on shutdown,
+ * -1 on error.
+ */
+int shutdown_wait(int fd);
+
+/* Like shutdown_wait() for up to 4 descriptors: polls fds without a timeout
+ * until one of them has an event or the server shuts down.
+ * @returns 1 with the revents of fds set, 0 on shutdown, -1 on error.
+ */
+int shutdown_poll(struct pollfd *fds, int nfds);
+
+/* Registers fn(arg) to run from shutdown_request() and shutdown_drain(), for
+ * threads that sleep on something other than a descriptor (a condition
+ * variable, for example). The table grows as needed.
+ * @returns 0 on success, -1 with errno set if it can't grow.
+ */
+int shutdown_hook(void (*fn)(void *arg), void *arg);
+void shutdown_unhook(void (*fn)(void *arg), void *arg);
+
+#endif /* SHUTDOWN_H */
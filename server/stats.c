@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+#include "stats.h"
+#include "shutdown.h"
+#include "alog.h"
+
+#define STATS_BUCKETS       24          // 1 us to 2^23 us (8.4 s), then +Inf
+
+/* Comments:
+ *  The counters and histograms are plain atomics updated with relaxed
+ *  ordering where the work happens, so recording costs an uncontended
+ *  atomic add and nothing is ever locked for it. A histogram has one
+ *  counter per power-of-two bucket, starting at 1 us.
+ *
+ *  The values are only formatted when someone asks: a thread accepts on a
+ *  Unix socket (-s path) and writes them to every connection in the
+ *  Prometheus text exposition format, for example with
+ *      socat - UNIX-CONNECT:/var/tmp/aesdsocket.stats
+ *  A scraper that needs HTTP can put any proxy in front of it; the socket
+ *  stays local and needs no parser in the server.
+ */
+
+struct stats_hist {
+    _Atomic uint64_t buckets[STATS_BUCKETS + 1];
+    _Atomic uint64_t sum_ns;
+};
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} stats_counter_info[STATS_NCOUNTERS] = {
+    [STATS_ACCEPTED] = { "aesdsocket_connections_accepted_total", "counter",
+                         "Client connections accepted." },
+    [STATS_ACTIVE]   = { "aesdsocket_connections_active", "gauge",
+                         "Client connections open." },
+    [STATS_BYTES_IN] = { "aesdsocket_received_bytes_total", "counter",
+                         "Bytes received from clients." },
+    [STATS_BYTES_OUT]= { "aesdsocket_sent_bytes_total", "counter",
+                         "Bytes sent to clients." },
+    [STATS_PACKETS]  = { "aesdsocket_packets_appended_total", "counter",
+                         "Packets appended to the data file." },
+    [STATS_DROPPED]  = { "aesdsocket_clients_dropped_total", "counter",
+                         "Clients dropped for falling behind the data file." },
+    [STATS_CACHE_LOADS] = { "aesdsocket_cache_loads_total", "counter",
+                            "Replay cache images read from the data file (-c)." }
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} stats_hist_info[STATS_NHISTOGRAMS] = {
+    [STATS_REPLAY]     = { "aesdsocket_replay_seconds",
+                           "Time to send a replay of the data file." },
+    [STATS_MUTEX_WAIT] = { "aesdsocket_dfdmutex_wait_seconds",
+                           "Time waiting for the data file mutex." },
+    [STATS_TIMESTAMP]  = { "aesdsocket_timestamp_write_seconds",
+                           "Time to append a timestamp line." },
+    [STATS_SYNC]       = { "aesdsocket_sync_seconds",
+                           "Time to flush the data file to the disk." }
+};
+
+static struct {
+    _Atomic int64_t counters[STATS_NCOUNTERS];
+    struct stats_hist hists[STATS_NHISTOGRAMS];
+    bool running;
+    int lfd;                        // Listening Unix socket
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pthread_t thread;
+} stats = {
+    .running = false,
+    .lfd = -1
+};
+
+static void *stats_thread(void *thread_param);
+static int stats_format(FILE *f);
+static size_t stats_bucket(uint64_t ns);
+
+void stats_add(enum stats_counter c, int64_t n) {
+    atomic_fetch_add_explicit(&stats.counters[c], n, memory_order_relaxed);
+}
+
+void stats_observe(enum stats_histogram h, uint64_t ns) {
+    struct stats_hist *hist = &stats.hists[h];
+    atomic_fetch_add_explicit(&hist->buckets[stats_bucket(ns)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_lock(pthread_mutex_t *m) {
+    if(pthread_mutex_trylock(m) == 0) {
+        stats_observe(STATS_MUTEX_WAIT, 0);
+        return;
+    }
+    uint64_t t = stats_now();
+    pthread_mutex_lock(m);
+    stats_observe(STATS_MUTEX_WAIT, stats_now() - t);
+}
+
+int stats_start(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(stats.path, path);
+
+    stats.lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if(stats.lfd == -1) return -1;
+    unlink(path);       // left over by a server that didn't stop cleanly
+    if(bind(stats.lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+       listen(stats.lfd, 16) == -1)
+        goto errorcleanup;
+    int r = pthread_create(&stats.thread, NULL, stats_thread, NULL);
+    if(r) {
+        errno = r;
+        unlink(path);
+        goto errorcleanup;
+    }
+    stats.running = true;
+    alog(LOG_DEBUG, "serving metrics on %s", path);
+    return 0;
+
+    errorcleanup:;
+    int errnoshadow = errno;
+    robustclose(stats.lfd);
+    stats.lfd = -1;
+    errno = errnoshadow;
+    return -1;
+}
+
+void stats_stop(void) {
+    if(!stats.running) return;
+    shutdown_request(0);
+    pthread_join(stats.thread, NULL);
+    stats.running = false;
+    robustclose(stats.lfd);
+    stats.lfd = -1;
+    unlink(stats.path);
+}
+
+static void *stats_thread(void *thread_param) {
+    for(;;) {
+        int w = shutdown_wait(stats.lfd);
+        if(w != 1) {
+            if(w == -1) log_errno("stats_thread(): shutdown_wait()");
+            break;
+        }
+        int cfd = accept4(stats.lfd, NULL, NULL, SOCK_CLOEXEC);
+        if(cfd == -1) {
+            if(errno != EINTR && errno != ECONNABORTED)
+                log_errno("stats_thread(): accept4()");
+            continue;
+        }
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        if(f == NULL || stats_format(f) || fclose(f) == EOF) {
+            log_errno("stats_thread(): formatting");
+        }
+        else {
+            size_t off = 0;
+            while(off < len) {
+                ssize_t wc = send(cfd, text + off, len - off, MSG_NOSIGNAL);
+                if(wc == -1) {
+                    if(errno == EINTR) continue;
+                    break;      // the client went away, nothing to do
+                }
+                off += wc;
+            }
+        }
+        free(text);
+        robustclose(cfd);
+    }
+    return thread_param;
+}
+
+/* Writes every metric to f in the Prometheus text format.
+ * @returns 0 on success, -1 on error.
+ */
+static int stats_format(FILE *f) {
+    for(int i = 0; i < STATS_NCOUNTERS; i++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %" PRId64 "\n",
+                stats_counter_info[i].name, stats_counter_info[i].help,
+                stats_counter_info[i].name, stats_counter_info[i].type,
+                stats_counter_info[i].name,
+                atomic_load_explicit(&stats.counters[i],
+                                     memory_order_relaxed));
+    }
+    off_t start = datastart(), end = datasize();
+    if(start != -1 && end != -1 && end >= start)
+        fprintf(f, "# HELP aesdsocket_data_bytes Bytes kept by the backend.\n"
+                   "# TYPE aesdsocket_data_bytes gauge\n"
+                   "aesdsocket_data_bytes %jd\n", (intmax_t)(end - start));
+    for(int i = 0; i < STATS_NHISTOGRAMS; i++) {
+        const char *name = stats_hist_info[i].name;
+        struct stats_hist *hist = &stats.hists[i];
+        uint64_t cumulative = 0;
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n",
+                name, stats_hist_info[i].help, name);
+        for(int b = 0; b < STATS_BUCKETS; b++) {
+            cumulative += atomic_load_explicit(&hist->buckets[b],
+                                               memory_order_relaxed);
+            // Exact: a bound is a whole number of microseconds
+            uint64_t us = 1ULL << b;
+            fprintf(f, "%s_bucket{le=\"%" PRIu64 ".%06" PRIu64 "\"} %" PRIu64
+                    "\n", name, us / 1000000, us % 1000000, cumulative);
+        }
+        cumulative += atomic_load_explicit(&hist->buckets[STATS_BUCKETS],
+                                           memory_order_relaxed);
+        // The buckets are read one at a time, so +Inf is their sum rather
+        // than count, to keep the series consistent.
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+                   "%s_sum %.9f\n%s_count %" PRIu64 "\n",
+                name, cumulative,
+                name, atomic_load_explicit(&hist->sum_ns,
+                                           memory_order_relaxed) / 1e9,
+                name, cumulative);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+/* @returns the index of the first bucket whose bound is at least ns. */
+static size_t stats_bucket(uint64_t ns) {
+    uint64_t us = (ns + 999) / 1000;
+    if(us <= 1) return 0;
+    size_t b = 64 - __builtin_clzll(us - 1);
+    return (b < STATS_BUCKETS) ? b : STATS_BUCKETS;
+}
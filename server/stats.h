@@ -0,0 +1,48 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+enum stats_counter {
+    STATS_ACCEPTED,                 // Connections accepted
+    STATS_ACTIVE,                   // Connections open (a gauge)
+    STATS_BYTES_IN,                 // Bytes received from clients
+    STATS_BYTES_OUT,                // Bytes sent to clients
+    STATS_PACKETS,                  // Packets appended to the data file
+    STATS_DROPPED,                  // Clients dropped for falling behind
+    STATS_CACHE_LOADS,              // Replay cache images read from the data
+    STATS_NCOUNTERS
+};
+
+enum stats_histogram {
+    STATS_REPLAY,                   // From the start to the end of a replay
+    STATS_MUTEX_WAIT,               // Waiting for the data file mutex
+    STATS_TIMESTAMP,                // Writing a timestamp line
+    STATS_SYNC,                     // Flushing the data file (-f)
+    STATS_NHISTOGRAMS
+};
+
+/* Adds n to a counter. Cheap enough for every send and receive. */
+void stats_add(enum stats_counter c, int64_t n);
+
+/* Records one duration in a histogram. */
+void stats_observe(enum stats_histogram h, uint64_t ns);
+
+/* @returns a CLOCK_MONOTONIC timestamp in nanoseconds, for stats_observe(). */
+uint64_t stats_now(void);
+
+/* Locks the data file mutex, recording how long it took. */
+void stats_lock(pthread_mutex_t *m);
+
+/* Starts the thread serving the metrics on a Unix socket at path: every
+ * connection gets the current values in the Prometheus text format and is
+ * closed.
+ * @returns 0 on success, -1 on error.
+ */
+int stats_start(const char *path);
+
+/* Stops the thread and removes the socket, if stats_start() was called. */
+void stats_stop(void);
+
+#endif /* STATS_H */
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "tail.h"
+#include "outq.h"
+#include "stats.h"
+#include "alog.h"
+
+#define TAIL_RING_LEN       (4 << 20)   // recent appends kept for subscribers
+#define TAIL_BUF_LEN        (16 * 1024) // bytes taken from the ring at a time
+
+/* Comments:
+ *  A subscriber gets the data file once, as an ordinary replay, and from
+ *  then on only what is appended after it. Every append (packets and
+ *  timestamps) is copied into a ring next to the replay cache, and each
+ *  subscriber sends from the ring at its own pace.
+ *
+ *  Only subscribers that have caught up get notified, once, so an append
+ *  costs one eventfd write (or one notify()) per idle subscriber and nothing
+ *  for the ones still sending. With no subscribers only the offset moves.
+ *
+ *  A subscriber that falls more than TAIL_RING_LEN bytes behind has lost
+ *  data it can't get back; tail_peek() fails and the connection is closed.
+ */
+
+static struct {
+    pthread_mutex_t mutex;          // Protects everything below
+    char *ring;
+    uint64_t head;                  // Bytes appended so far
+    LIST_HEAD(tail_head, tail_sub) subs;
+} tail = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .ring = NULL,
+    .head = 0
+};
+
+int tail_init(uint64_t head) {
+    tail.ring = malloc(TAIL_RING_LEN);
+    if(tail.ring == NULL) return -1;
+    tail.head = head;
+    LIST_INIT(&tail.subs);
+    return 0;
+}
+
+void tail_destroy(void) {
+    pthread_mutex_lock(&tail.mutex);
+    free(tail.ring);
+    tail.ring = NULL;
+    pthread_mutex_unlock(&tail.mutex);
+}
+
+void tail_append(const void *buf, size_t len) {
+    struct tail_sub *s;
+    uint64_t end;
+    pthread_mutex_lock(&tail.mutex);
+    if(tail.ring == NULL || LIST_EMPTY(&tail.subs)) {
+        tail.head += len;
+        end = tail.head;
+        pthread_mutex_unlock(&tail.mutex);
+        outq_check(end);
+        return;
+    }
+    if(len > TAIL_RING_LEN) {
+        // Only the end fits; anyone who needs the rest gets dropped
+        buf = (const char *)buf + (len - TAIL_RING_LEN);
+        tail.head += len - TAIL_RING_LEN;
+        len = TAIL_RING_LEN;
+    }
+    size_t off = tail.head % TAIL_RING_LEN;
+    size_t n = TAIL_RING_LEN - off;
+    if(n > len) n = len;
+    memcpy(tail.ring + off, buf, n);
+    memcpy(tail.ring, (const char *)buf + n, len - n);
+    tail.head += len;
+
+    LIST_FOREACH(s, &tail.subs, nodes) {
+        if(!s->waiting) continue;
+        s->waiting = false;
+        if(s->notify) {
+            s->notify(s);
+        }
+        else if(eventfd_write(s->efd, 1) == -1) {
+            log_errno("tail_append(): eventfd write()");
+        }
+    }
+    end = tail.head;
+    pthread_mutex_unlock(&tail.mutex);
+    outq_check(end);
+}
+
+int64_t tail_subscribe(struct tail_sub *s, void (*notify)(struct tail_sub *s),
+                       void *arg) {
+    memset(s, 0, sizeof(struct tail_sub));
+    s->notify = notify;
+    s->arg = arg;
+    s->efd = -1;
+    s->buf = malloc(TAIL_BUF_LEN);
+    if(s->buf == NULL) return -1;
+    if(notify == NULL) {
+        s->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if(s->efd == -1) {
+            free(s->buf);
+            s->buf = NULL;
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&tail.mutex);
+    s->pos = tail.head;
+    LIST_INSERT_HEAD(&tail.subs, s, nodes);
+    pthread_mutex_unlock(&tail.mutex);
+    alog(LOG_DEBUG, "subscribed at offset %" PRIu64, s->pos);
+    return s->pos;
+}
+
+void tail_unsubscribe(struct tail_sub *s) {
+    pthread_mutex_lock(&tail.mutex);
+    LIST_REMOVE(s, nodes);
+    pthread_mutex_unlock(&tail.mutex);
+    if(s->efd != -1) robustclose(s->efd);
+    s->efd = -1;
+    free(s->buf);
+    s->buf = NULL;
+}
+
+int tail_continue(struct tail_sub *s, int rsfd) {
+    const char *data;
+    size_t len;
+    int r;
+    while((r = tail_peek(s, &data, &len)) == 1) {
+        ssize_t wc = send(rsfd, data, len, MSG_NOSIGNAL);
+        if(wc == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_errno("tail_continue(): socket send()");
+            return -1;
+        }
+        tail_advance(s, wc);
+        stats_add(STATS_BYTES_OUT, wc);
+    }
+    return (r == 0) ? 1 : -1;
+}
+
+int tail_peek(struct tail_sub *s, const char **data, size_t *len) {
+    if(s->pending_len == 0) {
+        pthread_mutex_lock(&tail.mutex);
+        uint64_t behind = tail.head - s->pos;
+        if(behind > TAIL_RING_LEN) {
+            pthread_mutex_unlock(&tail.mutex);
+            alog(LOG_ERR, "subscriber fell %" PRIu64 " bytes behind, "
+                   "dropping it", behind);
+            stats_add(STATS_DROPPED, 1);
+            errno = ENOBUFS;
+            return -1;
+        }
+        if(behind == 0) {
+            // Drop a notification we no longer need before asking for one
+            eventfd_t count;
+            if(s->efd != -1) eventfd_read(s->efd, &count);
+            s->waiting = true;
+            pthread_mutex_unlock(&tail.mutex);
+            return 0;
+        }
+        size_t n = (behind < TAIL_BUF_LEN) ? behind : TAIL_BUF_LEN;
+        size_t off = s->pos % TAIL_RING_LEN;
+        size_t first = TAIL_RING_LEN - off;
+        if(first > n) first = n;
+        memcpy(s->buf, tail.ring + off, first);
+        memcpy(s->buf + first, tail.ring, n - first);
+        s->pos += n;
+        pthread_mutex_unlock(&tail.mutex);
+        s->pending_off = 0;
+        s->pending_len = n;
+    }
+    *data = s->buf + s->pending_off;
+    *len = s->pending_len;
+    return 1;
+}
+
+uint64_t tail_position(struct tail_sub *s) {
+    return s->pos - s->pending_len;
+}
+
+void tail_advance(struct tail_sub *s, size_t n) {
+    s->pending_off += n;
+    s->pending_len -= n;
+}
@@ -0,0 +1,70 @@
+#ifndef TAIL_H
+#define TAIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* A connection subscribed to the data appended to the data file. Offsets
+ * count the bytes appended since the server started, which with the file
+ * backend are also offsets into the data file.
+ */
+struct tail_sub {
+    uint64_t pos;                   // Next stream offset to send
+    bool waiting;                   // Caught up, wants a notification
+    int efd;                        // eventfd notified, or -1 with notify
+    void (*notify)(struct tail_sub *s);
+    void *arg;                      // For notify()
+    char *buf;                      // Bytes taken from the ring, not sent yet
+    size_t pending_off;
+    size_t pending_len;
+    LIST_ENTRY(tail_sub) nodes;
+};
+
+/* Allocates the ring of recent appends.
+ * @param head is the stream offset of the next append: 0, or the end of the
+ * data taken over from another server (see handoff.c).
+ * @returns 0 on success, -1 on error.
+ */
+int tail_init(uint64_t head);
+void tail_destroy(void);
+
+/* Records len bytes appended to the data file and wakes the subscribers
+ * waiting for them. Called where cache_append() is, with the same locking.
+ */
+void tail_append(const void *buf, size_t len);
+
+/* Subscribes s to everything appended from now on. Once s has caught up,
+ * the next append calls notify(s) from the appending thread (with the tail
+ * lock held, so it must only queue s somewhere and wake its owner), or makes
+ * s->efd readable when notify is NULL.
+ * @returns the stream offset s starts at, which is the length of the data
+ * file it follows, or -1 on error.
+ */
+int64_t tail_subscribe(struct tail_sub *s, void (*notify)(struct tail_sub *s),
+                       void *arg);
+
+/* Stops the notifications. notify() isn't running anymore when it returns. */
+void tail_unsubscribe(struct tail_sub *s);
+
+/* Sends what was appended since s->pos to rsfd until s has caught up or rsfd
+ * would block.
+ * @returns 1 when caught up, 0 when rsfd would block, -1 on error (also
+ * when s fell further behind than the ring holds).
+ */
+int tail_continue(struct tail_sub *s, int rsfd);
+
+/* For engines that send on the socket themselves (see uring.c).
+ * @returns 1 with the next bytes to send in *data and *len, 0 when caught
+ * up, -1 on error.
+ */
+int tail_peek(struct tail_sub *s, const char **data, size_t *len);
+
+/* Marks n of the bytes returned by tail_peek() as sent. */
+void tail_advance(struct tail_sub *s, size_t n);
+
+/* @returns the stream offset of the next byte s will send. */
+uint64_t tail_position(struct tail_sub *s);
+
+#endif /* TAIL_H */
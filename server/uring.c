@@ -0,0 +1,902 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+#include "uring.h"
+#include "replay.h"
+#include "packet.h"
+#include "proto.h"
+#include "cache.h"
+#include "writer.h"
+#include "tail.h"
+#include "outq.h"
+#include "stats.h"
+#include "shutdown.h"
+#include "backend.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "alog.h"
+
+#define URING_SQ_ENTRIES    256
+#define URING_CQ_ENTRIES    4096
+#define URING_REPLAY_LEN    (16 * 1024) // bounce buffer per connection
+#define URING_FEATURES      (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | \
+                             IORING_FEAT_FAST_POLL)
+
+/* Comments:
+ *  Each loop thread owns an io_uring, driven with the raw syscalls (no
+ *  liburing). The loop queues every socket operation it needs as a submission
+ *  and then makes one io_uring_enter() that both submits them and waits for
+ *  completions, so a round costs one syscall however many clients were
+ *  served in it:
+ *   - one accept on the listening socket is always queued per loop;
+ *   - a connection has at most one operation queued at a time: a recv while
+ *     it is receiving, a send while it is replaying, none while appending;
+ *   - the packets completed during a round are appended together at the end
+ *     of it with one writev() under the data file mutex (writer_flush()), or
+ *     handed to the writer thread with -g, which wakes the ring through an
+ *     eventfd read;
+ *   - replays are sent from the cached image or from a bounce buffer filled
+ *     with pread(), since sendfile() has no io_uring equivalent.
+ *  A poll on the shutdown eventfd ends the round when the server stops. A
+ *  poll on the drain eventfd (tagged with the loop pointer, see handoff.c)
+ *  cancels the accept, and the loop returns once its last connection is
+ *  closed.
+ *
+ *  A subscribed connection (AESDSOCKET_SUBSCRIBE) can have a send of new
+ *  appends queued next to its recv. The appending thread queues it on the
+ *  loop's tail_ready list and wakes the ring through the same eventfd.
+ *
+ *  A send that completes short found the socket full, so the connection is
+ *  listed as stalled until it has sent everything it owes (see outq.c). If
+ *  it gets dropped, the shutdown fails the send in flight and it is closed.
+ *
+ *  The user_data of a submission is the connection pointer with the
+ *  operation in its low bits.
+ */
+
+enum uring_op {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_WAKE,
+    URING_OP_SHUTDOWN,
+    URING_OP_CANCEL,
+    URING_OP_TAIL                   // Send of new appends to a subscriber
+};
+#define URING_OP_MASK       7ULL
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;              // Next free sqe, published by submit
+    unsigned to_submit;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;                     // SQ and CQ rings (single mmap)
+    size_t ring_sz;
+    size_t sqes_sz;
+};
+
+enum uring_state {
+    CONN_RECEIVING,
+    CONN_APPENDING,                 // In the round's batch or on the writer
+    CONN_REPLAYING
+};
+
+struct uring_loop;
+
+struct uring_conn {
+    int rsfd;                       // Socket file descriptor
+    enum uring_state state;
+    bool busy;                      // An operation is queued in the ring
+    bool closing;                   // Close once nothing is in flight
+    size_t pktlen;                  // Packet being appended or replayed
+    struct proto_cmd cmd;           // The request it holds
+    struct uring_loop *loop;
+    struct writer_req req;          // Append of the packet
+    struct uring_conn *next;        // Link in the batch or the done list
+    struct packet_buf in;           // Received bytes, framed into packets
+    struct replay_t replay;         // Replay state, borrows buf
+    struct tail_sub tail;           // New appends, once subscribed
+    bool subscribed;
+    bool tail_busy;                 // A send of new appends is queued
+    bool tail_ready;                // In loop->tail_ready
+    LIST_ENTRY(uring_conn) tail_nodes;
+    size_t sendlen;                 // Length of the replay send in flight
+    size_t tail_sendlen;            // Length of the tail send in flight
+    struct outq_ent out;            // Listed while rsfd is full
+    LIST_ENTRY(uring_conn) nodes;
+    char buf[URING_REPLAY_LEN+1];   // Replay bounce buffer
+};
+
+struct uring_loop {
+    struct uring ring;
+    int sfd;                        // Listening socket file descriptor
+    int dfd;                        // Data file descriptor
+    int wakefd;                     // eventfd signalled by the writer thread
+    uint64_t wakebuf;               // Target of the eventfd read
+    pthread_mutex_t *dfdmutex;      // Mutex for data file descriptor
+    pthread_mutex_t done_mutex;     // Protects done_head and tail_ready
+    struct uring_conn *done_head;   // Appends finished by the writer
+    LIST_HEAD(tail_ready_head, uring_conn) tail_ready;  // Subscribers to feed
+    struct uring_conn *batch_head;  // Packets to append this round
+    struct uring_conn **batch_tail;
+    int queued;                     // Operations in the ring
+    int inflight;                   // Appends queued on the writer
+    bool draining;                  // Not accepting, ends with the last conn
+    bool stopping;
+    pthread_t thread;               // Thread ID
+    int ret;                        // Return value
+    LIST_HEAD(uring_conn_head, uring_conn) conns;
+};
+
+static int ring_setup(struct uring *u, unsigned entries);
+static void ring_free(struct uring *u);
+static struct io_uring_sqe *ring_sqe(struct uring *u);
+static int ring_enter(struct uring *u, unsigned wait_nr);
+
+static void *uring_loopthread(void *thread_param);
+static int uring_loop(struct uring_loop *loop);
+static int uring_reap(struct uring_loop *loop);
+static void uring_dispatch(struct uring_loop *loop, struct io_uring_cqe *cqe);
+static void uring_accepted(struct uring_loop *loop, int res);
+static int uring_received(struct uring_loop *loop, struct uring_conn *c,
+                          int res);
+static int uring_sent(struct uring_loop *loop, struct uring_conn *c, int res);
+static int uring_process(struct uring_loop *loop, struct uring_conn *c);
+static int uring_replay(struct uring_loop *loop, struct uring_conn *c);
+static int uring_tail(struct uring_loop *loop, struct uring_conn *c);
+static int uring_tailsent(struct uring_loop *loop, struct uring_conn *c,
+                          int res);
+static void uring_tailready(struct tail_sub *s);
+static void uring_flush(struct uring_loop *loop);
+static void uring_appended(struct writer_req *req);
+static void uring_written(struct writer_req *req);
+static void uring_completions(struct uring_loop *loop);
+static void uring_afterappend(struct uring_loop *loop, struct uring_conn *c);
+static int uring_queue(struct uring_loop *loop, uint8_t opcode, int fd,
+                       void *addr, unsigned len, void *ptr, enum uring_op op);
+static int uring_recv(struct uring_loop *loop, struct uring_conn *c);
+static void uring_drop(struct uring_loop *loop, struct uring_conn *c);
+static void uring_close(struct uring_loop *loop, struct uring_conn *c);
+static void uring_cancelall(struct uring_loop *loop);
+
+bool uring_supported(void) {
+    struct uring u;
+    if(ring_setup(&u, 4)) return false;
+    ring_free(&u);
+    return true;
+}
+
+int uring_run(int sfd, pthread_mutex_t *dfdmutex, int nloops) {
+    int r = -1;
+    int started = 0;
+    struct uring_loop *loops = calloc(nloops, sizeof(struct uring_loop));
+    if(loops == NULL) {
+        log_errno("uring_run(): calloc()");
+        return -1;
+    }
+
+    for(started = 0; started < nloops; started++) {
+        struct uring_loop *loop = &loops[started];
+        loop->sfd = sfd;
+        loop->dfdmutex = dfdmutex;
+        loop->batch_tail = &loop->batch_head;
+        LIST_INIT(&loop->conns);
+        LIST_INIT(&loop->tail_ready);
+
+        if(ring_setup(&loop->ring, URING_SQ_ENTRIES)) {
+            log_errno("uring_run(): ring_setup()");
+            goto errorcleanup;
+        }
+        loop->wakefd = eventfd(0, EFD_CLOEXEC);
+        if(loop->wakefd == -1) {
+            log_errno("uring_run(): eventfd()");
+            ring_free(&loop->ring);
+            goto errorcleanup;
+        }
+        loop->dfd = opendatafile();
+        if(loop->dfd == -1) {
+            log_errno("uring_run(): opendatafile()");
+            robustclose(loop->wakefd);
+            ring_free(&loop->ring);
+            goto errorcleanup;
+        }
+        pthread_mutex_init(&loop->done_mutex, NULL);
+        r = pthread_create(&loop->thread, NULL, uring_loopthread, loop);
+        if(r) {
+            errno = r;
+            log_errno("uring_run(): pthread_create()");
+            pthread_mutex_destroy(&loop->done_mutex);
+            robustclose(loop->dfd);
+            robustclose(loop->wakefd);
+            ring_free(&loop->ring);
+            goto errorcleanup;
+        }
+        alog(LOG_DEBUG, "started io_uring loop %i", started);
+    }
+    r = 0;
+
+    errorcleanup:
+    if(r) {
+        shutdown_request(0);
+        r = -1;
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        if(loops[i].ret) r = -1;
+        pthread_mutex_destroy(&loops[i].done_mutex);
+        robustclose(loops[i].dfd);
+        robustclose(loops[i].wakefd);
+        ring_free(&loops[i].ring);
+    }
+    free(loops);
+    return r;
+}
+
+static void *uring_loopthread(void *thread_param) {
+    struct uring_loop *loop = (struct uring_loop *)thread_param;
+    loop->ret = uring_loop(loop);
+    return thread_param;
+}
+
+static int uring_loop(struct uring_loop *loop) {
+    int r = -1;
+
+    if(uring_queue(loop, IORING_OP_ACCEPT, loop->sfd, NULL, 0,
+                   NULL, URING_OP_ACCEPT) ||
+       uring_queue(loop, IORING_OP_POLL_ADD, shutdown_fd(), NULL, 0,
+                   NULL, URING_OP_SHUTDOWN) ||
+       uring_queue(loop, IORING_OP_POLL_ADD, shutdown_drain_fd(), NULL, 0,
+                   loop, URING_OP_SHUTDOWN) ||
+       uring_queue(loop, IORING_OP_READ, loop->wakefd, &loop->wakebuf,
+                   sizeof(loop->wakebuf), NULL, URING_OP_WAKE)) {
+        log_errno("uring_loop(): uring_queue()");
+        goto errorcleanup;
+    }
+
+    while(flag_accepting_connections &&
+          !(loop->draining && LIST_EMPTY(&loop->conns) &&
+            loop->batch_head == NULL && loop->inflight == 0)) {
+        if(uring_reap(loop)) goto errorcleanup;
+        uring_flush(loop);
+    }
+
+    r = 0;
+    errorcleanup:
+    // Let the writer finish what it has (its completions still come through
+    // the ring), then take back every operation still in the ring before the
+    // buffers they point to are freed.
+    loop->stopping = true;
+    uring_flush(loop);
+    while(loop->inflight > 0) {
+        if(uring_reap(loop)) break;
+    }
+    uring_cancelall(loop);
+    while(loop->queued > 0) {
+        if(uring_reap(loop)) break;
+    }
+    while(!LIST_EMPTY(&loop->conns)) {
+        uring_close(loop, LIST_FIRST(&loop->conns));
+    }
+    return r;
+}
+
+/* Submits what is queued, waits for completions and handles them all.
+ * @returns 0 on success, -1 on error.
+ */
+static int uring_reap(struct uring_loop *loop) {
+    struct uring *u = &loop->ring;
+    if(ring_enter(u, 1) == -1) {
+        log_errno("uring_reap(): io_uring_enter()");
+        return -1;
+    }
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++)
+        uring_dispatch(loop, &u->cqes[head & *u->cq_mask]);
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void uring_dispatch(struct uring_loop *loop, struct io_uring_cqe *cqe) {
+    enum uring_op op = cqe->user_data & URING_OP_MASK;
+    struct uring_conn *c = (void *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+    int r;
+
+    loop->queued--;
+    switch(op) {
+        case URING_OP_ACCEPT:
+            uring_accepted(loop, cqe->res);
+            return;
+        case URING_OP_WAKE:
+            uring_completions(loop);
+            if((!loop->stopping || loop->inflight > 0) &&
+               uring_queue(loop, IORING_OP_READ, loop->wakefd, &loop->wakebuf,
+                           sizeof(loop->wakebuf), NULL, URING_OP_WAKE))
+                log_errno("uring_dispatch(): uring_queue()");
+            return;
+        case URING_OP_SHUTDOWN:
+            if(c != NULL && cqe->res >= 0 && !loop->draining) {
+                // The drain poll: leave the new connections to the next
+                // server. A connection accepted meanwhile is still served.
+                loop->draining = true;
+                uring_queue(loop, IORING_OP_ASYNC_CANCEL, -1,
+                            (void *)(uintptr_t)URING_OP_ACCEPT, 0, NULL,
+                            URING_OP_CANCEL);
+            }
+            return;                     // the while condition ends the loop
+        case URING_OP_CANCEL:
+            return;
+        case URING_OP_RECV:
+            c->busy = false;
+            r = uring_received(loop, c, cqe->res);
+            break;
+        case URING_OP_SEND:
+            c->busy = false;
+            r = uring_sent(loop, c, cqe->res);
+            break;
+        case URING_OP_TAIL:
+            c->tail_busy = false;
+            r = uring_tailsent(loop, c, cqe->res);
+            break;
+        default:
+            return;
+    }
+    if(r || c->closing || loop->stopping)
+        uring_drop(loop, c);
+}
+
+static void uring_accepted(struct uring_loop *loop, int res) {
+    if(!loop->stopping && !loop->draining &&
+       uring_queue(loop, IORING_OP_ACCEPT, loop->sfd, NULL, 0,
+                   NULL, URING_OP_ACCEPT))
+        log_errno("uring_accepted(): uring_queue()");
+    if(res < 0) {
+        if(res != -ECANCELED && res != -EINTR && res != -ECONNABORTED) {
+            errno = -res;
+            log_errno("uring_accepted(): accept");
+        }
+        return;
+    }
+
+    int rsfd = res;
+    alog(LOG_DEBUG,"Opened new rsfd descriptor # %i",rsfd);
+    if(loop->stopping) {
+        closesocket(rsfd);
+        return;
+    }
+    struct uring_conn *c = malloc(sizeof(struct uring_conn));
+    if(c == NULL) {
+        log_errno("uring_accepted(): malloc()");
+        closesocket(rsfd);
+        return;
+    }
+    memset(c, 0, offsetof(struct uring_conn, buf));
+    c->rsfd = rsfd;
+    c->loop = loop;
+    c->state = CONN_RECEIVING;
+    if(packet_init(&c->in)) {
+        log_errno("uring_accepted(): packet_init()");
+        closesocket(rsfd);
+        free(c);
+        return;
+    }
+    replay_init(&c->replay, c->buf, URING_REPLAY_LEN);
+    LIST_INSERT_HEAD(&loop->conns, c, nodes);
+    stats_add(STATS_ACCEPTED, 1);
+    stats_add(STATS_ACTIVE, 1);
+    if(uring_recv(loop, c))
+        uring_close(loop, c);
+}
+
+/* @returns 0 to keep the connection, -1 to close it. */
+static int uring_received(struct uring_loop *loop, struct uring_conn *c,
+                          int res) {
+    if(res < 0) {
+        if(res == -EINTR || res == -EAGAIN)
+            return uring_recv(loop, c);
+        if(res != -ECANCELED) {
+            errno = -res;
+            log_errno("uring_received(): recv");
+        }
+        return -1;
+    }
+    if(res == 0) {
+        alog(LOG_DEBUG,"uring_received received FIN from client");
+        if(packet_pending(&c->in))
+            alog(LOG_DEBUG,"dropping %zu bytes without a newline",
+                   packet_pending(&c->in));
+        return -1;
+    }
+    packet_commit(&c->in, res);
+    stats_add(STATS_BYTES_IN, res);
+    return uring_process(loop, c);
+}
+
+/* @returns 0 to keep the connection, -1 to close it. */
+static int uring_sent(struct uring_loop *loop, struct uring_conn *c, int res) {
+    if(res < 0) {
+        if(res == -EINTR || res == -EAGAIN)
+            return uring_replay(loop, c);
+        if(res != -ECANCELED) {
+            errno = -res;
+            log_errno("uring_sent(): send");
+        }
+        return -1;
+    }
+    replay_advance(&c->replay, res);
+    stats_add(STATS_BYTES_OUT, res);
+    if((size_t)res < c->sendlen) {
+        off_t pos = replay_position(&c->replay);
+        outq_stall(&c->out, c->rsfd, (pos == -1) ? OUTQ_NOPOS : pos);
+    }
+    return uring_replay(loop, c);
+}
+
+/* Takes the next buffered request: sends the seek command to the driver and
+ * replays, or adds the append to the round's batch of appends. Queues a recv
+ * when no complete packet is left.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int uring_process(struct uring_loop *loop, struct uring_conn *c) {
+    c->pktlen = packet_next(&c->in);
+    if(c->pktlen == 0) {
+        c->state = CONN_RECEIVING;
+        if(c->subscribed && uring_tail(loop, c))
+            return -1;
+        return uring_recv(loop, c);
+    }
+    if(proto_parse(packet_data(&c->in), c->pktlen, packet_binary(&c->in),
+                   &c->cmd))
+        return -1;
+    if(c->subscribed && proto_subscribed(&c->cmd))
+        return -1;
+    if(c->cmd.op == PROTO_SUBSCRIBE) {
+        if(c->subscribed) {
+            packet_consume(&c->in, c->pktlen);
+            return uring_process(loop, c);
+        }
+        int64_t start = tail_subscribe(&c->tail, uring_tailready, c);
+        if(start == -1) {
+            log_errno("uring_process(): tail_subscribe()");
+            return -1;
+        }
+        c->subscribed = true;
+        c->state = CONN_REPLAYING;
+        replay_rewind(&c->replay);
+        if(backend->follows_appends)
+            replay_limit(&c->replay, start);
+        return uring_replay(loop, c);
+    }
+    if(c->cmd.op != PROTO_APPEND) {
+        if(c->cmd.op == PROTO_SEEK) {
+            backend->seek(loop->dfd, &c->cmd.seekto);
+            cache_invalidate();
+        }
+        c->state = CONN_REPLAYING;
+        proto_rewind(&c->replay, &c->cmd, loop->dfd);
+        return uring_replay(loop, c);
+    }
+    c->state = CONN_APPENDING;
+    stats_add(STATS_PACKETS, 1);
+    c->req.buf = c->cmd.data;
+    c->req.len = c->cmd.len;
+    c->req.arg = c;
+    c->next = NULL;
+    *loop->batch_tail = c;
+    loop->batch_tail = &c->next;
+    return 0;
+}
+
+/* Queues a send of the next part of the replay, or moves on to the next
+ * packet once the replay is done.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int uring_replay(struct uring_loop *loop, struct uring_conn *c) {
+    const char *data;
+    size_t len;
+    int r = replay_peek(&c->replay, loop->dfd, &data, &len);
+    if(r == -1)
+        return -1;
+    if(r == 0) {
+        alog(LOG_DEBUG,"uring_replay copied datafile to the socket");
+        outq_resume(&c->out);
+        packet_consume(&c->in, c->pktlen);
+        return uring_process(loop, c);
+    }
+    if(len > INT32_MAX) len = INT32_MAX;
+    if(uring_queue(loop, IORING_OP_SEND, c->rsfd, (void *)data, len,
+                   c, URING_OP_SEND))
+        return -1;
+    c->busy = true;
+    c->sendlen = len;
+    return 0;
+}
+
+/* Queues a send of what was appended since the last one to a subscribed
+ * connection, unless a send of it is already in flight. A connection that is
+ * replaying gets here when the replay is done.
+ * @returns 0 to keep the connection, -1 to close it.
+ */
+static int uring_tail(struct uring_loop *loop, struct uring_conn *c) {
+    const char *data;
+    size_t len;
+    if(c->tail_busy || c->closing || c->state == CONN_REPLAYING ||
+       loop->stopping)
+        return 0;
+    int r = tail_peek(&c->tail, &data, &len);
+    if(r == 0)
+        outq_resume(&c->out);
+    if(r <= 0)
+        return r;
+    if(uring_queue(loop, IORING_OP_SEND, c->rsfd, (void *)data, len,
+                   c, URING_OP_TAIL))
+        return -1;
+    c->tail_busy = true;
+    c->tail_sendlen = len;
+    return 0;
+}
+
+/* @returns 0 to keep the connection, -1 to close it. */
+static int uring_tailsent(struct uring_loop *loop, struct uring_conn *c,
+                          int res) {
+    if(res < 0) {
+        if(res == -EINTR || res == -EAGAIN)
+            return uring_tail(loop, c);
+        if(res != -ECANCELED) {
+            errno = -res;
+            log_errno("uring_tailsent(): send");
+        }
+        return -1;
+    }
+    tail_advance(&c->tail, res);
+    stats_add(STATS_BYTES_OUT, res);
+    if((size_t)res < c->tail_sendlen)
+        outq_stall(&c->out, c->rsfd, tail_position(&c->tail));
+    return uring_tail(loop, c);
+}
+
+/* Called by tail_append() on the appending thread when a subscriber that had
+ * caught up has something new. Hands it to its loop.
+ */
+static void uring_tailready(struct tail_sub *s) {
+    struct uring_conn *c = s->arg;
+    struct uring_loop *loop = c->loop;
+    bool wake = false;
+    pthread_mutex_lock(&loop->done_mutex);
+    if(!c->tail_ready) {
+        wake = LIST_EMPTY(&loop->tail_ready);
+        LIST_INSERT_HEAD(&loop->tail_ready, c, tail_nodes);
+        c->tail_ready = true;
+    }
+    pthread_mutex_unlock(&loop->done_mutex);
+    if(wake) {
+        uint64_t one = 1;
+        if(write(loop->wakefd, &one, sizeof(one)) == -1)
+            log_errno("uring_tailready(): eventfd write()");
+    }
+}
+
+/* Appends the packets completed during this round: with one writev() under
+ * the data file mutex, or through the writer thread when it is enabled.
+ */
+static void uring_flush(struct uring_loop *loop) {
+    struct uring_conn *c, *next, *batch = loop->batch_head;
+    if(batch == NULL) return;
+    loop->batch_head = NULL;
+    loop->batch_tail = &loop->batch_head;
+
+    if(writer_enabled()) {
+        for(c = batch; c != NULL; c = next) {
+            next = c->next;
+            c->req.done = uring_appended;
+            loop->inflight++;
+            writer_submit(&c->req);
+        }
+        return;
+    }
+
+    for(c = batch; c != NULL; c = c->next) {
+        c->req.done = uring_written;
+        c->req.next = c->next ? &c->next->req : NULL;
+    }
+    stats_lock(loop->dfdmutex);
+    writer_flush(loop->dfd, &batch->req);
+    pthread_mutex_unlock(loop->dfdmutex);
+    for(c = batch; c != NULL; c = next) {
+        next = c->next;
+        uring_afterappend(loop, c);
+    }
+}
+
+/* Called by writer_flush() on the loop thread itself; nothing to hand over. */
+static void uring_written(struct writer_req *req) {
+}
+
+/* Called on the writer thread when c->req is in the data file. Hands the
+ * connection back to its loop.
+ */
+static void uring_appended(struct writer_req *req) {
+    struct uring_conn *c = req->arg;
+    struct uring_loop *loop = c->loop;
+    bool wake;
+    pthread_mutex_lock(&loop->done_mutex);
+    c->next = loop->done_head;
+    loop->done_head = c;
+    wake = (c->next == NULL);
+    pthread_mutex_unlock(&loop->done_mutex);
+    if(wake) {
+        uint64_t one = 1;
+        if(write(loop->wakefd, &one, sizeof(one)) == -1)
+            log_errno("uring_appended(): eventfd write()");
+    }
+}
+
+static void uring_completions(struct uring_loop *loop) {
+    struct uring_conn *c, *next;
+    pthread_mutex_lock(&loop->done_mutex);
+    c = loop->done_head;
+    loop->done_head = NULL;
+    pthread_mutex_unlock(&loop->done_mutex);
+
+    for(; c != NULL; c = next) {
+        next = c->next;
+        loop->inflight--;
+        uring_afterappend(loop, c);
+    }
+
+    for(;;) {
+        pthread_mutex_lock(&loop->done_mutex);
+        c = LIST_FIRST(&loop->tail_ready);
+        if(c != NULL) {
+            LIST_REMOVE(c, tail_nodes);
+            c->tail_ready = false;
+        }
+        pthread_mutex_unlock(&loop->done_mutex);
+        if(c == NULL) break;
+        if(uring_tail(loop, c))
+            uring_drop(loop, c);
+    }
+}
+
+/* Starts the replay that follows an append (subscribers go on with the next
+ * packet instead), or closes the connection.
+ */
+static void uring_afterappend(struct uring_loop *loop, struct uring_conn *c) {
+    int r;
+    c->state = CONN_REPLAYING;
+    if(c->req.ret == -1) {
+        errno = c->req.err;
+        log_errno("uring_afterappend(): data write()");
+        uring_drop(loop, c);
+        return;
+    }
+    if(c->closing || loop->stopping) {
+        uring_drop(loop, c);
+        return;
+    }
+    if(c->subscribed) {
+        packet_consume(&c->in, c->pktlen);
+        r = uring_process(loop, c);
+    }
+    else {
+        proto_rewind(&c->replay, &c->cmd, loop->dfd);
+        r = uring_replay(loop, c);
+    }
+    if(r)
+        uring_drop(loop, c);
+}
+
+static int uring_recv(struct uring_loop *loop, struct uring_conn *c) {
+    size_t avail;
+    char *space = packet_space(&c->in, &avail);
+    if(space == NULL) {
+        log_errno("uring_recv(): packet_space()");
+        return -1;
+    }
+    if(avail > INT32_MAX) avail = INT32_MAX;
+    if(uring_queue(loop, IORING_OP_RECV, c->rsfd, space, avail,
+                   c, URING_OP_RECV))
+        return -1;
+    c->busy = true;
+    return 0;
+}
+
+/* Prepares a submission; it goes to the kernel with the next ring_enter().
+ * @returns 0 on success, -1 on error (errno is set).
+ */
+static int uring_queue(struct uring_loop *loop, uint8_t opcode, int fd,
+                       void *addr, unsigned len, void *ptr, enum uring_op op) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    if(sqe == NULL) return -1;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    switch(opcode) {
+        case IORING_OP_ACCEPT:
+            sqe->accept_flags = SOCK_CLOEXEC;
+            break;
+        case IORING_OP_SEND:
+            sqe->msg_flags = MSG_NOSIGNAL;
+            break;
+        case IORING_OP_POLL_ADD:
+            sqe->poll32_events = POLLIN;
+            break;
+        case IORING_OP_READ:
+            sqe->off = (uint64_t)-1;        // eventfds have no offset
+            break;
+    }
+    sqe->user_data = (uintptr_t)ptr | op;
+    loop->queued++;
+    return 0;
+}
+
+/* Cancels every operation still in the ring. */
+static void uring_cancelall(struct uring_loop *loop) {
+    struct uring_conn *c;
+    uint64_t targets[] = { URING_OP_ACCEPT, URING_OP_WAKE, URING_OP_SHUTDOWN,
+                           (uintptr_t)loop | URING_OP_SHUTDOWN };
+    for(size_t i = 0; i < sizeof(targets)/sizeof(targets[0]); i++) {
+        uring_queue(loop, IORING_OP_ASYNC_CANCEL, -1,
+                    (void *)(uintptr_t)targets[i], 0, NULL, URING_OP_CANCEL);
+    }
+    LIST_FOREACH(c, &loop->conns, nodes) {
+        if(c->tail_busy) {
+            uint64_t target = (uintptr_t)c | URING_OP_TAIL;
+            uring_queue(loop, IORING_OP_ASYNC_CANCEL, -1,
+                        (void *)(uintptr_t)target, 0, NULL, URING_OP_CANCEL);
+            c->closing = true;
+        }
+        if(!c->busy) continue;
+        uint64_t target = (uintptr_t)c |
+                (c->state == CONN_REPLAYING ? URING_OP_SEND : URING_OP_RECV);
+        uring_queue(loop, IORING_OP_ASYNC_CANCEL, -1, (void *)(uintptr_t)target,
+                    0, NULL, URING_OP_CANCEL);
+        c->closing = true;
+    }
+}
+
+/* Closes c, or has it closed when the operations it has in flight come back.
+ * Shutting the socket down makes a recv waiting on an idle client return.
+ */
+static void uring_drop(struct uring_loop *loop, struct uring_conn *c) {
+    if(c->busy || c->tail_busy || c->state == CONN_APPENDING) {
+        if(!c->closing && (c->busy || c->tail_busy))
+            shutdown(c->rsfd, SHUT_RDWR);
+        c->closing = true;
+        return;
+    }
+    uring_close(loop, c);
+}
+
+static void uring_close(struct uring_loop *loop, struct uring_conn *c) {
+    LIST_REMOVE(c, nodes);
+    if(c->subscribed) {
+        tail_unsubscribe(&c->tail);     // no uring_tailready() after this
+        pthread_mutex_lock(&loop->done_mutex);
+        if(c->tail_ready)
+            LIST_REMOVE(c, tail_nodes);
+        pthread_mutex_unlock(&loop->done_mutex);
+    }
+    outq_resume(&c->out);
+    replay_release(&c->replay);
+    closesocket(c->rsfd);
+    packet_free(&c->in);
+    free(c);
+    stats_add(STATS_ACTIVE, -1);
+}
+
+static int ring_setup(struct uring *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(struct uring));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(u->fd == -1) return -1;
+    if((p.features & URING_FEATURES) != URING_FEATURES) {
+        robustclose(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    u->ring = mmap(NULL, u->ring_sz, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->ring == MAP_FAILED) {
+        robustclose(u->fd);
+        return -1;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED) {
+        munmap(u->ring, u->ring_sz);
+        robustclose(u->fd);
+        return -1;
+    }
+
+    char *ring = u->ring;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    // Slot i of the array always points at sqe i
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for(unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    u->sqe_tail = *u->sq_tail;
+    return 0;
+}
+
+static void ring_free(struct uring *u) {
+    munmap(u->sqes, u->sqes_sz);
+    munmap(u->ring, u->ring_sz);
+    robustclose(u->fd);
+}
+
+/* @returns a cleared submission, submitting the queued ones first if the
+ * queue is full, or NULL on error.
+ */
+static struct io_uring_sqe *ring_sqe(struct uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if(u->sqe_tail - head >= u->sq_entries) {
+        if(ring_enter(u, 0) == -1) return NULL;
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if(u->sqe_tail - head >= u->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sqe_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+/* Submits the queued submissions and waits for at least wait_nr completions.
+ * @returns 0 on success, -1 on error (errno is set).
+ */
+static int ring_enter(struct uring *u, unsigned wait_nr) {
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    for(;;) {
+        int n = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait_nr,
+                        wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(n == -1) {
+            if(errno == EINTR) {
+                if(wait_nr) return 0;   // let the caller look at the flags
+                continue;
+            }
+            return -1;
+        }
+        u->to_submit -= n;
+        return 0;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/* @returns true if the kernel has the io_uring features uring_run() needs,
+ * false with errno set when it doesn't (too old, or disabled with
+ * kernel.io_uring_disabled); the server then falls back to the epoll mode.
+ */
+bool uring_supported(void);
+
+/* Runs the io_uring server mode: nloops threads, each with its own ring,
+ * share the listening socket sfd. Accepts, receives and replay sends go
+ * through the rings, and the packets completed in one round are appended
+ * with a single writev(). Returns when flag_accepting_connections goes false
+ * and all the loops have exited.
+ * @param sfd is the bound and listening socket.
+ * @param dfdmutex is the mutex protecting writes to the data file.
+ * @param nloops is the number of ring threads to start.
+ * @returns 0 on success, -1 on error (errno is set).
+ */
+int uring_run(int sfd, pthread_mutex_t *dfdmutex, int nloops);
+
+#endif /* URING_H */
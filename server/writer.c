@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+#include "writer.h"
+#include "cache.h"
+#include "tail.h"
+#include "pktidx.h"
+#include "alog.h"
+
+#define WRITER_IOV_MAX      IOV_MAX     // requests per writev()
+
+/* Comments:
+ *  Connection handlers don't write the data file themselves. They push their
+ *  completed packets on a lock-free stack (a compare-and-swap on head) and a
+ *  single writer thread takes the whole stack at once, puts it back in
+ *  arrival order and appends it with one writev() per WRITER_IOV_MAX
+ *  packets. The writer is the only thread appending, so it needs no lock and
+ *  there is nothing for the handlers to queue up on, and a burst of N packets
+ *  costs one syscall instead of N.
+ *
+ *  With -f batch (or packet) the durability is settled here too: once the
+ *  writev() of a batch is done, one datasync() flushes all of it, and only
+ *  then are the requests completed. Every packet that arrived together is
+ *  on the disk before any of them is acknowledged, and they share the cost
+ *  of the fdatasync(). -f packet gives each request a batch of its own.
+ *
+ *  The writer is only woken (sem_post) when a producer finds the stack empty.
+ *  While it is busy with a batch, new packets pile up for the next one. It
+ *  sleeps on the semaphore without a timeout; writer_stop() posts it too.
+ */
+
+static struct {
+    bool enabled;
+    volatile bool running;
+    int dfd;
+    pthread_t thread;
+    sem_t wake;
+    _Atomic(struct writer_req *) head;  // Newest request first
+} writer = {
+    .enabled = false,
+    .dfd = -1,
+    .head = NULL
+};
+
+static void *writer_thread(void *thread_param);
+static void writer_wakeup(struct writer_req *req);
+
+int writer_start(void) {
+    int r;
+    writer.dfd = opendatafile();
+    if(writer.dfd == -1) return -1;
+    sem_init(&writer.wake, 0, 0);
+    writer.running = true;
+    r = pthread_create(&writer.thread, NULL, writer_thread, NULL);
+    if(r) {
+        errno = r;
+        sem_destroy(&writer.wake);
+        robustclose(writer.dfd);
+        return -1;
+    }
+    writer.enabled = true;
+    return 0;
+}
+
+void writer_stop(void) {
+    if(!writer.enabled) return;
+    writer.running = false;
+    sem_post(&writer.wake);
+    pthread_join(writer.thread, NULL);
+    writer.enabled = false;
+    sem_destroy(&writer.wake);
+    alog(LOG_DEBUG, "closing data file %s", datapath);
+    robustclose(writer.dfd);
+}
+
+bool writer_enabled(void) {
+    return writer.enabled;
+}
+
+void writer_submit(struct writer_req *req) {
+    struct writer_req *head = atomic_load(&writer.head);
+    do {
+        req->next = head;
+    } while(!atomic_compare_exchange_weak(&writer.head, &head, req));
+    if(head == NULL)
+        sem_post(&writer.wake);
+}
+
+ssize_t writer_append(const void *buf, size_t len) {
+    struct writer_req req = {
+        .buf = buf,
+        .len = len,
+        .done = writer_wakeup
+    };
+    sem_init(&req.sem, 0, 0);
+    writer_submit(&req);
+    while(sem_wait(&req.sem) == -1 && errno == EINTR);
+    sem_destroy(&req.sem);
+    if(req.ret == -1) errno = req.err;
+    return req.ret;
+}
+
+static void writer_wakeup(struct writer_req *req) {
+    sem_post(&req->sem);
+}
+
+static void *writer_thread(void *thread_param) {
+    for(;;) {
+        struct writer_req *batch = atomic_exchange(&writer.head, NULL);
+        if(batch == NULL) {
+            if(!writer.running) break;
+            while(sem_wait(&writer.wake) == -1 && errno == EINTR);
+            continue;
+        }
+
+        // The stack is newest first; reverse it into arrival order.
+        struct writer_req *fifo = NULL;
+        while(batch) {
+            struct writer_req *next = batch->next;
+            batch->next = fifo;
+            fifo = batch;
+            batch = next;
+        }
+        writer_flush(writer.dfd, fifo);
+    }
+    return thread_param;
+}
+
+void writer_flush(int dfd, struct writer_req *fifo) {
+    struct iovec iov[WRITER_IOV_MAX];
+    int maxcnt = (aesd_opts.durability == DURABILITY_PACKET) ? 1
+                                                             : WRITER_IOV_MAX;
+
+    while(fifo) {
+        struct writer_req *first = fifo, *req;
+        int cnt = 0;
+        for(req = first; req != NULL && cnt < maxcnt; req = req->next) {
+            iov[cnt].iov_base = (void *)req->buf;
+            iov[cnt].iov_len = req->len;
+            req->ret = 0;
+            cnt++;
+        }
+        fifo = req;     // first request of the next writev()
+
+        struct iovec *v = iov;
+        int vcnt = cnt;
+        int err = 0;
+        req = first;
+        for(;;) {
+            while(vcnt > 0 && v->iov_len == 0) {
+                v++;
+                vcnt--;
+                req = req->next;
+            }
+            if(vcnt == 0) break;
+            ssize_t wc = datawritev(dfd, v, vcnt);
+            if(wc == -1) {
+                if(errno == EINTR) continue;
+                err = errno;
+                log_errno("writer_flush(): writev()");
+                break;
+            }
+            // Credit the bytes to the requests, which may end mid-request
+            while(wc > 0) {
+                size_t n = v->iov_len < (size_t)wc ? v->iov_len : (size_t)wc;
+                req->ret += n;
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= n;
+                wc -= n;
+                if(v->iov_len == 0) {
+                    v++;
+                    vcnt--;
+                    req = req->next;
+                }
+            }
+        }
+        int syncerr = 0;
+        if(!err && aesd_opts.durability >= DURABILITY_BATCH && datasync())
+            syncerr = errno;    // appended, but not known to be on the disk
+
+        for(req = first; req != fifo; ) {
+            struct writer_req *next = req->next;
+            if(req->ret > 0) {
+                cache_append(req->buf, req->ret);
+                tail_append(req->buf, req->ret);
+                pktidx_append(req->ret);
+            }
+            if(err && (size_t)req->ret < req->len) {
+                req->ret = -1;
+                req->err = err;
+            }
+            else if(syncerr) {
+                req->ret = -1;
+                req->err = syncerr;
+            }
+            req->done(req);     // req may be gone after this
+            req = next;
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <semaphore.h>
+#include <sys/types.h>
+
+/* One append handed to the writer thread. buf must stay valid until done()
+ * is called (or writer_append() returns).
+ */
+struct writer_req {
+    struct writer_req *next;        // Queue link, owned by the writer
+    const void *buf;
+    size_t len;
+    ssize_t ret;                    // Bytes written, or -1 (errno in err)
+    int err;
+    void (*done)(struct writer_req *req);   // Runs on the writer thread
+    void *arg;                      // For done()
+    sem_t sem;                      // Used by writer_append()
+};
+
+/* Starts the writer thread. From then on every append to the data file must
+ * go through writer_submit() or writer_append().
+ * @returns 0 on success, -1 on error.
+ */
+int writer_start(void);
+
+/* Writes what is still queued and stops the writer thread. */
+void writer_stop(void);
+
+bool writer_enabled(void);
+
+/* Queues req without blocking. req->done(req) is called from the writer
+ * thread once the bytes are in the data file and in the replay cache.
+ */
+void writer_submit(struct writer_req *req);
+
+/* Queues len bytes of buf and waits until they are written.
+ * @returns the number of bytes written, or -1 on error (errno is set).
+ */
+ssize_t writer_append(const void *buf, size_t len);
+
+/* Appends the requests in fifo (linked by next, oldest first) to dfd with as
+ * few writev() calls as possible, flushes them with -f batch and packet,
+ * then updates the replay cache and calls done() for every request, in
+ * order. The caller must be the only thread
+ * appending: the writer thread, or a thread holding the data file mutex.
+ */
+void writer_flush(int dfd, struct writer_req *fifo);
+
+#endif /* WRITER_H */